@@ -13,13 +13,50 @@
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
+ #include <stdarg.h>
+ #include <strings.h>
  #include <time.h>
+ #include <stddef.h>
+ #include <math.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <pthread.h>
+ #include <sched.h>
+ #include <errno.h>
+ #include <signal.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include <sys/epoll.h>
  
- #define MAX_CUSTOMERS 100
- #define MAX_HISTORY 12
+ #define CUSTOMER_CHUNK_SIZE 1024
+ #define MAX_CUSTOMER_CHUNKS 65536 // up to 64M customers
+ #define BILL_CHUNK_SIZE 4096
+ #define MAX_BILL_CHUNKS 65536     // up to 256M bills
+ #define MAX_HISTORY 12            // most recent bills used for trend analysis
  #define MAX_NAME_LENGTH 50
  #define MAX_ADDRESS_LENGTH 100
  #define FILENAME "customer_data.bin"
+ #define LOG_FILENAME "customer_data.wal"
+ #define DB_FILENAME "customer_data.db"
+ #define INDEX_FILENAME "customer_data.idx"
+ #define ROLLUP_FILENAME "customer_data.rup"
+ #define RATE_PLAN_FILENAME "rate_plans.txt"
+ #define DATA_MAGIC 0x31534245     // "EBS1"
+ #define LOG_MAGIC 0x31574245      // "EBW1"
+ #define DB_MAGIC 0x314D4245       // "EBM1"
+ #define INDEX_MAGIC 0x31494245    // "EBI1"
+ #define ROLLUP_MAGIC 0x32524245   // "EBR2"
+ #define DATA_VERSION 6           // 2: customers carry a rate plan, 3: amounts in cents, 4: bill dates as day numbers, 5: columnar snapshot, 6: part payments
+ #define RAW_DATA_VERSION 4       // last snapshot version holding raw records
+ #define CHECKPOINT_INTERVAL 1000  // log records between snapshots
+ #define REPORT_BLOCK_ROWS (BILL_CHUNK_SIZE * 16) // ledger rows per report work unit
+ #define MAX_REPORT_THREADS 64
+ #define MAX_ROLLUP_MONTHS 600     // 50 years of monthly roll-ups
+ #define FIRST_CUSTOMER_ID 1001
+ #define FIRST_BILL_ID 100001
+ #define CUSTOMER_SHARDS 256       // lock shards, a power of two
  
  typedef enum {
      RESIDENTIAL,
@@ -33,11 +70,22 @@
      int year;
  } Date;
  
+ // Bill dates are stored as day numbers: days since 1 January 1970. Day 0
+ // stands for no date, as on an unpaid bill. Due dates are a plain addition
+ // and a month is the range of day numbers between two month starts.
+ typedef int DayNumber;
+ #define NO_DATE 0
+ 
  typedef struct {
      float peak_hours;      // 2pm-8pm (higher rate)
      float off_peak_hours;  // 8pm-2pm (lower rate)
  } TimeOfUseUsage;
  
+ // Money is held as a whole number of minor units (cents), so sums are exact
+ // and do not depend on the order bills are added in
+ typedef long long Money;
+ #define MONEY_SCALE 100
+ 
  typedef struct {
      int bill_id;
      Date bill_date;
@@ -46,12 +94,28 @@
      float meter_reading_end;
      float total_usage;
      TimeOfUseUsage tou_usage;
-     float amount;
+     Money amount;
      int is_paid;
      Date payment_date;
      char payment_method[20];
  } BillingInfo;
  
+ // Bill layout used before amounts were held in cents, kept to read old data
+ // files and logs
+ typedef struct {
+     int bill_id;
+     Date bill_date;
+     Date due_date;
+     float meter_reading_start;
+     float meter_reading_end;
+     float total_usage;
+     TimeOfUseUsage tou_usage;
+     float amount;
+     int is_paid;
+     Date payment_date;
+     char payment_method[20];
+ } LegacyBillingInfo;
+ 
  typedef struct {
      int customer_id;
      char name[MAX_NAME_LENGTH];
@@ -60,17 +124,320 @@
      char email[50];
      CustomerType type;
      char meter_number[20];
-     BillingInfo billing_history[MAX_HISTORY];
      int bill_count;
+     int last_bill;         // ledger row of the newest bill, -1 if none
      Date connection_date;
      int is_active;
+     char rate_plan[20];    // empty for the default plan of the customer's type
  } Customer;
  
+ // Version 1 customer records end where the rate plan starts
+ #define CUSTOMER_V1_SIZE offsetof(Customer, rate_plan)
+ 
+ // Bills are kept in an append-only ledger, stored column by column in
+ // fixed-size chunks. Each bill links back to the same customer's previous
+ // bill, so a customer's history is reached from Customer.last_bill.
+ typedef struct {
+     int bill_id[BILL_CHUNK_SIZE];
+     int customer_index[BILL_CHUNK_SIZE];
+     int prev_bill[BILL_CHUNK_SIZE];
+     DayNumber bill_date[BILL_CHUNK_SIZE];
+     DayNumber due_date[BILL_CHUNK_SIZE];
+     float meter_reading_start[BILL_CHUNK_SIZE];
+     float meter_reading_end[BILL_CHUNK_SIZE];
+     float total_usage[BILL_CHUNK_SIZE];
+     float peak_hours[BILL_CHUNK_SIZE];
+     float off_peak_hours[BILL_CHUNK_SIZE];
+     Money amount[BILL_CHUNK_SIZE];
+     Money amount_received[BILL_CHUNK_SIZE]; // part payments while the bill is open
+     int is_paid[BILL_CHUNK_SIZE];
+     DayNumber payment_date[BILL_CHUNK_SIZE];
+     char payment_method[BILL_CHUNK_SIZE][20];
+ } BillChunk;
+ 
+ // Column layout of BillChunk, used to read and write the ledger
+ typedef struct {
+     size_t offset;
+     size_t size;
+ } LedgerColumn;
+ 
+ static const LedgerColumn ledger_columns[] = {
+     {offsetof(BillChunk, bill_id), sizeof(int)},
+     {offsetof(BillChunk, customer_index), sizeof(int)},
+     {offsetof(BillChunk, prev_bill), sizeof(int)},
+     {offsetof(BillChunk, bill_date), sizeof(DayNumber)},
+     {offsetof(BillChunk, due_date), sizeof(DayNumber)},
+     {offsetof(BillChunk, meter_reading_start), sizeof(float)},
+     {offsetof(BillChunk, meter_reading_end), sizeof(float)},
+     {offsetof(BillChunk, total_usage), sizeof(float)},
+     {offsetof(BillChunk, peak_hours), sizeof(float)},
+     {offsetof(BillChunk, off_peak_hours), sizeof(float)},
+     {offsetof(BillChunk, amount), sizeof(Money)},
+     {offsetof(BillChunk, amount_received), sizeof(Money)},
+     {offsetof(BillChunk, is_paid), sizeof(int)},
+     {offsetof(BillChunk, payment_date), sizeof(DayNumber)},
+     {offsetof(BillChunk, payment_method), 20}
+ };
+ 
+ #define LEDGER_COLUMN_COUNT (int)(sizeof(ledger_columns) / sizeof(ledger_columns[0]))
+ 
+ // Columnar snapshots (version 5) store each field of the customers and the
+ // ledger as its own segment: a byte count followed by the encoded values.
+ // Integers are varints, signed ones zigzag-encoded and mostly stored as the
+ // difference from a predicted value, text is a heap of length-prefixed
+ // strings, and fields that follow from earlier ones are left out.
+ typedef struct {
+     unsigned char *data;
+     size_t size;
+     size_t capacity;
+     int failed;                // set when growing the buffer failed
+ } ByteBuffer;
+ 
+ typedef struct {
+     const unsigned char *data;
+     size_t size;
+     size_t pos;
+     int failed;                // set when a value runs past the end
+ } ByteReader;
+ 
+ // Text fields of a customer, each stored as a segment of strings
+ typedef struct {
+     size_t offset;
+     size_t capacity;
+ } TextColumn;
+ 
+ static const TextColumn customer_text_columns[] = {
+     {offsetof(Customer, name), MAX_NAME_LENGTH},
+     {offsetof(Customer, address), MAX_ADDRESS_LENGTH},
+     {offsetof(Customer, phone), 15},
+     {offsetof(Customer, email), 50},
+     {offsetof(Customer, meter_number), 20},
+     {offsetof(Customer, rate_plan), 20}
+ };
+ 
+ #define CUSTOMER_TEXT_COLUMN_COUNT (int)(sizeof(customer_text_columns) / sizeof(customer_text_columns[0]))
+ 
+ // Per-bill flags in the meter segment; a reading or usage that does not
+ // follow from the others is stored in full after the flags
+ #define BILL_START_FOLLOWS 1      // start reading is the previous bill's end reading
+ #define BILL_USAGE_FOLLOWS 2      // usage is end minus start reading
+ #define BILL_PAID 4
+ #define MAX_METHOD_CODES 64       // payment methods given a code per snapshot
+ 
+ // Customer record layout used before the bill ledger, kept to read old data files
+ typedef struct {
+     int customer_id;
+     char name[MAX_NAME_LENGTH];
+     char address[MAX_ADDRESS_LENGTH];
+     char phone[15];
+     char email[50];
+     CustomerType type;
+     char meter_number[20];
+     LegacyBillingInfo billing_history[MAX_HISTORY];
+     int bill_count;
+     Date connection_date;
+     int is_active;
+ } LegacyCustomer;
+ 
+ // Write-ahead log record types. Each record carries the full new state of
+ // one customer or one ledger row; replaying a record for the next unused
+ // index appends it, otherwise it overwrites the existing entry.
+ typedef enum {
+     LOG_CUSTOMER = 1,
+     LOG_BILL = 2
+ } LogRecordType;
+ 
+ typedef struct {
+     int type;
+     int index;             // customer index or ledger row
+     int size;              // payload bytes following the header
+     unsigned int checksum; // FNV-1a of the payload
+ } LogRecordHeader;
+ 
+ typedef struct {
+     int customer_index;
+     BillingInfo bill;
+     Money amount_received;
+ } LoggedBill;
+ 
+ // Bill records logged before version 6 end where the part payments start
+ #define LOGGED_BILL_V5_SIZE offsetof(LoggedBill, amount_received)
+ 
+ typedef struct {
+     int customer_index;
+     LegacyBillingInfo bill;
+ } LegacyLoggedBill;
+ 
+ typedef enum {
+     STORAGE_FILE,  // snapshot + write-ahead log, loaded into memory
+     STORAGE_MMAP   // database file mapped and used in place
+ } StorageMode;
+ 
+ // When a change written to the log is made durable (file mode)
+ typedef enum {
+     COMMIT_SYNC,   // written and synced before the change returns
+     COMMIT_GROUP,  // queued; a writer thread syncs queued changes in batches
+     COMMIT_WAIT    // queued, and the change waits for its batch to be synced
+ } CommitMode;
+ 
+ // Header at the start of the memory-mapped database. Chunks are laid out in
+ // the file in the order they were allocated, each starting on a page
+ // boundary, and the header records where every chunk lives.
+ typedef struct {
+     int magic;
+     int version;
+     int customer_size;        // sizeof(Customer) the file was created with
+     int bill_chunk_size;      // sizeof(BillChunk) the file was created with
+     int customer_count;
+     int ledger_count;
+     long long file_size;
+     long long customer_chunk_offsets[MAX_CUSTOMER_CHUNKS];
+     long long bill_chunk_offsets[MAX_BILL_CHUNKS];
+     int bill_id_offset;       // 0 in files from before it was kept here
+ } MappedHeader;
+ 
+ // Header of the memory-mapped meter index file; the slots follow it
+ typedef struct {
+     int magic;
+     int capacity;
+     int size;
+     int customer_count;       // customers indexed when last flushed
+ } MappedIndexHeader;
+ 
  // Global variables
- Customer customers[MAX_CUSTOMERS];
+ // Customers live in fixed-size chunks allocated on demand, so a customer's
+ // address never changes as the store grows.
+ Customer *customer_chunks[MAX_CUSTOMER_CHUNKS];
  int customer_count = 0;
  
- // Rate structure
+ BillChunk *bill_chunks[MAX_BILL_CHUNKS];
+ int ledger_count = 0;
+ 
+ // A new bill's ID is its ledger row plus this offset, so IDs never repeat
+ // and a bill is found from its ID directly. The offset is set when data is
+ // loaded, to give new bills IDs above every stored one, and stays fixed
+ // from then on. Bills stored before IDs worked this way keep the IDs they
+ // were given: their customer's ID times 100 plus their number.
+ int bill_id_offset = FIRST_BILL_ID;
+ 
+ // Persistence: a snapshot file plus a log of changes made since it was written
+ const char *data_filename = FILENAME;
+ const char *log_filename = LOG_FILENAME;
+ const char *report_filename = NULL; // NULL for report_DD_MM_YYYY.txt
+ FILE *log_file = NULL;
+ int log_records = 0;       // records appended since the last checkpoint
+ 
+ StorageMode storage_mode = STORAGE_FILE;
+ int mapped_read_only = 0;  // the command only reads the mapped database
+ int db_fd = -1;
+ MappedHeader *db_header = NULL;          // mmap mode only
+ MappedIndexHeader *index_header = NULL;  // mmap mode only
+ 
+ // Meter number index: open addressing with linear probing.
+ // Each slot holds a customer index, or -1 when empty.
+ int *meter_index = NULL;
+ int meter_index_capacity = 0; // always a power of two
+ int meter_index_size = 0;
+ unsigned int meter_index_sequence = 0; // odd while the index is being changed
+ 
+ // Slots the meter index outgrew. A lookup running without a lock may still be
+ // probing one, so they are only released when the index is rebuilt. Each is
+ // half the size of the next, so together they are no larger than the index.
+ typedef struct {
+     int *slots;
+     int capacity;
+     StorageMode mode;    // the mode they were allocated in
+ } RetiredSlots;
+ 
+ RetiredSlots retired_meter_slots[32]; // one per doubling
+ int retired_meter_count = 0;
+ 
+ // Concurrent access. Each customer belongs to one shard. Writers hold the
+ // shard's lock while changing one of its customers or their bills, and bump
+ // its sequence number before and after, so readers can copy a customer
+ // without locking: a copy that overlapped a change is simply taken again.
+ // The structures all customers share each have a lock of their own, taken
+ // after the shard's and held only while they are updated.
+ typedef struct {
+     pthread_mutex_t lock;
+     unsigned int sequence; // odd while a writer is changing the shard
+ } __attribute__((aligned(64))) CustomerShard;
+ 
+ CustomerShard customer_shards[CUSTOMER_SHARDS] = {[0 ... CUSTOMER_SHARDS - 1] = {PTHREAD_MUTEX_INITIALIZER, 0}};
+ pthread_mutex_t customer_add_lock = PTHREAD_MUTEX_INITIALIZER; // new customers and the customer indexes
+ pthread_mutex_t allocation_lock = PTHREAD_MUTEX_INITIALIZER;   // ledger rows and storage chunks
+ pthread_mutex_t rollup_lock = PTHREAD_MUTEX_INITIALIZER;
+ pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+ pthread_mutex_t new_bill_lock = PTHREAD_MUTEX_INITIALIZER;     // new bills reach the log in row order
+ __thread int in_store_operation = 0; // checkpoints wait until the operation ends
+ 
+ // Group commit. Log records queue up in memory under log_lock while a writer
+ // thread appends the previous batch, so one fsync covers every change made
+ // during the last one.
+ CommitMode commit_mode = COMMIT_SYNC;
+ ByteBuffer log_queue = {NULL, 0, 0, 0};
+ long long log_queued = 0;      // records queued since the program started
+ long long log_committed = 0;   // of those, records written and synced
+ long long log_syncs = 0;       // fsync calls made on the log
+ int log_writer_running = 0;
+ pthread_t log_writer;
+ pthread_cond_t log_queue_filled = PTHREAD_COND_INITIALIZER;
+ pthread_cond_t log_batch_committed = PTHREAD_COND_INITIALIZER;
+ __thread long long last_queued_record = 0; // this thread's latest record
+ 
+ // Customer ID index. IDs are handed out in order from FIRST_CUSTOMER_ID, so
+ // most are direct-addressed: id_index[id - FIRST_CUSTOMER_ID] holds the
+ // customer index, or -1. IDs outside that range, or too far past the last
+ // customer to keep the table dense, go into a small hash table instead.
+ // Built by loadData() in file mode, and on the first ID lookup in mmap mode
+ // so startup does not touch every customer record.
+ typedef struct {
+     int customer_id;
+     int customer_index;    // -1 for an empty slot
+ } IdSlot;
+ 
+ int *id_index = NULL;
+ int id_index_capacity = 0;
+ IdSlot *sparse_id_index = NULL; // open addressing, power-of-two capacity
+ int sparse_id_capacity = 0;
+ int sparse_id_size = 0;
+ int id_index_built = 0;
+ 
+ // Substring search index over customer name, meter number and phone. Each
+ // trigram (three consecutive characters) of a field maps to the ascending
+ // list of customers whose field contains it, so a search only checks the
+ // customers that contain every trigram of the search term. It is built on
+ // the first search and kept up to date from then on.
+ typedef enum {
+     SEARCH_NAME,
+     SEARCH_METER_NUMBER,
+     SEARCH_PHONE
+ } SearchField;
+ 
+ typedef struct {
+     unsigned int key;     // field and trigram, 0 for an empty slot
+     int count;
+     int capacity;
+     int *customers;
+ } TrigramPostings;
+ 
+ TrigramPostings *trigram_table = NULL; // open addressing, power-of-two capacity
+ int trigram_capacity = 0;
+ int trigram_count = 0;
+ int search_index_built = 0;
+ 
+ int report_threads = 0;    // report worker threads, 0 for one per online CPU
+ 
+ // Cached clock, see getToday(). The day and its bounds change together
+ // under clock_lock.
+ pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+ DayNumber clock_today = NO_DATE;
+ time_t clock_day_start = 0;
+ time_t clock_day_end = 0;
+ int clock_pinned = 0;
+ 
+ // Built-in rates, used for the default plan of each customer type unless
+ // the rate plan file defines a plan of the same name
  typedef struct {
      CustomerType type;
      float base_charge;
@@ -88,40 +455,660 @@
      {INDUSTRIAL, 200.0, 6.5, 10.0, 15.0, 18.0, 9.0, 0.09}
  };
  
+ // Rate plans, compiled when loaded. Tier k covers usage from tier_start[k] up
+ // to the next tier's start and tier_cost[k] is the cost of all usage below
+ // it, so a bill is rated by finding its tier and one multiply. Unused tiers
+ // start at infinity, so the tier search always takes the same steps.
+ #define MAX_RATE_PLANS 32
+ #define MAX_RATE_TIERS 16         // a power of two
+ 
+ typedef struct {
+     char name[20];
+     double base_charge;
+     double peak_rate;
+     double off_peak_rate;
+     double tax_rate;
+     int tier_count;
+     double tier_start[MAX_RATE_TIERS];
+     double tier_rate[MAX_RATE_TIERS];
+     double tier_cost[MAX_RATE_TIERS];
+ } RatePlan;
+ 
+ RatePlan rate_plans[MAX_RATE_PLANS];
+ int rate_plan_count = 0;
+ 
+ // Batch rating works on four bills at a time using the compiler's vector
+ // extensions, which map onto SSE/NEON registers
+ #define TARIFF_LANES 4
+ #define BILL_RUN_BATCH 1024       // bills rated together by the batch bill run
+ #define SUITE_RESULTS_FILENAME "bench_results.csv"
+ #define SERVER_MAX_EVENTS 64      // connections handled per wake-up
+ #define SERVER_REQUEST_MAX 1024   // longest request line a client may send
+ #define SERVER_OUTPUT_MAX (1 << 20) // queued response bytes before a client's requests wait
+ #define SERVER_DATE_SIZE 11       // YYYY-MM-DD
+ #define IMPORT_MAX_FIELDS 7       // name, address, phone, email, type, meter number, rate plan
+ #define RECONCILE_MAX_FIELDS 4    // bill ID or meter number, amount, payment date, payment method
+ #define RECONCILE_EXCEPTIONS_FILENAME "payment_exceptions.csv"
+ 
+ typedef float FloatLanes __attribute__((vector_size(TARIFF_LANES * sizeof(float))));
+ typedef double DoubleLanes __attribute__((vector_size(TARIFF_LANES * sizeof(double))));
+ typedef long long MoneyLanes __attribute__((vector_size(TARIFF_LANES * sizeof(Money))));
+ 
+ // Report section accumulators
+ #define MAX_PAYMENT_METHODS 10
+ #define REPORT_TOP_CONSUMERS 5
+ 
+ typedef struct {
+     int customer_index;
+     float usage;
+     Money amount;
+ } ConsumerRanking;
+ 
+ typedef enum {
+     RANK_BY_USAGE,
+     RANK_BY_AMOUNT
+ } RankingKey;
+ 
+ // The K highest-ranked consumers offered so far. While offers are being made
+ // the entries form a min-heap with the lowest-ranked entry at the root;
+ // finishTopConsumers() sorts them best first.
+ typedef struct {
+     ConsumerRanking *entries;
+     int capacity;              // K
+     int count;
+     RankingKey key;
+ } TopConsumers;
+ 
+ // Streaming top consumers in fixed memory (the Space-Saving algorithm).
+ // Usage can be added for a customer any number of times. Once all counters
+ // are taken, a new customer replaces the lowest-ranked one and inherits its
+ // total as an overestimate. Any customer whose true total exceeds the sum
+ // of all weights divided by the capacity is guaranteed to be monitored.
+ typedef struct {
+     ConsumerRanking ranking;
+     double error;              // how much the ranking key may be overestimated
+     int heap_position;
+ } MonitoredConsumer;
+ 
+ typedef struct {
+     MonitoredConsumer *entries;
+     int *heap;                 // entry numbers, lowest-ranked at the root
+     int *slots;                // customer index -> entry number, -1 when empty
+     int slot_capacity;         // always a power of two
+     int capacity;
+     int count;
+     RankingKey key;
+ } ApproxTopConsumers;
+ 
+ typedef struct {
+     char method[20];
+     int count;
+     Money amount;
+ } PaymentMethodStats;
+ 
+ // Everything the monthly report prints. Also used for the partial totals of
+ // one block of ledger rows while the report is being aggregated.
+ typedef struct {
+     int active_customers;
+     int customers_by_type[3];
+     int bills_generated;
+     int bills_paid;
+     Money total_billed_amount;
+     Money total_collected_amount;
+     Money total_outstanding_amount;
+     Money amount_by_type[3];
+     double total_usage;
+     double usage_by_type[3];
+     double peak_usage;
+     double off_peak_usage;
+     TopConsumers top_consumers;    // by usage this month, best first once aggregated
+     PaymentMethodStats payment_stats[MAX_PAYMENT_METHODS];
+     int payment_methods_count;
+ } ReportTotals;
+ 
+ // Report totals for one month, kept up to date as bills are generated and
+ // paid so the monthly report never has to scan the ledger. Bill counts and
+ // sums cover bills dated in the month; payment methods cover bills paid in it.
+ typedef struct {
+     int year;
+     int month;
+     int bills_generated;
+     int bills_paid;
+     Money total_billed_amount;
+     Money total_collected_amount;
+     Money total_outstanding_amount;
+     Money amount_by_type[3];
+     double total_usage;
+     double usage_by_type[3];
+     double peak_usage;
+     double off_peak_usage;
+     PaymentMethodStats payment_stats[MAX_PAYMENT_METHODS];
+     int payment_methods_count;
+     ConsumerRanking top_consumers[REPORT_TOP_CONSUMERS]; // by usage, best first
+     int top_consumer_count;
+ } MonthRollup;
+ 
+ typedef struct {
+     MonthRollup *months;       // MAX_ROLLUP_MONTHS entries, the first count in use
+     int count;                 // sorted by year and month
+ } RollupTable;
+ 
+ // Header of the memory-mapped roll-up file; the months follow it
+ typedef struct {
+     int magic;
+     int month_size;            // sizeof(MonthRollup) the file was created with
+     int month_count;
+     int ledger_count;          // bills covered when last saved
+     int clean;                 // 1 only after a save on exit; 0 while in use
+ } RollupHeader;
+ 
+ RollupTable rollup_table = {NULL, 0};
+ RollupHeader *rollup_header = NULL;      // mmap mode only
+ 
+ // Exports stream one record per line into a large buffer that is written
+ // out whenever it fills, and format numbers themselves rather than through
+ // printf, so export speed is bound by the disk
+ #define EXPORT_BUFFER_SIZE (1 << 20)
+ #define EXPORT_RECORD_MAX 4096    // longest record any dataset can produce
+ #define EXPORT_DATE_CACHE 8       // formatted dates kept, a power of two
+ 
+ typedef enum {
+     EXPORT_CUSTOMERS,
+     EXPORT_BILLS,
+     EXPORT_PAYMENTS,
+     EXPORT_REPORT      // one record per month of roll-ups
+ } ExportDataset;
+ 
+ typedef enum {
+     EXPORT_CSV,
+     EXPORT_JSONL       // one JSON object per line
+ } ExportFormat;
+ 
+ typedef struct {
+     int fd;
+     ExportFormat format;
+     const char *const *fields; // field names of the dataset, in record order
+     int field;                 // next field of the current record
+     char *buffer;
+     size_t used;
+     long long bytes;           // written to the file so far
+     int failed;
+     DayNumber cached_days[EXPORT_DATE_CACHE];
+     char cached_dates[EXPORT_DATE_CACHE][10];
+ } ExportWriter;
+ 
+ // The energy usage alert for a customer's latest bill
+ typedef struct {
+     float last_usage;
+     float average_usage;
+     int has_change;        // more than one bill, so monthly_change is set
+     float monthly_change;  // percent change from the previous bill
+     int level;             // 1 well above the average, -1 well below, 0 normal
+     float peak_percentage; // share of the latest bill's usage in peak hours
+ } UsageAlert;
+ 
+ // Operation stats: a call count and a latency histogram per hot operation,
+ // shown by menu option 15 and by --stats at exit. Build with -DBILL_NO_STATS
+ // to compile them out entirely.
+ #ifndef BILL_NO_STATS
+ #define BILL_STATS
+ #endif
+ 
+ #define MENU_ITEMS 15             // menu options 1 to MENU_ITEMS
+ #define STAT_BUCKETS 256          // four per power of two of nanoseconds
+ 
+ typedef enum {
+     STAT_MENU,                    // STAT_MENU + n - 1 is menu option n
+     STAT_MENU_OTHER = STAT_MENU + MENU_ITEMS, // exit or an invalid choice
+     STAT_FIND_METER,
+     STAT_CALCULATE_BILL,
+     STAT_RATE_BATCH,
+     STAT_LOG_APPEND,
+     STAT_LOG_COMMIT,
+     STAT_SAVE,
+     STAT_LOAD,
+     STAT_SERVER_REQUEST,
+     STAT_REPORT_TOTALS,
+     STAT_REPORT_CUSTOMERS,
+     STAT_REPORT_BILLING,
+     STAT_REPORT_USAGE,
+     STAT_REPORT_TIME_OF_USE,
+     STAT_REPORT_TOP_CONSUMERS,
+     STAT_REPORT_PAYMENTS,
+     STAT_REPORT_CLOSE,
+     STAT_COUNT
+ } StatId;
+ 
+ typedef struct {
+     long long count;
+     long long timed;              // calls that were timed
+     long long total_ns;           // over the timed calls
+     long long max_ns;
+     long long bytes;
+     unsigned int histogram[STAT_BUCKETS];
+ } OperationStats;
+ 
+ #ifdef BILL_STATS
+ // The cheapest operations are timed on one call in (mask + 1) only, so the
+ // clock is not read more often than they run; every call is counted
+ static const unsigned int stat_sample_masks[STAT_COUNT] = {
+     [STAT_FIND_METER] = 15,
+     [STAT_CALCULATE_BILL] = 63
+ };
+ 
+ OperationStats operation_stats[STAT_COUNT];
+ 
+ static inline long long getTimeNanoseconds() {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ }
+ 
+ // Counts a call and returns its start time, or 0 if it is not timed
+ static inline long long startStat(StatId id) {
+     OperationStats *stats = &operation_stats[id];
+     if ((stats->count++ & stat_sample_masks[id]) != 0) {
+         return 0;
+     }
+     return getTimeNanoseconds();
+ }
+ 
+ void recordStatTime(StatId id, long long elapsed_ns);
+ 
+ static inline void endStat(StatId id, long long start_ns, long long bytes) {
+     operation_stats[id].bytes += bytes;
+     if (start_ns != 0) {
+         recordStatTime(id, getTimeNanoseconds() - start_ns);
+     }
+ }
+ 
+ static inline StatId getMenuStat(int choice) {
+     return choice >= 1 && choice <= MENU_ITEMS ? (StatId)(STAT_MENU + choice - 1) : STAT_MENU_OTHER;
+ }
+ 
+ #define STAT_BEGIN(var, id) long long var = startStat(id)
+ #define STAT_END(var, id, bytes) endStat(id, var, bytes)
+ #else
+ #define STAT_BEGIN(var, id)
+ #define STAT_END(var, id, bytes)
+ #endif
+
+ static inline Customer *getCustomer(int index) {
+     return &customer_chunks[index / CUSTOMER_CHUNK_SIZE][index % CUSTOMER_CHUNK_SIZE];
+ }
+ 
+ static inline BillChunk *getBillChunk(int row) {
+     return bill_chunks[row / BILL_CHUNK_SIZE];
+ }
+ 
+ // Accesses one column of a ledger row, e.g. BILL_FIELD(row, amount)
+ #define BILL_FIELD(row, field) (getBillChunk(row)->field[(row) % BILL_CHUNK_SIZE])
+ 
+ static inline CustomerShard *getCustomerShard(int customer_index) {
+     return &customer_shards[customer_index & (CUSTOMER_SHARDS - 1)];
+ }
+ 
+ // Sequence locks: a writer (already holding a lock that excludes other
+ // writers) makes the sequence odd while it changes the data. A reader notes
+ // the sequence, copies the data, and copies again if the sequence moved.
+ static inline void beginSequenceWrite(unsigned int *sequence) {
+     __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+ }
+ 
+ static inline void endSequenceWrite(unsigned int *sequence) {
+     __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+ }
+ 
+ static inline unsigned int beginSequenceRead(unsigned int *sequence) {
+     unsigned int value;
+     for (int spins = 0; (value = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1; spins++) {
+         // A writer is part way through. If it was descheduled, let it finish.
+         if (spins >= 100) {
+             sched_yield();
+         }
+     }
+     return value;
+ }
+ 
+ // Returns nonzero if the data read since beginSequenceRead() may be torn
+ static inline int retrySequenceRead(unsigned int *sequence, unsigned int value) {
+     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+     return __atomic_load_n(sequence, __ATOMIC_RELAXED) != value;
+ }
+ 
+ // Rounds an amount in currency units to the nearest cent, halves away from zero
+ static inline Money toMoney(double units) {
+     return (Money)(units < 0 ? units * MONEY_SCALE - 0.5 : units * MONEY_SCALE + 0.5);
+ }
+ 
+ // For display and ratios only; sums stay in cents
+ static inline double moneyToUnits(Money amount) {
+     return (double)amount / MONEY_SCALE;
+ }
+ 
+ // Day number of a calendar date. Days past the end of the month carry into
+ // the next one. A zeroed Date gives NO_DATE.
+ static inline DayNumber getDayNumber(Date date) {
+     if (date.year == 0) {
+         return NO_DATE;
+     }
+     // Count from 1 March of year 0, so the leap day falls at the end of a year
+     int year = date.year - (date.month <= 2);
+     int era = (year >= 0 ? year : year - 399) / 400;
+     int year_of_era = year - era * 400;
+     int day_of_year = (153 * (date.month + (date.month > 2 ? -3 : 9)) + 2) / 5 + date.day - 1;
+     int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+     return era * 146097 + day_of_era - 719468;
+ }
+ 
+ // Calendar date of a day number; NO_DATE gives a zeroed Date
+ static inline Date getDateOfDay(DayNumber day) {
+     Date date = {0, 0, 0};
+     if (day == NO_DATE) {
+         return date;
+     }
+     int days = day + 719468;
+     int era = (days >= 0 ? days : days - 146096) / 146097;
+     int day_of_era = days - era * 146097;
+     int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+     int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+     int month_index = (5 * day_of_year + 2) / 153;
+     date.day = day_of_year - (153 * month_index + 2) / 5 + 1;
+     date.month = month_index < 10 ? month_index + 3 : month_index - 9;
+     date.year = year_of_era + era * 400 + (date.month <= 2);
+     return date;
+ }
+ 
+ // Day number of the first day of a month; month 13 is January of the next year
+ static inline DayNumber getMonthStart(int year, int month) {
+     Date first = {1, month > 12 ? month - 12 : month, month > 12 ? year + 1 : year};
+     return getDayNumber(first);
+ }
+ 
  // Function prototypes
+ int appendCustomer(const Customer *customer);
+ void clearCustomers();
+ int appendBill(int customer_index);
+ int getCustomerBill(int customer_index, int bill_index);
+ int collectRecentBills(int customer_index, int *rows, int max_rows);
+ void convertLegacyBill(const LegacyBillingInfo *legacy, BillingInfo *bill);
+ BillingInfo getBill(int row);
+ void setBill(int row, const BillingInfo *bill);
  void saveData();
  void loadData();
+ long writeSnapshot(const char *filename);
+ int checkpoint();
+ void resetLog();
+ void logCustomer(int customer_index);
+ void logBill(int row);
+ void stopLogWriter();
+ void drainLog();
+ void waitForLogCommit();
+ void runLogBenchmark();
+ void runCommitBenchmark();
+ void runFormatBenchmark();
+ int migrateSnapshot();
+ void *allocateChunk(size_t bytes, int is_bill_chunk, int chunk_index);
+ void releaseChunk(void *chunk, size_t bytes);
+ int *allocateIndexSlots(int capacity);
+ void releaseIndexSlots(int *slots, int capacity);
+ int openMappedDatabase();
+ void flushMappedCustomer(int customer_index);
+ void flushMappedBill(int row);
+ void flushMappedDatabase();
+ void closeMappedDatabase();
+ double percentile(double *samples, int count, double fraction);
+ long getFileSize(const char *filename);
  void addCustomer();
  void displayCustomer(int index);
  void generateBill(int customer_index);
+ int createBill(int customer_index, float meter_reading_end, TimeOfUseUsage tou_usage);
+ void runBillBatch(const char *filename);
+ void runCustomerImport(const char *filename);
+ void runPaymentReconciliation(const char *filename, const char *exceptions_filename);
+ double getTimeSeconds();
+ void addSyntheticCustomers(int count);
+ void runStoreBenchmark();
  void displayBill(int customer_index, int bill_index);
  void recordPayment(int customer_index, int bill_index);
+ void markBillPaid(int row, const char *payment_method);
+ void applyBillPayment(int row, const char *payment_method, DayNumber payment_date);
+ void applyPartPayment(int row, Money amount);
  void showPaymentHistory(int customer_index);
  void compareWithPreviousBill(int customer_index);
  void projectNextBill(int customer_index);
+ int getBillProjection(int customer_index, float *projected_usage, Money *projected_amount);
  void generateEnergyUsageAlert(int customer_index);
+ int getUsageAlert(int customer_index, UsageAlert *alert);
  void generateReport();
- float calculateBillAmount(CustomerType type, float usage, TimeOfUseUsage tou_usage);
+ int exportData(ExportDataset dataset, ExportFormat format, const char *filename, long long *rows, long long *bytes);
+ void exportMenu();
+ int runExportCommand(const char *dataset_name, const char *format_name, const char *filename);
+ void runExportBenchmark();
+ void generateData(int customers, int bills_per_customer, unsigned long long seed);
+ int runDataGenerator(const char *customers_arg, const char *bills_arg);
+ void runBenchmarkSuite(const char *results_filename);
+ void printOperationStats();
+ int runServer(const char *socket_path);
+ int aggregateReport(Date report_date, ReportTotals *totals);
+ int getReportThreadCount(int block_count);
+ int getRollupReport(Date report_date, ReportTotals *totals);
+ MonthRollup *getRollup(RollupTable *table, int year, int month, int create);
+ void applyBillToRollups(RollupTable *table, int row, int direction);
+ void applyCustomerToRollups(RollupTable *table, int customer_index, int direction);
+ void clearRollups(RollupTable *table);
+ int rebuildRollups(RollupTable *table);
+ int checkRollups();
+ int initTopConsumers(TopConsumers *top, int k, RankingKey key);
+ void offerTopConsumer(TopConsumers *top, const ConsumerRanking *candidate);
+ int finishTopConsumers(TopConsumers *top);
+ void freeTopConsumers(TopConsumers *top);
+ int initApproxTopConsumers(ApproxTopConsumers *approx, int capacity, RankingKey key);
+ void addApproxConsumerUsage(ApproxTopConsumers *approx, int customer_index, float usage, Money amount);
+ int getApproxTopConsumers(ApproxTopConsumers *approx, TopConsumers *top);
+ void freeApproxTopConsumers(ApproxTopConsumers *approx);
+ void runReportBenchmark();
+ void runTopConsumersBenchmark();
+ void runTariffBenchmark();
+ void addSyntheticBills(int bills_per_customer);
+ void loadRatePlans(const char *filename);
+ int compileRatePlan(RatePlan *plan);
+ int findRatePlan(const char *name);
+ int getCustomerRatePlan(const Customer *c);
+ const char *getDefaultRatePlanName(CustomerType type);
+ void showRatePlans();
+ Money calculateBillAmount(const RatePlan *plan, float usage, TimeOfUseUsage tou_usage);
+ void calculateBillAmounts(const int *plans, const float *usages, const float *peak_hours,
+                           const float *off_peak_hours, Money *amounts, int count);
+ DayNumber getToday();
+ void pinClock();
+ void unpinClock();
  Date getCurrentDate();
- Date addDaysToDate(Date date, int days);
  int findCustomerByMeterNumber(char *meter_number);
+ void buildMeterIndex();
+ void indexCustomerMeter(int customer_index);
+ void unindexCustomerMeter(int customer_index);
+ void readCustomer(int customer_index, Customer *customer);
+ int readCustomerByMeter(const char *meter_number, Customer *customer);
+ int readRecentBills(int customer_index, BillingInfo *bills, int max_bills);
+ int addBillLocked(int customer_index, float meter_reading_end, TimeOfUseUsage tou_usage);
+ int payBillLocked(int customer_index, int bill_id, const char *payment_method);
+ int addCustomerLocked(const Customer *customer);
+ void runConcurrencyBenchmark();
+ int findCustomerById(int customer_id);
+ void setBillIdOffset();
+ int findBillById(int bill_id);
+ void buildCustomerIdIndex();
+ void clearCustomerIdIndex();
+ void indexCustomerId(int customer_index);
+ void buildSearchIndex();
+ void clearSearchIndex();
+ void indexCustomerText(int customer_index);
+ void unindexCustomerText(int customer_index);
+ int findCustomersByText(SearchField field, const char *term, int **matches);
+ void runSearchBenchmark();
  void updateCustomerInfo(int customer_index);
  void showAllCustomers();
  void searchCustomer();
  void showMainMenu();
  
- int main() {
+ int main(int argc, char *argv[]) {
      int choice, customer_index, bill_index;
      char meter_number[20];
      
+     // Storage, rate and report options come before the command
+     const char *rate_plan_filename = RATE_PLAN_FILENAME;
+     int arg = 1;
+     while (arg < argc) {
+         if (strcmp(argv[arg], "--mmap") == 0) {
+             storage_mode = STORAGE_MMAP;
+             arg++;
+         } else if (strcmp(argv[arg], "--rates") == 0 && arg + 1 < argc) {
+             rate_plan_filename = argv[arg + 1];
+             arg += 2;
+         } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+             report_threads = atoi(argv[arg + 1]);
+             arg += 2;
+         } else if (strcmp(argv[arg], "--stats") == 0) {
+             atexit(printOperationStats);
+             arg++;
+         } else if (strcmp(argv[arg], "--commit") == 0 && arg + 1 < argc) {
+             const char *modes[] = {"sync", "group", "wait"};
+             int mode = 0;
+             while (mode < 3 && strcmp(argv[arg + 1], modes[mode]) != 0) {
+                 mode++;
+             }
+             if (mode == 3) {
+                 printf("Unknown commit mode %s (expected sync, group or wait)\n", argv[arg + 1]);
+                 return 1;
+             }
+             commit_mode = (CommitMode)mode;
+             if (commit_mode != COMMIT_SYNC) {
+                 atexit(stopLogWriter); // Writes out anything still queued
+             }
+             arg += 2;
+         } else {
+             break;
+         }
+     }
+     const char *command = arg < argc ? argv[arg] : NULL;
+     
+     loadRatePlans(rate_plan_filename);
+     
+     // Benchmarks run against synthetic in-memory data and never touch the data files
+     if (command != NULL && strncmp(command, "--bench-", 8) == 0) {
+         storage_mode = STORAGE_FILE;
+     }
+     if (command != NULL && strcmp(command, "--bench-store") == 0) {
+         runStoreBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-wal") == 0) {
+         runLogBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-commit") == 0) {
+         runCommitBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-report") == 0) {
+         runReportBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-topk") == 0) {
+         runTopConsumersBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-tariff") == 0) {
+         runTariffBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-search") == 0) {
+         runSearchBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-format") == 0) {
+         runFormatBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-export") == 0) {
+         runExportBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-concurrency") == 0) {
+         runConcurrencyBenchmark();
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--bench-suite") == 0) {
+         runBenchmarkSuite(arg + 1 < argc ? argv[arg + 1] : SUITE_RESULTS_FILENAME);
+         return 0;
+     }
+     if (command != NULL && strcmp(command, "--generate") == 0 && arg + 2 < argc) {
+         storage_mode = STORAGE_FILE;
+         return runDataGenerator(argv[arg + 1], argv[arg + 2]) == 0 ? 0 : 1;
+     }
+     if (command != NULL && strcmp(command, "--migrate") == 0) {
+         return migrateSnapshot() == 0 ? 0 : 1;
+     }
+     
+     // An export leaves the store as it found it
+     if (command != NULL && strcmp(command, "--export") == 0) {
+         mapped_read_only = 1;
+     }
      loadData();
      
+     // Non-interactive modes
+     if (command != NULL) {
+         if (strcmp(command, "--bill-run") == 0 && arg + 1 < argc) {
+             runBillBatch(argv[arg + 1]);
+             return 0;
+         }
+         if (strcmp(command, "--import-customers") == 0 && arg + 1 < argc) {
+             runCustomerImport(argv[arg + 1]);
+             return 0;
+         }
+         if (strcmp(command, "--reconcile") == 0 && arg + 1 < argc) {
+             runPaymentReconciliation(argv[arg + 1], arg + 2 < argc ? argv[arg + 2] : RECONCILE_EXCEPTIONS_FILENAME);
+             return 0;
+         }
+         if (strcmp(command, "--check-rollups") == 0) {
+             int mismatched = checkRollups();
+             if (mismatched < 0) {
+                 printf("Error allocating roll-ups!\n");
+                 return 1;
+             }
+             if (mismatched == 0) {
+                 printf("Monthly roll-ups match the bills (%d months).\n", rollup_table.count);
+                 if (storage_mode == STORAGE_MMAP) {
+                     flushMappedDatabase(); // Close the roll-up file cleanly
+                 }
+                 return 0;
+             }
+             printf("%d months differ; rebuilding roll-ups from the bills.\n", mismatched);
+             rebuildRollups(&rollup_table);
+             saveData();
+             return 1;
+         }
+         if (strcmp(command, "--serve") == 0 && arg + 1 < argc) {
+             return runServer(argv[arg + 1]) == 0 ? 0 : 1;
+         }
+         if (strcmp(command, "--export") == 0 && arg + 3 < argc) {
+             return runExportCommand(argv[arg + 1], argv[arg + 2], argv[arg + 3]) == 0 ? 0 : 1;
+         }
+         
+         printf("Usage: %s [--mmap] [--rates <rate plan file>] [--threads <n>] [--stats] [--commit <sync|group|wait>] [--bill-run <readings file> | --import-customers <csv file> | --reconcile <payments file> [exceptions file] | --serve <socket path> | --export <customers|bills|payments|report> <csv|jsonl> <file> | --generate <customers> <bills per customer> | --check-rollups | --migrate | --bench-store | --bench-wal | --bench-commit | --bench-report | --bench-topk | --bench-tariff | --bench-search | --bench-format | --bench-export | --bench-concurrency | --bench-suite [results file]]\n", argv[0]);
+         return 1;
+     }
+     
      while (1) {
          showMainMenu();
          printf("Enter your choice: ");
          scanf("%d", &choice);
          getchar(); // Consume newline character
          
+         // Timed from the choice until the action is done, including any prompts
+         STAT_BEGIN(menu_start, getMenuStat(choice));
          switch (choice) {
              case 1:
                  addCustomer();
@@ -160,8 +1147,8 @@
                  
                  customer_index = findCustomerByMeterNumber(meter_number);
                  if (customer_index != -1) {
-                     if (customers[customer_index].bill_count > 0) {
-                         displayBill(customer_index, customers[customer_index].bill_count - 1);
+                     if (getCustomer(customer_index)->bill_count > 0) {
+                         displayBill(customer_index, getCustomer(customer_index)->bill_count - 1);
                      } else {
                          printf("No bills found for this customer!\n");
                      }
@@ -177,12 +1164,12 @@
                  
                  customer_index = findCustomerByMeterNumber(meter_number);
                  if (customer_index != -1) {
-                     if (customers[customer_index].bill_count > 0) {
-                         printf("Enter bill index (0-%d): ", customers[customer_index].bill_count - 1);
+                     if (getCustomer(customer_index)->bill_count > 0) {
+                         printf("Enter bill index (0-%d): ", getCustomer(customer_index)->bill_count - 1);
                          scanf("%d", &bill_index);
                          getchar(); // Consume newline character
                          
-                         if (bill_index >= 0 && bill_index < customers[customer_index].bill_count) {
+                         if (bill_index >= 0 && bill_index < getCustomer(customer_index)->bill_count) {
                              recordPayment(customer_index, bill_index);
                          } else {
                              printf("Invalid bill index!\n");
@@ -248,7 +1235,7 @@
                  break;
                  
              case 10:
-                 updateCustomerInfo(findCustomerByMeterNumber(meter_number));
+                 updateCustomerInfo(-1);
                  break;
                  
              case 11:
@@ -263,7 +1250,16 @@
                  generateReport();
                  break;
                  
+             case 14:
+                 exportMenu();
+                 break;
+                 
+             case 15:
+                 printOperationStats();
+                 break;
+                 
              case 0:
+                 STAT_END(menu_start, getMenuStat(choice), 0);
                  saveData();
                  printf("Thank you for using Electric Billing System. Goodbye!\n");
                  exit(0);
@@ -271,6 +1267,7 @@
              default:
                  printf("Invalid choice! Please try again.\n");
          }
+         STAT_END(menu_start, getMenuStat(choice), 0);
          
          printf("\nPress Enter to continue...");
          getchar();
@@ -294,1032 +1291,8120 @@
      printf("11. Show All Customers\n");
      printf("12. Search Customer\n");
      printf("13. Generate Monthly Report\n");
+     printf("14. Export Data\n");
+     printf("15. Show Performance Stats\n");
      printf("0. Exit\n");
      printf("============================================\n");
  }
  
- void saveData() {
-     FILE *file = fopen(FILENAME, "wb");
-     if (file == NULL) {
-         printf("Error opening file for writing!\n");
-         return;
+ static void putBytes(ByteBuffer *buffer, const void *bytes, size_t count) {
+     if (buffer->size + count > buffer->capacity) {
+         size_t capacity = buffer->capacity > 0 ? buffer->capacity : 65536;
+         while (capacity < buffer->size + count) {
+             capacity *= 2;
+         }
+         unsigned char *data = realloc(buffer->data, capacity);
+         if (data == NULL) {
+             buffer->failed = 1;
+             return;
+         }
+         buffer->data = data;
+         buffer->capacity = capacity;
      }
-     
-     fwrite(&customer_count, sizeof(int), 1, file);
-     fwrite(customers, sizeof(Customer), customer_count, file);
-     
-     fclose(file);
-     printf("Data saved successfully!\n");
+     memcpy(buffer->data + buffer->size, bytes, count);
+     buffer->size += count;
  }
  
- void loadData() {
-     FILE *file = fopen(FILENAME, "rb");
-     if (file == NULL) {
-         printf("No existing data found or error opening file!\n");
-         return;
+ // Seven bits per byte, low bits first; the top bit marks that more follow
+ static void putVarint(ByteBuffer *buffer, unsigned long long value) {
+     unsigned char bytes[10];
+     int count = 0;
+     while (value >= 0x80) {
+         bytes[count++] = (unsigned char)(value | 0x80);
+         value >>= 7;
      }
-     
-     fread(&customer_count, sizeof(int), 1, file);
-     fread(customers, sizeof(Customer), customer_count, file);
-     
-     fclose(file);
-     printf("Data loaded successfully!\n");
+     bytes[count++] = (unsigned char)value;
+     putBytes(buffer, bytes, count);
  }
  
- Date getCurrentDate() {
-     time_t t = time(NULL);
-     struct tm *tm_info = localtime(&t);
-     
-     Date current_date;
-     current_date.day = tm_info->tm_mday;
-     current_date.month = tm_info->tm_mon + 1;
-     current_date.year = tm_info->tm_year + 1900;
-     
-     return current_date;
+ // Zigzag encoding keeps small negative numbers small: 0, -1, 1, -2 -> 0, 1, 2, 3
+ static void putSigned(ByteBuffer *buffer, long long value) {
+     putVarint(buffer, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
  }
  
- Date addDaysToDate(Date date, int days) {
-     struct tm timeinfo = {0};
-     timeinfo.tm_year = date.year - 1900;
-     timeinfo.tm_mon = date.month - 1;
-     timeinfo.tm_mday = date.day + days;
-     
-     time_t rawtime = mktime(&timeinfo);
-     struct tm *tm_info = localtime(&rawtime);
-     
-     Date new_date;
-     new_date.day = tm_info->tm_mday;
-     new_date.month = tm_info->tm_mon + 1;
-     new_date.year = tm_info->tm_year + 1900;
-     
-     return new_date;
+ static void putString(ByteBuffer *buffer, const char *text, size_t capacity) {
+     size_t length = strnlen(text, capacity - 1);
+     putVarint(buffer, length);
+     putBytes(buffer, text, length);
  }
  
- void addCustomer() {
-     if (customer_count >= MAX_CUSTOMERS) {
-         printf("Maximum number of customers reached!\n");
-         return;
-     }
-     
-     Customer new_customer;
-     new_customer.customer_id = customer_count + 1001; // Starting from 1001
-     new_customer.bill_count = 0;
-     new_customer.is_active = 1;
-     new_customer.connection_date = getCurrentDate();
-     
-     printf("Enter customer name: ");
-     fgets(new_customer.name, MAX_NAME_LENGTH, stdin);
-     new_customer.name[strcspn(new_customer.name, "\n")] = 0; // Remove newline
+ // Writes a segment and empties the buffer for the next one. Returns 0 on
+ // success, -1 on error.
+ static int writeSegment(FILE *file, ByteBuffer *buffer) {
+     long long size = buffer->size;
+     int failed = buffer->failed || fwrite(&size, sizeof(size), 1, file) != 1 ||
+                  fwrite(buffer->data, 1, buffer->size, file) != buffer->size;
+     buffer->size = 0;
+     return failed ? -1 : 0;
+ }
+ 
+ // Writes customers and bills as columnar segments. Returns 0 on success,
+ // -1 on error.
+ static int writeColumnarData(FILE *file) {
+     ByteBuffer buffer = {NULL, 0, 0, 0};
+     int failed = 0;
      
-     printf("Enter address: ");
-     fgets(new_customer.address, MAX_ADDRESS_LENGTH, stdin);
-     new_customer.address[strcspn(new_customer.address, "\n")] = 0; // Remove newline
+     int counts[2] = {customer_count, ledger_count};
+     failed |= fwrite(counts, sizeof(int), 2, file) != 2;
      
-     printf("Enter phone number: ");
-     fgets(new_customer.phone, 15, stdin);
-     new_customer.phone[strcspn(new_customer.phone, "\n")] = 0; // Remove newline
-     
-     printf("Enter email: ");
-     fgets(new_customer.email, 50, stdin);
-     new_customer.email[strcspn(new_customer.email, "\n")] = 0; // Remove newline
-     
-     printf("Enter customer type (0-Residential, 1-Commercial, 2-Industrial): ");
-     int type;
-     scanf("%d", &type);
-     getchar(); // Consume newline
-     new_customer.type = (CustomerType)type;
-     
-     printf("Enter meter number: ");
-     fgets(new_customer.meter_number, 20, stdin);
-     new_customer.meter_number[strcspn(new_customer.meter_number, "\n")] = 0; // Remove newline
-     
-     customers[customer_count] = new_customer;
-     customer_count++;
-     
-     printf("Customer added successfully! Customer ID: %d\n", new_customer.customer_id);
-     saveData();
- }
- 
- int findCustomerByMeterNumber(char *meter_number) {
+     // Customer IDs and connection dates are stored as the change from the
+     // previous customer's, usually one and zero
+     long long previous = 0;
      for (int i = 0; i < customer_count; i++) {
-         if (strcmp(customers[i].meter_number, meter_number) == 0) {
-             return i;
+         putSigned(&buffer, getCustomer(i)->customer_id - previous);
+         previous = getCustomer(i)->customer_id;
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int i = 0; i < customer_count; i++) {
+         putVarint(&buffer, getCustomer(i)->type);
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int i = 0; i < customer_count; i++) {
+         putVarint(&buffer, getCustomer(i)->bill_count);
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int i = 0; i < customer_count; i++) {
+         putVarint(&buffer, getCustomer(i)->last_bill + 1);
+     }
+     failed |= writeSegment(file, &buffer);
+     previous = 0;
+     for (int i = 0; i < customer_count; i++) {
+         DayNumber connected = getDayNumber(getCustomer(i)->connection_date);
+         putSigned(&buffer, connected - previous);
+         previous = connected;
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int i = 0; i < customer_count; i++) {
+         putVarint(&buffer, getCustomer(i)->is_active);
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int col = 0; col < CUSTOMER_TEXT_COLUMN_COUNT; col++) {
+         for (int i = 0; i < customer_count; i++) {
+             putString(&buffer, (const char *)getCustomer(i) + customer_text_columns[col].offset,
+                       customer_text_columns[col].capacity);
          }
+         failed |= writeSegment(file, &buffer);
      }
-     return -1;
- }
- 
- void displayCustomer(int index) {
-     Customer c = customers[index];
-     printf("\n------ Customer Details ------\n");
-     printf("ID: %d\n", c.customer_id);
-     printf("Name: %s\n", c.name);
-     printf("Address: %s\n", c.address);
-     printf("Phone: %s\n", c.phone);
-     printf("Email: %s\n", c.email);
-     printf("Meter Number: %s\n", c.meter_number);
-     printf("Customer Type: %s\n", c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"));
-     printf("Connection Date: %02d/%02d/%d\n", c.connection_date.day, c.connection_date.month, c.connection_date.year);
-     printf("Active Status: %s\n", c.is_active ? "Active" : "Inactive");
-     printf("Number of Bills: %d\n", c.bill_count);
-     printf("-----------------------------\n");
- }
- 
- float calculateBillAmount(CustomerType type, float usage, TimeOfUseUsage tou_usage) {
-     RateStructure rate;
      
-     // Find the appropriate rate structure
-     for (int i = 0; i < 3; i++) {
-         if (rates[i].type == type) {
-             rate = rates[i];
-             break;
+     // Bills of different customers interleave, so most bill fields are
+     // predicted from the same customer's previous bill
+     previous = 0;
+     for (int row = 0; row < ledger_count; row++) {
+         putSigned(&buffer, BILL_FIELD(row, customer_index) - previous);
+         previous = BILL_FIELD(row, customer_index);
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         int prev_bill = BILL_FIELD(row, prev_bill);
+         putVarint(&buffer, prev_bill == -1 ? 0 : row - prev_bill);
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         int prev_bill = BILL_FIELD(row, prev_bill);
+         long long predicted = prev_bill == -1 ?
+             getCustomer(BILL_FIELD(row, customer_index))->customer_id * 100LL + 1 :
+             BILL_FIELD(prev_bill, bill_id) + 1LL;
+         putSigned(&buffer, BILL_FIELD(row, bill_id) - predicted);
+     }
+     failed |= writeSegment(file, &buffer);
+     previous = 0;
+     for (int row = 0; row < ledger_count; row++) {
+         putSigned(&buffer, BILL_FIELD(row, bill_date) - previous);
+         previous = BILL_FIELD(row, bill_date);
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         putSigned(&buffer, (long long)BILL_FIELD(row, due_date) - BILL_FIELD(row, bill_date));
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         putBytes(&buffer, &BILL_FIELD(row, meter_reading_end), sizeof(float));
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         int prev_bill = BILL_FIELD(row, prev_bill);
+         float previous_reading = prev_bill == -1 ? 0 : BILL_FIELD(prev_bill, meter_reading_end);
+         float start = BILL_FIELD(row, meter_reading_start);
+         float usage = BILL_FIELD(row, total_usage);
+         float expected_usage = BILL_FIELD(row, meter_reading_end) - start;
+         
+         unsigned char flags = 0;
+         flags |= memcmp(&start, &previous_reading, sizeof(float)) == 0 ? BILL_START_FOLLOWS : 0;
+         flags |= memcmp(&usage, &expected_usage, sizeof(float)) == 0 ? BILL_USAGE_FOLLOWS : 0;
+         flags |= BILL_FIELD(row, is_paid) ? BILL_PAID : 0;
+         putBytes(&buffer, &flags, 1);
+         if (!(flags & BILL_START_FOLLOWS)) {
+             putBytes(&buffer, &start, sizeof(float));
+         }
+         if (!(flags & BILL_USAGE_FOLLOWS)) {
+             putBytes(&buffer, &usage, sizeof(float));
          }
      }
-     
-     float amount = rate.base_charge;
-     
-     // Calculate based on regular usage tiers
-     if (usage <= 100) {
-         amount += usage * rate.tier1_rate;
-     } else if (usage <= 300) {
-         amount += 100 * rate.tier1_rate + (usage - 100) * rate.tier2_rate;
-     } else {
-         amount += 100 * rate.tier1_rate + 200 * rate.tier2_rate + (usage - 300) * rate.tier3_rate;
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         putBytes(&buffer, &BILL_FIELD(row, peak_hours), sizeof(float));
      }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         putBytes(&buffer, &BILL_FIELD(row, off_peak_hours), sizeof(float));
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         putSigned(&buffer, BILL_FIELD(row, amount));
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         DayNumber paid = BILL_FIELD(row, payment_date);
+         putSigned(&buffer, paid == NO_DATE ? 0 : (long long)paid - BILL_FIELD(row, bill_date) + 1);
+     }
+     failed |= writeSegment(file, &buffer);
      
-     // Add time-of-use charges
-     amount += tou_usage.peak_hours * rate.peak_rate;
-     amount += tou_usage.off_peak_hours * rate.off_peak_rate;
-     
-     // Add tax
-     amount += amount * rate.tax_rate;
+     // Payment methods: code 0 is followed by the text, which then takes the
+     // next free code
+     char methods[MAX_METHOD_CODES][20];
+     int method_count = 0;
+     for (int row = 0; row < ledger_count; row++) {
+         const char *method = BILL_FIELD(row, payment_method);
+         int code = 0;
+         for (int k = 0; k < method_count && code == 0; k++) {
+             if (strncmp(methods[k], method, 20) == 0) {
+                 code = k + 1;
+             }
+         }
+         putVarint(&buffer, code);
+         if (code == 0) {
+             putString(&buffer, method, 20);
+             if (method_count < MAX_METHOD_CODES) {
+                 strncpy(methods[method_count++], method, 20);
+             }
+         }
+     }
+     failed |= writeSegment(file, &buffer);
+     for (int row = 0; row < ledger_count; row++) {
+         putSigned(&buffer, BILL_FIELD(row, amount_received));
+     }
+     failed |= writeSegment(file, &buffer);
      
-     return amount;
+     free(buffer.data);
+     return failed ? -1 : 0;
  }
  
- void generateBill(int customer_index) {
-     Customer *c = &customers[customer_index];
+ // Writes customers as raw records and the ledger column by column, trimmed
+ // to the rows in use, as snapshots were written up to RAW_DATA_VERSION
+ static int writeRawData(FILE *file) {
+     fwrite(&customer_count, sizeof(int), 1, file);
+     for (int i = 0; i < customer_count; i += CUSTOMER_CHUNK_SIZE) {
+         int n = customer_count - i < CUSTOMER_CHUNK_SIZE ? customer_count - i : CUSTOMER_CHUNK_SIZE;
+         fwrite(customer_chunks[i / CUSTOMER_CHUNK_SIZE], sizeof(Customer), n, file);
+     }
      
-     if (c->bill_count >= MAX_HISTORY) {
-         // Shift bills to make room for new one
-         for (int i = 0; i < MAX_HISTORY - 1; i++) {
-             c->billing_history[i] = c->billing_history[i + 1];
+     fwrite(&ledger_count, sizeof(int), 1, file);
+     for (int i = 0; i < ledger_count; i += BILL_CHUNK_SIZE) {
+         int n = ledger_count - i < BILL_CHUNK_SIZE ? ledger_count - i : BILL_CHUNK_SIZE;
+         char *chunk = (char *)bill_chunks[i / BILL_CHUNK_SIZE];
+         for (int col = 0; col < LEDGER_COLUMN_COUNT; col++) {
+             // Part payments came after the raw layout
+             if (ledger_columns[col].offset != offsetof(BillChunk, amount_received)) {
+                 fwrite(chunk + ledger_columns[col].offset, ledger_columns[col].size, n, file);
+             }
          }
-         c->bill_count--;
      }
-     
-     int bill_index = c->bill_count;
-     BillingInfo *bill = &c->billing_history[bill_index];
-     
-     bill->bill_id = c->customer_id * 100 + bill_index + 1;
-     bill->bill_date = getCurrentDate();
-     bill->due_date = addDaysToDate(bill->bill_date, 15); // Due in 15 days
-     bill->is_paid = 0;
-     
-     float previous_reading = 0;
-     if (bill_index > 0) {
-         previous_reading = c->billing_history[bill_index - 1].meter_reading_end;
+     return ferror(file) ? -1 : 0;
+ }
+ 
+ static long writeSnapshotFile(const char *filename, int version) {
+     FILE *file = fopen(filename, "wb");
+     if (file == NULL) {
+         return -1;
      }
      
-     bill->meter_reading_start = previous_reading;
-     
-     printf("Enter current meter reading: ");
-     scanf("%f", &bill->meter_reading_end);
-     getchar(); // Consume newline
-     
-     bill->total_usage = bill->meter_reading_end - bill->meter_reading_start;
-     
-     printf("Enter peak hours usage (2pm-8pm): ");
-     scanf("%f", &bill->tou_usage.peak_hours);
-     getchar(); // Consume newline
-     
-     printf("Enter off-peak hours usage (8pm-2pm): ");
-     scanf("%f", &bill->tou_usage.off_peak_hours);
-     getchar(); // Consume newline
+     int header[2] = {DATA_MAGIC, version};
+     fwrite(header, sizeof(int), 2, file);
      
-     // Calculate bill amount
-     bill->amount = calculateBillAmount(c->type, bill->total_usage, bill->tou_usage);
+     int failed = version == RAW_DATA_VERSION ? writeRawData(file) : writeColumnarData(file);
      
-     c->bill_count++;
+     // Monthly roll-ups follow the ledger; files written before they existed
+     // simply end here
+     int rollup_header[3] = {ROLLUP_MAGIC, sizeof(MonthRollup), rollup_table.count};
+     fwrite(rollup_header, sizeof(int), 3, file);
+     fwrite(rollup_table.months, sizeof(MonthRollup), rollup_table.count, file);
      
-     printf("Bill generated successfully!\n");
-     displayBill(customer_index, bill_index);
-     saveData();
+     long bytes = ftell(file);
+     failed |= fflush(file) != 0 || fsync(fileno(file)) != 0;
+     failed |= fclose(file) != 0;
+     return failed ? -1 : bytes;
  }
  
- void displayBill(int customer_index, int bill_index) {
-     Customer c = customers[customer_index];
-     BillingInfo bill = c.billing_history[bill_index];
+ // Writes the full customer and ledger snapshot to filename.
+ // Returns the number of bytes written, or -1 on error.
+ long writeSnapshot(const char *filename) {
+     return writeSnapshotFile(filename, DATA_VERSION);
+ }
+ 
+ // Writes a new snapshot beside the current one, swaps it in, and starts an
+ // empty log since everything logged so far is now part of the snapshot.
+ // Returns 0 on success, -1 on error.
+ int checkpoint() {
+     STAT_BEGIN(save_start, STAT_SAVE);
+     if (storage_mode == STORAGE_MMAP) {
+         flushMappedDatabase();
+         STAT_END(save_start, STAT_SAVE, 0);
+         return 0;
+     }
      
-     printf("\n========== ELECTRIC BILL ==========\n");
-     printf("Bill ID: %d\n", bill.bill_id);
-     printf("Date: %02d/%02d/%d\n", bill.bill_date.day, bill.bill_date.month, bill.bill_date.year);
-     printf("Due Date: %02d/%02d/%d\n", bill.due_date.day, bill.due_date.month, bill.due_date.year);
-     printf("Customer ID: %d\n", c.customer_id);
-     printf("Name: %s\n", c.name);
-     printf("Address: %s\n", c.address);
-     printf("Meter Number: %s\n", c.meter_number);
-     printf("Customer Type: %s\n", c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"));
-     printf("-------------------------------\n");
-     printf("Previous Reading: %.2f units\n", bill.meter_reading_start);
-     printf("Current Reading: %.2f units\n", bill.meter_reading_end);
-     printf("Total Consumption: %.2f units\n", bill.total_usage);
-     printf("-------------------------------\n");
-     printf("Peak Hours Usage (2pm-8pm): %.2f units\n", bill.tou_usage.peak_hours);
-     printf("Off-Peak Hours Usage (8pm-2pm): %.2f units\n", bill.tou_usage.off_peak_hours);
-     printf("-------------------------------\n");
-     printf("Total Amount Due: $%.2f\n", bill.amount);
-     printf("Payment Status: %s\n", bill.is_paid ? "Paid" : "Unpaid");
+     char temp_filename[256];
+     snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", data_filename);
      
-     if (bill.is_paid) {
-         printf("Payment Date: %02d/%02d/%d\n", bill.payment_date.day, bill.payment_date.month, bill.payment_date.year);
-         printf("Payment Method: %s\n", bill.payment_method);
+     // The writer thread must be done with the log before it is reset
+     drainLog();
+     long bytes = writeSnapshot(temp_filename);
+     if (bytes < 0 || rename(temp_filename, data_filename) != 0) {
+         remove(temp_filename);
+         return -1;
      }
      
-     printf("===============================\n");
+     resetLog();
+     STAT_END(save_start, STAT_SAVE, bytes);
+     return 0;
  }
  
- void recordPayment(int customer_index, int bill_index) {
-     BillingInfo *bill = &customers[customer_index].billing_history[bill_index];
-     
-     if (bill->is_paid) {
-         printf("This bill is already paid!\n");
+ void saveData() {
+     if (checkpoint() != 0) {
+         printf("Error opening file for writing!\n");
          return;
      }
+     printf("Data saved successfully!\n");
+ }
+ 
+ // FNV-1a over a log record payload
+ static unsigned int logChecksum(const void *payload, int size) {
+     const unsigned char *bytes = payload;
+     unsigned int hash = 2166136261u;
+     for (int i = 0; i < size; i++) {
+         hash ^= bytes[i];
+         hash *= 16777619u;
+     }
+     return hash;
+ }
+ 
+ // Truncates the log and leaves it open for appending
+ void resetLog() {
+     if (log_file != NULL) {
+         fclose(log_file);
+     }
      
-     bill->is_paid = 1;
-     bill->payment_date = getCurrentDate();
-     
-     printf("Enter payment method (Cash/Credit Card/Bank Transfer): ");
-     fgets(bill->payment_method, 20, stdin);
-     bill->payment_method[strcspn(bill->payment_method, "\n")] = 0; // Remove newline
+     log_file = fopen(log_filename, "wb");
+     if (log_file == NULL) {
+         printf("Error opening log file %s!\n", log_filename);
+         return;
+     }
      
-     printf("Payment recorded successfully!\n");
-     saveData();
+     int header[2] = {LOG_MAGIC, DATA_VERSION};
+     fwrite(header, sizeof(int), 2, log_file);
+     fflush(log_file);
+     log_records = 0;
  }
  
- void showPaymentHistory(int customer_index) {
-     Customer c = customers[customer_index];
-     
-     printf("\n===== Payment History for %s =====\n", c.name);
+ // Opens the log for appending, creating it with a header if needed. It holds
+ // no records by now (recoverFromLog() checkpoints otherwise), so a header
+ // from an older version is replaced: records appended under it would be
+ // read back in the old layout.
+ static void openLog() {
+     log_file = fopen(log_filename, "a+b");
+     if (log_file == NULL) {
+         printf("Error opening log file %s!\n", log_filename);
+         return;
+     }
      
-     if (c.bill_count == 0) {
-         printf("No payment history found!\n");
+     fseek(log_file, 0, SEEK_END);
+     if (ftell(log_file) == 0) {
+         int header[2] = {LOG_MAGIC, DATA_VERSION};
+         fwrite(header, sizeof(int), 2, log_file);
+         fflush(log_file);
          return;
      }
      
-     for (int i = 0; i < c.bill_count; i++) {
-         BillingInfo bill = c.billing_history[i];
-         printf("Bill ID: %d, Date: %02d/%02d/%d, Amount: $%.2f, Status: %s\n",
-                bill.bill_id, bill.bill_date.day, bill.bill_date.month, bill.bill_date.year,
-                bill.amount, bill.is_paid ? "Paid" : "Unpaid");
+     int header[2] = {0, 0};
+     rewind(log_file);
+     if (fread(header, sizeof(int), 2, log_file) != 2 || header[0] != LOG_MAGIC || header[1] != DATA_VERSION) {
+         resetLog();
+     }
+ }
+ 
+ // Writes queued log records a batch at a time until stopLogWriter()
+ static void *runLogWriter(void *arg) {
+     (void)arg;
+     ByteBuffer batch = {NULL, 0, 0, 0};
+     
+     pthread_mutex_lock(&log_lock);
+     while (1) {
+         while (log_queue.size == 0 && log_writer_running) {
+             pthread_cond_wait(&log_queue_filled, &log_lock);
+         }
+         if (log_queue.size == 0) {
+             break; // Stopping, with everything written
+         }
          
-         if (bill.is_paid) {
-             printf("  Payment Date: %02d/%02d/%d, Method: %s\n",
-                    bill.payment_date.day, bill.payment_date.month, bill.payment_date.year,
-                    bill.payment_method);
+         // Take the queue and leave an empty buffer for the next batch
+         ByteBuffer queued = log_queue;
+         log_queue = batch;
+         batch = queued;
+         long long batch_end = log_queued;
+         pthread_mutex_unlock(&log_lock);
+         
+         STAT_BEGIN(commit_start, STAT_LOG_COMMIT);
+         if (fwrite(batch.data, 1, batch.size, log_file) != batch.size ||
+             fflush(log_file) != 0 || fsync(fileno(log_file)) != 0) {
+             printf("Error writing to log file!\n");
          }
+         STAT_END(commit_start, STAT_LOG_COMMIT, batch.size);
+         batch.size = 0;
+         
+         pthread_mutex_lock(&log_lock);
+         log_syncs++;
+         log_committed = batch_end;
+         pthread_cond_broadcast(&log_batch_committed);
      }
-     
-     printf("===================================\n");
+     pthread_mutex_unlock(&log_lock);
+     free(batch.data);
+     return NULL;
  }
  
- void compareWithPreviousBill(int customer_index) {
-     Customer c = customers[customer_index];
-     
-     if (c.bill_count < 2) {
-         printf("Not enough bills for comparison!\n");
-         return;
+ // Writes out whatever is still queued and ends the writer thread
+ void stopLogWriter() {
+     pthread_mutex_lock(&log_lock);
+     int running = log_writer_running;
+     log_writer_running = 0;
+     pthread_cond_signal(&log_queue_filled);
+     pthread_mutex_unlock(&log_lock);
+     if (running) {
+         pthread_join(log_writer, NULL);
      }
-     
-     BillingInfo current = c.billing_history[c.bill_count - 1];
-     BillingInfo previous = c.billing_history[c.bill_count - 2];
-     
-     float usage_diff = current.total_usage - previous.total_usage;
-     float amount_diff = current.amount - previous.amount;
-     float usage_diff_percent = (usage_diff / previous.total_usage) * 100;
-     float amount_diff_percent = (amount_diff / previous.amount) * 100;
-     
-     printf("\n===== Bill Comparison =====\n");
-     printf("Current Bill (%02d/%02d/%d): $%.2f, %.2f units\n",
-            current.bill_date.day, current.bill_date.month, current.bill_date.year,
-            current.amount, current.total_usage);
-     
-     printf("Previous Bill (%02d/%02d/%d): $%.2f, %.2f units\n",
-            previous.bill_date.day, previous.bill_date.month, previous.bill_date.year,
-            previous.amount, previous.total_usage);
-     
-     printf("---------------------------\n");
-     printf("Usage Difference: %.2f units (%.2f%%)\n", usage_diff, usage_diff_percent);
-     printf("Amount Difference: $%.2f (%.2f%%)\n", amount_diff, amount_diff_percent);
-     printf("===========================\n");
-     
-     if (usage_diff_percent > 20) {
-         printf("\nALERT: Your usage has increased by more than 20%% compared to last month!\n");
-         printf("Tips to reduce consumption:\n");
-         printf("1. Turn off lights when not in use\n");
-         printf("2. Use energy-efficient appliances\n");
-         printf("3. Reduce air conditioning usage\n");
-         printf("4. Check for electrical leakages\n");
+ }
+ 
+ // Waits until every record queued so far is written and synced
+ void drainLog() {
+     pthread_mutex_lock(&log_lock);
+     while (log_committed < log_queued) {
+         pthread_cond_wait(&log_batch_committed, &log_lock);
      }
+     pthread_mutex_unlock(&log_lock);
  }
  
- void projectNextBill(int customer_index) {
-     Customer c = customers[customer_index];
-     
-     if (c.bill_count == 0) {
-         printf("No previous bill found for projection!\n");
-         return;
+ // Waits until every change this thread logged is written and synced
+ void waitForLogCommit() {
+     pthread_mutex_lock(&log_lock);
+     while (log_committed < last_queued_record) {
+         pthread_cond_wait(&log_batch_committed, &log_lock);
      }
-     
-     BillingInfo last_bill = c.billing_history[c.bill_count - 1];
-     
-     // Get average increase if we have multiple bills
-     float avg_usage_increase = 0;
-     if (c.bill_count > 1) {
-         float total_increase = 0;
-         for (int i = 1; i < c.bill_count; i++) {
-             total_increase += c.billing_history[i].total_usage - c.billing_history[i-1].total_usage;
+     pthread_mutex_unlock(&log_lock);
+ }
+ 
+ // Adds a record to the queue, starting the writer thread on first use.
+ // Called with log_lock held. Returns 0 on success, or -1 if the record
+ // could not be queued and has to be written directly.
+ static int queueLogRecord(const LogRecordHeader *header, const void *payload, int size) {
+     if (!log_writer_running) {
+         if (pthread_create(&log_writer, NULL, runLogWriter, NULL) != 0) {
+             return -1;
          }
-         avg_usage_increase = total_increase / (c.bill_count - 1);
+         log_writer_running = 1;
      }
      
-     float projected_usage = last_bill.total_usage + avg_usage_increase;
-     
-     // Assume same time-of-use distribution
-     TimeOfUseUsage projected_tou;
-     float tou_ratio = last_bill.total_usage > 0 ? 
-                      (last_bill.tou_usage.peak_hours / last_bill.total_usage) : 0.3;
-     
-     projected_tou.peak_hours = projected_usage * tou_ratio;
-     projected_tou.off_peak_hours = projected_usage * (1 - tou_ratio);
-     
-     float projected_amount = calculateBillAmount(c.type, projected_usage, projected_tou);
+     size_t queued_size = log_queue.size;
+     putBytes(&log_queue, header, sizeof(LogRecordHeader));
+     putBytes(&log_queue, payload, size);
+     if (log_queue.failed) {
+         log_queue.size = queued_size;
+         log_queue.failed = 0;
+         return -1;
+     }
+     last_queued_record = ++log_queued;
+     pthread_cond_signal(&log_queue_filled);
+     return 0;
+ }
+ 
+ static void appendLogRecord(int type, int index, const void *payload, int size) {
+     if (log_file == NULL) {
+         return; // Persistence is not active (e.g. benchmarks)
+     }
      
-     printf("\n===== Next Month's Bill Projection =====\n");
-     printf("Projected Usage: %.2f units\n", projected_usage);
-     printf("Projected Amount: $%.2f\n", projected_amount);
-     printf("---------------------------------------\n");
-     printf("Last Month's Usage: %.2f units\n", last_bill.total_usage);
-     printf("Last Month's Amount: $%.2f\n", last_bill.amount);
-     printf("=======================================\n");
+     STAT_BEGIN(append_start, STAT_LOG_APPEND);
+     LogRecordHeader header = {type, index, size, logChecksum(payload, size)};
+     pthread_mutex_lock(&log_lock);
+     if (commit_mode == COMMIT_SYNC || queueLogRecord(&header, payload, size) != 0) {
+         // Anything queued goes first, so records stay in order
+         while (log_committed < log_queued) {
+             pthread_cond_wait(&log_batch_committed, &log_lock);
+         }
+         fwrite(&header, sizeof(LogRecordHeader), 1, log_file);
+         fwrite(payload, size, 1, log_file);
+         
+         if (fflush(log_file) != 0 || fsync(fileno(log_file)) != 0) {
+             printf("Error writing to log file!\n");
+         }
+         log_syncs++;
+     }
+     int checkpoint_due = ++log_records >= CHECKPOINT_INTERVAL;
+     pthread_mutex_unlock(&log_lock);
+     STAT_END(append_start, STAT_LOG_APPEND, sizeof(LogRecordHeader) + size);
      
-     // Provide energy-saving tips
-     printf("\nEnergy-Saving Tips:\n");
-     printf("1. Switch to LED bulbs to save up to 80%% on lighting costs\n");
-     printf("2. Use smart power strips to eliminate phantom power usage\n");
-     printf("3. Adjust your thermostat by 1-2 degrees to save up to 10%% on heating/cooling\n");
-     printf("4. Shift energy-intensive activities to off-peak hours (8pm-2pm)\n");
+     // A store operation holds locks, so it waits and checkpoints once done
+     if (in_store_operation) {
+         return;
+     }
+     if (commit_mode == COMMIT_WAIT) {
+         waitForLogCommit();
+     }
+     // Fold the log into a fresh snapshot once it grows long enough
+     if (checkpoint_due) {
+         checkpoint();
+     }
  }
  
- void generateEnergyUsageAlert(int customer_index) {
-     Customer c = customers[customer_index];
-     
-     if (c.bill_count == 0) {
-         printf("No bills found for analysis!\n");
+ void logCustomer(int customer_index) {
+     if (storage_mode == STORAGE_MMAP) {
+         flushMappedCustomer(customer_index);
+         return;
+     }
+     appendLogRecord(LOG_CUSTOMER, customer_index, getCustomer(customer_index), sizeof(Customer));
+ }
+ 
+ void logBill(int row) {
+     if (storage_mode == STORAGE_MMAP) {
+         flushMappedBill(row);
          return;
      }
      
-     BillingInfo last_bill = c.billing_history[c.bill_count - 1];
+     LoggedBill logged;
+     memset(&logged, 0, sizeof(LoggedBill));
+     logged.customer_index = BILL_FIELD(row, customer_index);
+     logged.bill = getBill(row);
+     logged.amount_received = BILL_FIELD(row, amount_received);
+     appendLogRecord(LOG_BILL, row, &logged, sizeof(LoggedBill));
+ }
+ 
+ // Re-applies changes logged since the snapshot was written, stopping at the
+ // first incomplete or damaged record (e.g. one cut short by a crash).
+ // Returns the number of records applied, or -1 if the log was unreadable or
+ // ended in a damaged record.
+ static int replayLog() {
+     FILE *file = fopen(log_filename, "rb");
+     if (file == NULL) {
+         return 0;
+     }
      
-     // Calculate average usage from all bills
-     float total_usage = 0;
-     for (int i = 0; i < c.bill_count; i++) {
-         total_usage += c.billing_history[i].total_usage;
+     int header[2] = {0, 0};
+     if (fread(header, sizeof(int), 2, file) != 2 || header[0] != LOG_MAGIC ||
+         header[1] < 1 || header[1] > DATA_VERSION) {
+         fclose(file);
+         return -1;
      }
-     float avg_usage = total_usage / c.bill_count;
      
-     printf("\n===== Energy Usage Analysis =====\n");
-     printf("Customer: %s\n", c.name);
-     printf("Meter Number: %s\n", c.meter_number);
-     printf("Last Month's Usage: %.2f units\n", last_bill.total_usage);
-     printf("Average Monthly Usage: %.2f units\n", avg_usage);
+     int applied = 0;
+     long good_end = ftell(file);
+     LogRecordHeader record;
+     Customer customer;
+     LoggedBill logged;
+     LegacyLoggedBill legacy_logged;
+     int customer_size = header[1] == 1 ? (int)CUSTOMER_V1_SIZE : (int)sizeof(Customer);
+     int legacy_bills = header[1] < 3;
+     int bill_size = header[1] < 6 ? (int)LOGGED_BILL_V5_SIZE : (int)sizeof(LoggedBill);
      
-     if (c.bill_count > 1) {
-         float monthly_change = ((last_bill.total_usage - c.billing_history[c.bill_count - 2].total_usage) 
-                               / c.billing_history[c.bill_count - 2].total_usage) * 100;
-         printf("Monthly Change: %.2f%%\n", monthly_change);
+     while (fread(&record, sizeof(LogRecordHeader), 1, file) == 1) {
+         memset(&customer, 0, sizeof(Customer));
+         void *payload = &customer;
+         int expected = customer_size;
+         if (record.type == LOG_BILL) {
+             payload = legacy_bills ? (void *)&legacy_logged : (void *)&logged;
+             expected = legacy_bills ? (int)sizeof(LegacyLoggedBill) : bill_size;
+             logged.amount_received = 0;
+         }
+         
+         if ((record.type != LOG_CUSTOMER && record.type != LOG_BILL) || record.size != expected ||
+             fread(payload, record.size, 1, file) != 1 ||
+             logChecksum(payload, record.size) != record.checksum) {
+             break;
+         }
+         if (record.type == LOG_BILL && legacy_bills) {
+             logged.customer_index = legacy_logged.customer_index;
+             convertLegacyBill(&legacy_logged.bill, &logged.bill);
+         }
+         
+         if (record.type == LOG_CUSTOMER) {
+             if (record.index == customer_count) {
+                 if (appendCustomer(&customer) == -1) {
+                     break;
+                 }
+             } else if (record.index >= 0 && record.index < customer_count) {
+                 int type_changed = getCustomer(record.index)->type != customer.type;
+                 if (type_changed) {
+                     applyCustomerToRollups(&rollup_table, record.index, -1);
+                 }
+                 *getCustomer(record.index) = customer;
+                 if (type_changed) {
+                     applyCustomerToRollups(&rollup_table, record.index, 1);
+                 }
+             } else {
+                 break;
+             }
+         } else {
+             if (record.index == ledger_count) {
+                 if (logged.customer_index < 0 || logged.customer_index >= customer_count ||
+                     appendBill(logged.customer_index) == -1) {
+                     break;
+                 }
+             } else if (record.index < 0 || record.index > ledger_count) {
+                 break;
+             } else {
+                 applyBillToRollups(&rollup_table, record.index, -1);
+             }
+             setBill(record.index, &logged.bill);
+             BILL_FIELD(record.index, amount_received) = logged.amount_received;
+             applyBillToRollups(&rollup_table, record.index, 1);
+         }
+         applied++;
+         good_end = ftell(file);
      }
      
-     printf("-------------------------------\n");
+     // Anything after the last good record means the log was cut short
+     fseek(file, 0, SEEK_END);
+     int damaged = ftell(file) != good_end;
      
-     if (last_bill.total_usage > avg_usage * 1.2) {
-         printf("ALERT: Your usage is %.2f%% above your average!\n", 
-               ((last_bill.total_usage / avg_usage) - 1) * 100);
+     fclose(file);
+     return damaged ? -1 : applied;
+ }
+ 
+ // Reads a data file written before the bill ledger existed: a customer count
+ // followed by customer records with their billing history embedded.
+ static void loadLegacyData(FILE *file, int count) {
+     LegacyCustomer legacy;
+     
+     while (customer_count < count && fread(&legacy, sizeof(LegacyCustomer), 1, file) == 1) {
+         Customer customer;
+         memset(&customer, 0, sizeof(Customer));
+         customer.customer_id = legacy.customer_id;
+         memcpy(customer.name, legacy.name, MAX_NAME_LENGTH);
+         memcpy(customer.address, legacy.address, MAX_ADDRESS_LENGTH);
+         memcpy(customer.phone, legacy.phone, 15);
+         memcpy(customer.email, legacy.email, 50);
+         customer.type = legacy.type;
+         memcpy(customer.meter_number, legacy.meter_number, 20);
+         customer.last_bill = -1;
+         customer.connection_date = legacy.connection_date;
+         customer.is_active = legacy.is_active;
          
-         printf("\nPossible causes of high consumption:\n");
-         printf("1. Weather changes (heating/cooling)\n");
-         printf("2. New appliances or electronic devices\n");
-         printf("3. Increased occupancy\n");
-         printf("4. Faulty appliances or electrical leakages\n");
+         int customer_index = appendCustomer(&customer);
+         if (customer_index == -1) {
+             return;
+         }
          
-         printf("\nRecommended actions:\n");
-         printf("1. Schedule an energy audit\n");
-         printf("2. Check for appliances left on standby\n");
-         printf("3. Inspect for electrical leakages\n");
-         printf("4. Consider smart home energy monitoring\n");
-     } else if (last_bill.total_usage < avg_usage * 0.8) {
-         printf("NOTICE: Your usage is %.2f%% below your average. Good job!\n", 
-               (1 - (last_bill.total_usage / avg_usage)) * 100);
+         int bill_count = legacy.bill_count < MAX_HISTORY ? legacy.bill_count : MAX_HISTORY;
+         for (int j = 0; j < bill_count; j++) {
+             BillingInfo bill;
+             convertLegacyBill(&legacy.billing_history[j], &bill);
+             int row = appendBill(customer_index);
+             if (row == -1) {
+                 return;
+             }
+             
+             setBill(row, &bill);
+         }
+     }
+ }
+ 
+ static int isDateColumn(int col) {
+     size_t offset = ledger_columns[col].offset;
+     return offset == offsetof(BillChunk, bill_date) || offset == offsetof(BillChunk, due_date) ||
+            offset == offsetof(BillChunk, payment_date);
+ }
+ 
+ // Width of a ledger column in data written by an older version: amounts
+ // were floats before version 3, dates were day/month/year before version 4,
+ // and part payments were not kept before version 6
+ static size_t getLedgerColumnSize(int col, int version) {
+     if (version < 6 && ledger_columns[col].offset == offsetof(BillChunk, amount_received)) {
+         return 0;
+     }
+     if (version < 3 && ledger_columns[col].offset == offsetof(BillChunk, amount)) {
+         return sizeof(float);
+     }
+     if (version < 4 && isDateColumn(col)) {
+         return sizeof(Date);
+     }
+     return ledger_columns[col].size;
+ }
+ 
+ // Size of a whole bill chunk as laid out by a version
+ static size_t getBillChunkSize(int version) {
+     size_t bytes = 0;
+     for (int col = 0; col < LEDGER_COLUMN_COUNT; col++) {
+         bytes += getLedgerColumnSize(col, version) * BILL_CHUNK_SIZE;
+     }
+     return bytes;
+ }
+ 
+ // Copies count entries of a column in a version's layout into a chunk
+ static void convertLedgerColumn(BillChunk *chunk, int col, const void *column, int count, int version) {
+     char *target = (char *)chunk + ledger_columns[col].offset;
+     if (getLedgerColumnSize(col, version) == ledger_columns[col].size) {
+         memcpy(target, column, count * ledger_columns[col].size);
+     } else if (getLedgerColumnSize(col, version) == 0) {
+         memset(target, 0, count * ledger_columns[col].size);
+     } else if (isDateColumn(col)) {
+         for (int i = 0; i < count; i++) {
+             ((DayNumber *)target)[i] = getDayNumber(((const Date *)column)[i]);
+         }
      } else {
-         printf("Your usage is within normal range.\n");
+         for (int i = 0; i < count; i++) {
+             ((Money *)target)[i] = toMoney(((const float *)column)[i]);
+         }
+     }
+ }
+ 
+ static void loadLedger(FILE *file, int version) {
+     int count = 0;
+     if (fread(&count, sizeof(int), 1, file) != 1) {
+         return;
      }
      
-     // Time of use analysis
-     float peak_percentage = (last_bill.tou_usage.peak_hours / last_bill.total_usage) * 100;
-     printf("\nPeak Hours Usage: %.2f%% of total\n", peak_percentage);
+     // Columns in an older layout are read here and converted
+     char *legacy_column = NULL;
+     if (version < DATA_VERSION) {
+         legacy_column = malloc(BILL_CHUNK_SIZE * sizeof(Date));
+         if (legacy_column == NULL) {
+             printf("Error allocating bill storage!\n");
+             return;
+         }
+     }
      
-     if (peak_percentage > 40) {
-         printf("TIP: You can save money by shifting usage to off-peak hours (8pm-2pm).\n");
-         printf("Activities to consider shifting:\n");
-         printf("- Laundry\n");
-         printf("- Dishwashing\n");
-         printf("- Electric vehicle charging\n");
-         printf("- Heavy machinery operation\n");
+     for (int i = 0; i < count; i += BILL_CHUNK_SIZE) {
+         int n = count - i < BILL_CHUNK_SIZE ? count - i : BILL_CHUNK_SIZE;
+         int chunk_index = i / BILL_CHUNK_SIZE;
+         
+         if (chunk_index >= MAX_BILL_CHUNKS) {
+             printf("Maximum number of bills reached!\n");
+             break;
+         }
+         
+         bill_chunks[chunk_index] = allocateChunk(sizeof(BillChunk), 1, chunk_index);
+         if (bill_chunks[chunk_index] == NULL) {
+             printf("Error allocating bill storage!\n");
+             break;
+         }
+         
+         char *chunk = (char *)bill_chunks[chunk_index];
+         int truncated = 0;
+         for (int col = 0; col < LEDGER_COLUMN_COUNT && !truncated; col++) {
+             size_t column_size = getLedgerColumnSize(col, version);
+             if (column_size == ledger_columns[col].size) {
+                 truncated = fread(chunk + ledger_columns[col].offset, column_size, n, file) != (size_t)n;
+             } else if (column_size == 0) {
+                 convertLedgerColumn(bill_chunks[chunk_index], col, NULL, n, version);
+             } else {
+                 truncated = fread(legacy_column, column_size, n, file) != (size_t)n;
+                 convertLedgerColumn(bill_chunks[chunk_index], col, legacy_column, n, version);
+             }
+         }
+         if (truncated) {
+             printf("Bill ledger is truncated!\n");
+             break;
+         }
+         ledger_count = i + n;
+     }
+     free(legacy_column);
+ }
+ 
+ static unsigned long long getVarint(ByteReader *reader) {
+     unsigned long long value = 0;
+     for (int shift = 0; shift < 64; shift += 7) {
+         if (reader->pos >= reader->size) {
+             break;
+         }
+         unsigned char byte = reader->data[reader->pos++];
+         value |= (unsigned long long)(byte & 0x7f) << shift;
+         if (!(byte & 0x80)) {
+             return value;
+         }
+     }
+     reader->failed = 1;
+     return 0;
+ }
+ 
+ static long long getSigned(ByteReader *reader) {
+     unsigned long long value = getVarint(reader);
+     return (long long)(value >> 1) ^ -(long long)(value & 1);
+ }
+ 
+ static void getBytes(ByteReader *reader, void *bytes, size_t count) {
+     if (reader->size - reader->pos < count) {
+         reader->failed = 1;
+         memset(bytes, 0, count);
+         return;
+     }
+     memcpy(bytes, reader->data + reader->pos, count);
+     reader->pos += count;
+ }
+ 
+ // Reads a string into a field of the given capacity, cutting it short if needed
+ static void getString(ByteReader *reader, char *text, size_t capacity) {
+     unsigned long long length = getVarint(reader);
+     if (length > reader->size - reader->pos) {
+         reader->failed = 1;
+         length = 0;
+     }
+     size_t kept = length < capacity - 1 ? length : capacity - 1;
+     memcpy(text, reader->data + reader->pos, kept);
+     text[kept] = '\0';
+     reader->pos += length;
+ }
+ 
+ // Reads the next segment into the reader's buffer, which is reused between
+ // segments. Returns 0 on success, -1 on error.
+ static int readSegment(FILE *file, ByteReader *reader, unsigned char **buffer, size_t *capacity) {
+     long long size;
+     if (fread(&size, sizeof(size), 1, file) != 1 || size < 0) {
+         return -1;
+     }
+     if ((size_t)size > *capacity) {
+         unsigned char *data = realloc(*buffer, size);
+         if (data == NULL) {
+             return -1;
+         }
+         *buffer = data;
+         *capacity = size;
+     }
+     if (fread(*buffer, 1, size, file) != (size_t)size) {
+         return -1;
+     }
+     reader->data = *buffer;
+     reader->size = size;
+     reader->pos = 0;
+     reader->failed = 0;
+     return 0;
+ }
+ 
+ // Reads the customers and bills of a columnar snapshot. Returns 0 on
+ // success, -1 if the file is damaged.
+ static int loadColumnarData(FILE *file, int version) {
+     int counts[2];
+     if (fread(counts, sizeof(int), 2, file) != 2 || counts[0] < 0 || counts[1] < 0) {
+         return -1;
      }
      
-     printf("===============================\n");
+     // Fields are filled in one column at a time, so the records come first
+     Customer customer;
+     memset(&customer, 0, sizeof(Customer));
+     while (customer_count < counts[0]) {
+         if (appendCustomer(&customer) == -1) {
+             return -1;
+         }
+     }
+     for (int i = 0; i < counts[1]; i += BILL_CHUNK_SIZE) {
+         int chunk_index = i / BILL_CHUNK_SIZE;
+         if (chunk_index >= MAX_BILL_CHUNKS) {
+             printf("Maximum number of bills reached!\n");
+             return -1;
+         }
+         bill_chunks[chunk_index] = allocateChunk(sizeof(BillChunk), 1, chunk_index);
+         if (bill_chunks[chunk_index] == NULL) {
+             printf("Error allocating bill storage!\n");
+             return -1;
+         }
+     }
+     ledger_count = counts[1];
+     
+     unsigned char *buffer = NULL;
+     size_t capacity = 0;
+     ByteReader reader = {NULL, 0, 0, 0};
+     int failed = 0;
+     
+     failed |= readSegment(file, &reader, &buffer, &capacity);
+     long long previous = 0;
+     for (int i = 0; !failed && i < customer_count; i++) {
+         previous += getSigned(&reader);
+         getCustomer(i)->customer_id = (int)previous;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int i = 0; !failed && i < customer_count; i++) {
+         getCustomer(i)->type = (CustomerType)getVarint(&reader);
+         failed |= getCustomer(i)->type > INDUSTRIAL;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int i = 0; !failed && i < customer_count; i++) {
+         getCustomer(i)->bill_count = (int)getVarint(&reader);
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int i = 0; !failed && i < customer_count; i++) {
+         getCustomer(i)->last_bill = (int)getVarint(&reader) - 1;
+         failed |= getCustomer(i)->last_bill >= ledger_count;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     previous = 0;
+     for (int i = 0; !failed && i < customer_count; i++) {
+         previous += getSigned(&reader);
+         getCustomer(i)->connection_date = getDateOfDay((DayNumber)previous);
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int i = 0; !failed && i < customer_count; i++) {
+         getCustomer(i)->is_active = (int)getVarint(&reader);
+     }
+     for (int col = 0; col < CUSTOMER_TEXT_COLUMN_COUNT; col++) {
+         failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+         for (int i = 0; !failed && i < customer_count; i++) {
+             getString(&reader, (char *)getCustomer(i) + customer_text_columns[col].offset,
+                       customer_text_columns[col].capacity);
+         }
+     }
+     
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     previous = 0;
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         previous += getSigned(&reader);
+         BILL_FIELD(row, customer_index) = (int)previous;
+         failed |= previous < 0 || previous >= customer_count;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         unsigned long long distance = getVarint(&reader);
+         BILL_FIELD(row, prev_bill) = distance == 0 ? -1 : (int)(row - distance);
+         failed |= distance > (unsigned long long)row;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         int prev_bill = BILL_FIELD(row, prev_bill);
+         long long predicted = prev_bill == -1 ?
+             getCustomer(BILL_FIELD(row, customer_index))->customer_id * 100LL + 1 :
+             BILL_FIELD(prev_bill, bill_id) + 1LL;
+         BILL_FIELD(row, bill_id) = (int)(predicted + getSigned(&reader));
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     previous = 0;
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         previous += getSigned(&reader);
+         BILL_FIELD(row, bill_date) = (DayNumber)previous;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         BILL_FIELD(row, due_date) = (DayNumber)(BILL_FIELD(row, bill_date) + getSigned(&reader));
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         getBytes(&reader, &BILL_FIELD(row, meter_reading_end), sizeof(float));
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         int prev_bill = BILL_FIELD(row, prev_bill);
+         unsigned char flags;
+         getBytes(&reader, &flags, 1);
+         
+         float start = prev_bill == -1 ? 0 : BILL_FIELD(prev_bill, meter_reading_end);
+         if (!(flags & BILL_START_FOLLOWS)) {
+             getBytes(&reader, &start, sizeof(float));
+         }
+         float usage = BILL_FIELD(row, meter_reading_end) - start;
+         if (!(flags & BILL_USAGE_FOLLOWS)) {
+             getBytes(&reader, &usage, sizeof(float));
+         }
+         BILL_FIELD(row, meter_reading_start) = start;
+         BILL_FIELD(row, total_usage) = usage;
+         BILL_FIELD(row, is_paid) = (flags & BILL_PAID) != 0;
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         getBytes(&reader, &BILL_FIELD(row, peak_hours), sizeof(float));
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         getBytes(&reader, &BILL_FIELD(row, off_peak_hours), sizeof(float));
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         BILL_FIELD(row, amount) = getSigned(&reader);
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         long long paid = getSigned(&reader);
+         BILL_FIELD(row, payment_date) = paid == 0 ? NO_DATE : (DayNumber)(BILL_FIELD(row, bill_date) + paid - 1);
+     }
+     failed |= reader.failed || readSegment(file, &reader, &buffer, &capacity);
+     char methods[MAX_METHOD_CODES][20];
+     int method_count = 0;
+     for (int row = 0; !failed && row < ledger_count; row++) {
+         char *method = BILL_FIELD(row, payment_method);
+         unsigned long long code = getVarint(&reader);
+         if (code == 0) {
+             getString(&reader, method, 20);
+             if (method_count < MAX_METHOD_CODES) {
+                 strcpy(methods[method_count++], method);
+             }
+         } else if (code <= (unsigned long long)method_count) {
+             strcpy(method, methods[code - 1]);
+         } else {
+             failed = 1;
+         }
+     }
+     failed |= reader.failed;
+     
+     // Part payments were added in version 6; older bills have none
+     if (version >= 6) {
+         failed |= readSegment(file, &reader, &buffer, &capacity);
+         for (int row = 0; !failed && row < ledger_count; row++) {
+             BILL_FIELD(row, amount_received) = getSigned(&reader);
+         }
+         failed |= reader.failed;
+     } else {
+         for (int row = 0; row < ledger_count; row++) {
+             BILL_FIELD(row, amount_received) = 0;
+         }
+     }
+     
+     free(buffer);
+     return failed ? -1 : 0;
  }
  
- void updateCustomerInfo(int customer_index) {
-    if (customer_index == -1) {
-        printf("Enter meter number: ");
-        char meter_number[20];
-        fgets(meter_number, 20, stdin);
-        meter_number[strcspn(meter_number, "\n")] = 0; // Remove newline
-        
-        customer_index = findCustomerByMeterNumber(meter_number);
-        
-        if (customer_index == -1) {
-            printf("Customer not found!\n");
-            return;
-        }
-    }
-    
-    Customer *c = &customers[customer_index];
-    int choice;
-    
-    printf("\n===== Update Customer Information =====\n");
-    printf("1. Update Name\n");
-    printf("2. Update Address\n");
-    printf("3. Update Phone\n");
-    printf("4. Update Email\n");
-    printf("5. Update Customer Type\n");
-    printf("6. Change Active Status\n");
-    printf("0. Back to Main Menu\n");
-    printf("Enter your choice: ");
-    scanf("%d", &choice);
-    getchar(); // Consume newline
-    
-    switch (choice) {
-        case 1:
-            printf("Current Name: %s\n", c->name);
-            printf("Enter new name: ");
-            fgets(c->name, MAX_NAME_LENGTH, stdin);
-            c->name[strcspn(c->name, "\n")] = 0; // Remove newline
-            printf("Name updated successfully!\n");
-            break;
-            
-        case 2:
-            printf("Current Address: %s\n", c->address);
-            printf("Enter new address: ");
-            fgets(c->address, MAX_ADDRESS_LENGTH, stdin);
-            c->address[strcspn(c->address, "\n")] = 0; // Remove newline
-            printf("Address updated successfully!\n");
-            break;
-            
-        case 3:
-            printf("Current Phone: %s\n", c->phone);
-            printf("Enter new phone: ");
-            fgets(c->phone, 15, stdin);
-            c->phone[strcspn(c->phone, "\n")] = 0; // Remove newline
-            printf("Phone updated successfully!\n");
-            break;
-            
-        case 4:
-            printf("Current Email: %s\n", c->email);
-            printf("Enter new email: ");
-            fgets(c->email, 50, stdin);
-            c->email[strcspn(c->email, "\n")] = 0; // Remove newline
-            printf("Email updated successfully!\n");
-            break;
-            
-        case 5:
-            printf("Current Customer Type: %s\n", 
-                   c->type == RESIDENTIAL ? "Residential" : 
-                   (c->type == COMMERCIAL ? "Commercial" : "Industrial"));
-            printf("Enter new customer type (0-Residential, 1-Commercial, 2-Industrial): ");
-            int type;
-            scanf("%d", &type);
-            getchar(); // Consume newline
-            c->type = (CustomerType)type;
-            printf("Customer type updated successfully!\n");
-            break;
-            
-        case 6:
-            printf("Current Status: %s\n", c->is_active ? "Active" : "Inactive");
-            printf("Change status to %s? (1-Yes, 0-No): ", c->is_active ? "Inactive" : "Active");
-            int status;
-            scanf("%d", &status);
-            getchar(); // Consume newline
-            if (status == 1) {
-                c->is_active = !c->is_active;
-                printf("Status updated successfully!\n");
-            }
-            break;
+ // Reads the monthly roll-ups saved after the ledger. Returns 0 on success, or
+ // -1 if the file has none (or ones from another layout) and they have to be
+ // rebuilt from the bills.
+ static int loadRollups(FILE *file) {
+     int header[3];
+     if (fread(header, sizeof(int), 3, file) != 3 || header[0] != ROLLUP_MAGIC ||
+         header[1] != (int)sizeof(MonthRollup) || header[2] < 0 || header[2] > MAX_ROLLUP_MONTHS) {
+         return -1;
+     }
+     
+     if (rollup_table.months == NULL ||
+         fread(rollup_table.months, sizeof(MonthRollup), header[2], file) != (size_t)header[2]) {
+         return -1;
+     }
+     rollup_table.count = header[2];
+     return 0;
+ }
+ 
+ // Replays the log on top of the loaded snapshot and reopens it for appending.
+ // Recovered changes are folded into a new snapshot so the log starts clean.
+ static void recoverFromLog() {
+     int recovered = replayLog();
+     buildMeterIndex();
+     buildCustomerIdIndex();
+     
+     if (recovered != 0) {
+         checkpoint();
+     } else {
+         openLog();
+     }
+     
+     if (recovered > 0) {
+         printf("Recovered %d changes from the log.\n", recovered);
+     }
+ }
+ 
+ // Loads the snapshot and replays the log, or opens the mapped database
+ static void readDataFiles() {
+     if (storage_mode == STORAGE_MMAP) {
+         if (openMappedDatabase() == 0) {
+             atexit(closeMappedDatabase); // However the program ends
+         }
+         return;
+     }
+     
+     clearCustomers();
+     
+     FILE *file = fopen(data_filename, "rb");
+     if (file == NULL) {
+         printf("No existing data found or error opening file!\n");
+         
+         // A log without a snapshot still holds everything since the first change
+         recoverFromLog();
+         return;
+     }
+     
+     int count = 0;
+     fread(&count, sizeof(int), 1, file);
+     
+     if (count != DATA_MAGIC) {
+         // Files without a header hold the customer count first
+         loadLegacyData(file, count);
+     } else {
+         int version = 0;
+         fread(&version, sizeof(int), 1, file);
+         if (version < 1 || version > DATA_VERSION) {
+             // Saving over a newer file would lose everything in it
+             printf("Unsupported data file version %d!\n", version);
+             exit(1);
+         }
+         
+         if (version > RAW_DATA_VERSION) {
+             // A half-read columnar snapshot is of no use, and saving over it
+             // would lose the rest
+             if (loadColumnarData(file, version) != 0) {
+                 printf("Data file %s is damaged!\n", data_filename);
+                 exit(1);
+             }
+         } else {
+             count = 0;
+             fread(&count, sizeof(int), 1, file);
+             
+             // Older customer records are a prefix of the current layout
+             size_t customer_size = version == 1 ? CUSTOMER_V1_SIZE : sizeof(Customer);
+             Customer customer;
+             memset(&customer, 0, sizeof(Customer));
+             while (customer_count < count && fread(&customer, customer_size, 1, file) == 1) {
+                 if (appendCustomer(&customer) == -1) {
+                     break;
+                 }
+             }
+             
+             loadLedger(file, version);
+         }
+     }
+     
+     if (loadRollups(file) != 0) {
+         rebuildRollups(&rollup_table);
+     }
+     fclose(file);
+     
+     printf("Data loaded successfully!\n");
+     recoverFromLog();
+ }
+ 
+ #ifdef BILL_STATS
+ // Bytes read from the snapshot and the log
+ static long long getDataFilesSize() {
+     long data_size = getFileSize(data_filename);
+     long log_size = getFileSize(log_filename);
+     return (data_size > 0 ? data_size : 0) + (log_size > 0 ? log_size : 0);
+ }
+ #endif
+ 
+ void loadData() {
+     STAT_BEGIN(load_start, STAT_LOAD);
+     readDataFiles();
+     if (storage_mode == STORAGE_FILE) {
+         setBillIdOffset();
+     }
+     STAT_END(load_start, STAT_LOAD, storage_mode == STORAGE_FILE ? getDataFilesSize() : 0);
+ }
+ 
+ static size_t pageAlign(size_t bytes) {
+     size_t page = (size_t)sysconf(_SC_PAGESIZE);
+     return (bytes + page - 1) / page * page;
+ }
+ 
+ // msync() needs a page-aligned start address
+ static void flushMappedRange(void *address, size_t bytes) {
+     size_t page = (size_t)sysconf(_SC_PAGESIZE);
+     char *start = (char *)((size_t)address / page * page);
+     msync(start, (char *)address + bytes - start, MS_SYNC);
+ }
+ 
+ // Allocates storage for one customer or bill chunk. In mmap mode the file is
+ // extended and the new region mapped, so the chunk's address stays stable.
+ void *allocateChunk(size_t bytes, int is_bill_chunk, int chunk_index) {
+     if (storage_mode == STORAGE_FILE) {
+         return malloc(bytes);
+     }
+     
+     long long offset = db_header->file_size;
+     if (ftruncate(db_fd, offset + pageAlign(bytes)) != 0) {
+         return NULL;
+     }
+     
+     void *chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, db_fd, offset);
+     if (chunk == MAP_FAILED) {
+         return NULL;
+     }
+     
+     if (is_bill_chunk) {
+         db_header->bill_chunk_offsets[chunk_index] = offset;
+     } else {
+         db_header->customer_chunk_offsets[chunk_index] = offset;
+     }
+     db_header->file_size = offset + pageAlign(bytes);
+     return chunk;
+ }
+ 
+ void releaseChunk(void *chunk, size_t bytes) {
+     if (storage_mode == STORAGE_FILE) {
+         free(chunk);
+     } else {
+         munmap(chunk, bytes);
+     }
+ }
+ 
+ // Allocates meter index slots. In mmap mode they live in a new index file,
+ // written under a temporary name until resizeMeterIndex() swaps it in.
+ int *allocateIndexSlots(int capacity) {
+     if (storage_mode == STORAGE_FILE) {
+         return malloc(capacity * sizeof(int));
+     }
+     
+     size_t bytes = sizeof(MappedIndexHeader) + capacity * sizeof(int);
+     int fd = open(INDEX_FILENAME ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0644);
+     if (fd == -1) {
+         return NULL;
+     }
+     
+     MappedIndexHeader *header = MAP_FAILED;
+     if (ftruncate(fd, bytes) == 0) {
+         header = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     }
+     close(fd);
+     if (header == MAP_FAILED) {
+         return NULL;
+     }
+     
+     header->magic = INDEX_MAGIC;
+     header->capacity = capacity;
+     return (int *)(header + 1);
+ }
+ 
+ void releaseIndexSlots(int *slots, int capacity) {
+     if (slots == NULL) {
+         return;
+     }
+     if (storage_mode == STORAGE_FILE) {
+         free(slots);
+     } else {
+         munmap((MappedIndexHeader *)slots - 1, sizeof(MappedIndexHeader) + capacity * sizeof(int));
+     }
+ }
+ 
+ // Maps the meter index saved alongside the database. Returns 0 on success,
+ // or -1 if it is missing or out of date and has to be rebuilt.
+ static int openMappedIndex() {
+     int fd = open(INDEX_FILENAME, O_RDWR);
+     if (fd == -1) {
+         return -1;
+     }
+     
+     MappedIndexHeader header;
+     struct stat info;
+     if (read(fd, &header, sizeof(header)) != sizeof(header) || fstat(fd, &info) != 0 ||
+         header.magic != INDEX_MAGIC || header.customer_count != customer_count ||
+         header.size != customer_count ||
+         info.st_size != (off_t)(sizeof(MappedIndexHeader) + header.capacity * sizeof(int))) {
+         close(fd);
+         return -1;
+     }
+     
+     index_header = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     close(fd);
+     if (index_header == MAP_FAILED) {
+         index_header = NULL;
+         return -1;
+     }
+     
+     meter_index = (int *)(index_header + 1);
+     meter_index_capacity = index_header->capacity;
+     meter_index_size = index_header->size;
+     return 0;
+ }
+ 
+ // Maps the roll-up file kept beside the database, creating it if needed.
+ // Returns 1 if it holds the roll-ups saved when the database was last closed,
+ // 0 if they have to be rebuilt, or -1 if it could not be mapped.
+ static int openMappedRollups() {
+     size_t bytes = sizeof(RollupHeader) + MAX_ROLLUP_MONTHS * sizeof(MonthRollup);
+     int fd = open(ROLLUP_FILENAME, O_RDWR | O_CREAT, 0644);
+     if (fd == -1) {
+         return -1;
+     }
+     
+     struct stat info;
+     int sized = fstat(fd, &info) == 0 && info.st_size == (off_t)bytes;
+     if (!sized && ftruncate(fd, bytes) != 0) {
+         close(fd);
+         return -1;
+     }
+     
+     rollup_header = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     close(fd);
+     if (rollup_header == MAP_FAILED) {
+         rollup_header = NULL;
+         return -1;
+     }
+     
+     // Roll-ups are only trusted after a clean close that covered every bill
+     int valid = sized && rollup_header->magic == ROLLUP_MAGIC &&
+                 rollup_header->month_size == (int)sizeof(MonthRollup) &&
+                 rollup_header->clean && rollup_header->ledger_count == ledger_count &&
+                 rollup_header->month_count >= 0 && rollup_header->month_count <= MAX_ROLLUP_MONTHS;
+     
+     rollup_table.months = (MonthRollup *)(rollup_header + 1);
+     rollup_table.count = valid ? rollup_header->month_count : 0;
+     rollup_header->magic = ROLLUP_MAGIC;
+     rollup_header->month_size = sizeof(MonthRollup);
+     return valid;
+ }
+ 
+ // Marks the roll-up file as in use. Bills and roll-ups are written back to
+ // disk independently, so after a crash the roll-ups cannot be trusted and
+ // are rebuilt on the next start.
+ static void markMappedRollupsInUse() {
+     rollup_header->clean = 0;
+     flushMappedRange(rollup_header, sizeof(RollupHeader));
+ }
+ 
+ static void flushMappedRollups() {
+     rollup_header->month_count = rollup_table.count;
+     rollup_header->ledger_count = ledger_count;
+     flushMappedRange(rollup_header, sizeof(RollupHeader) + rollup_table.count * sizeof(MonthRollup));
+     rollup_header->clean = 1;
+     flushMappedRange(rollup_header, sizeof(RollupHeader));
+ }
+ 
+ // Moves customers and bills loaded from the snapshot and log into a freshly
+ // created database file.
+ static void importIntoMappedDatabase() {
+     storage_mode = STORAGE_FILE;
+     loadData();
+     if (log_file != NULL) {
+         fclose(log_file);
+         log_file = NULL;
+     }
+     storage_mode = STORAGE_MMAP;
+     
+     size_t customer_chunk_bytes = CUSTOMER_CHUNK_SIZE * sizeof(Customer);
+     for (int i = 0; i < MAX_CUSTOMER_CHUNKS && customer_chunks[i] != NULL; i++) {
+         void *mapped = allocateChunk(customer_chunk_bytes, 0, i);
+         if (mapped == NULL) {
+             printf("Error extending database file!\n");
+             exit(1);
+         }
+         memcpy(mapped, customer_chunks[i], customer_chunk_bytes);
+         free(customer_chunks[i]);
+         customer_chunks[i] = mapped;
+     }
+     
+     for (int i = 0; i < MAX_BILL_CHUNKS && bill_chunks[i] != NULL; i++) {
+         void *mapped = allocateChunk(sizeof(BillChunk), 1, i);
+         if (mapped == NULL) {
+             printf("Error extending database file!\n");
+             exit(1);
+         }
+         memcpy(mapped, bill_chunks[i], sizeof(BillChunk));
+         free(bill_chunks[i]);
+         bill_chunks[i] = mapped;
+     }
+     
+     db_header->customer_count = customer_count;
+     db_header->ledger_count = ledger_count;
+     
+     // So are the roll-ups
+     MonthRollup *imported_months = rollup_table.months;
+     int imported_count = rollup_table.count;
+     if (openMappedRollups() == -1) {
+         printf("Error creating roll-up file %s!\n", ROLLUP_FILENAME);
+         exit(1);
+     }
+     memcpy(rollup_table.months, imported_months, imported_count * sizeof(MonthRollup));
+     rollup_table.count = imported_count;
+     free(imported_months);
+     
+     // The heap-allocated index is replaced by a mapped one
+     storage_mode = STORAGE_FILE;
+     releaseIndexSlots(meter_index, meter_index_capacity);
+     meter_index = NULL;
+     meter_index_capacity = 0;
+     storage_mode = STORAGE_MMAP;
+     buildMeterIndex();
+     flushMappedDatabase();
+ }
+ 
+ // Rewrites the chunks of a database created by an older version in the
+ // current layout: customers gained a rate plan in version 2, bill amounts
+ // became cents in version 3 and bill dates day numbers in version 4. Each
+ // chunk is copied to a new chunk at the end of the file; the space the old
+ // chunks used is left unused.
+ static void upgradeMappedDatabase() {
+     int version = db_header->version;
+     int upgrade_customers = db_header->customer_size == (int)CUSTOMER_V1_SIZE;
+     int upgrade_bills = db_header->bill_chunk_size != (int)sizeof(BillChunk);
+     size_t old_customer_bytes = CUSTOMER_CHUNK_SIZE * CUSTOMER_V1_SIZE;
+     size_t old_bill_bytes = getBillChunkSize(version);
+     char *old_chunk = malloc(old_customer_bytes > old_bill_bytes ? old_customer_bytes : old_bill_bytes);
+     long long *customer_offsets = malloc(MAX_CUSTOMER_CHUNKS * sizeof(long long));
+     long long *bill_offsets = malloc(MAX_BILL_CHUNKS * sizeof(long long));
+     if (old_chunk == NULL || customer_offsets == NULL || bill_offsets == NULL) {
+         printf("Error allocating upgrade buffer!\n");
+         exit(1);
+     }
+     memcpy(customer_offsets, db_header->customer_chunk_offsets, MAX_CUSTOMER_CHUNKS * sizeof(long long));
+     memcpy(bill_offsets, db_header->bill_chunk_offsets, MAX_BILL_CHUNKS * sizeof(long long));
+     
+     // allocateChunk() records each new chunk in the header; the old offset is
+     // put back until every chunk has been copied
+     int customer_chunk_count = (db_header->customer_count + CUSTOMER_CHUNK_SIZE - 1) / CUSTOMER_CHUNK_SIZE;
+     for (int i = 0; upgrade_customers && i < customer_chunk_count; i++) {
+         long long old_offset = customer_offsets[i];
+         if (pread(db_fd, old_chunk, old_customer_bytes, old_offset) != (ssize_t)old_customer_bytes) {
+             printf("Error reading database file %s!\n", DB_FILENAME);
+             exit(1);
+         }
+         
+         Customer *chunk = allocateChunk(CUSTOMER_CHUNK_SIZE * sizeof(Customer), 0, i);
+         if (chunk == NULL) {
+             printf("Error extending database file!\n");
+             exit(1);
+         }
+         customer_offsets[i] = db_header->customer_chunk_offsets[i];
+         db_header->customer_chunk_offsets[i] = old_offset;
+         
+         memset(chunk, 0, CUSTOMER_CHUNK_SIZE * sizeof(Customer));
+         for (int j = 0; j < CUSTOMER_CHUNK_SIZE; j++) {
+             memcpy(&chunk[j], old_chunk + j * CUSTOMER_V1_SIZE, CUSTOMER_V1_SIZE);
+         }
+         flushMappedRange(chunk, CUSTOMER_CHUNK_SIZE * sizeof(Customer));
+         munmap(chunk, CUSTOMER_CHUNK_SIZE * sizeof(Customer));
+     }
+     
+     int bill_chunk_count = (db_header->ledger_count + BILL_CHUNK_SIZE - 1) / BILL_CHUNK_SIZE;
+     for (int i = 0; upgrade_bills && i < bill_chunk_count; i++) {
+         long long old_offset = bill_offsets[i];
+         if (pread(db_fd, old_chunk, old_bill_bytes, old_offset) != (ssize_t)old_bill_bytes) {
+             printf("Error reading database file %s!\n", DB_FILENAME);
+             exit(1);
+         }
+         
+         BillChunk *chunk = allocateChunk(sizeof(BillChunk), 1, i);
+         if (chunk == NULL) {
+             printf("Error extending database file!\n");
+             exit(1);
+         }
+         bill_offsets[i] = db_header->bill_chunk_offsets[i];
+         db_header->bill_chunk_offsets[i] = old_offset;
+         
+         // Old columns follow each other at their own widths
+         size_t old_column_offset = 0;
+         for (int col = 0; col < LEDGER_COLUMN_COUNT; col++) {
+             convertLedgerColumn(chunk, col, old_chunk + old_column_offset, BILL_CHUNK_SIZE, version);
+             old_column_offset += getLedgerColumnSize(col, version) * BILL_CHUNK_SIZE;
+         }
+         flushMappedRange(chunk, sizeof(BillChunk));
+         munmap(chunk, sizeof(BillChunk));
+     }
+     free(old_chunk);
+     
+     // The header switches to the new chunks only once they are all on disk,
+     // so an upgrade cut short starts over from the old ones
+     memcpy(db_header->customer_chunk_offsets, customer_offsets, MAX_CUSTOMER_CHUNKS * sizeof(long long));
+     memcpy(db_header->bill_chunk_offsets, bill_offsets, MAX_BILL_CHUNKS * sizeof(long long));
+     free(customer_offsets);
+     free(bill_offsets);
+     db_header->customer_size = sizeof(Customer);
+     db_header->bill_chunk_size = sizeof(BillChunk);
+     db_header->version = DATA_VERSION;
+     flushMappedRange(db_header, sizeof(MappedHeader));
+     printf("Database %s upgraded to version %d.\n", DB_FILENAME, DATA_VERSION);
+ }
+ 
+ // Takes the bill ID offset from the header. Databases from before it was kept
+ // there have it worked out from their bills once and recorded.
+ static void loadMappedBillIdOffset() {
+     if (db_header->bill_id_offset == 0) {
+         setBillIdOffset();
+         db_header->bill_id_offset = bill_id_offset;
+         flushMappedRange(db_header, sizeof(MappedHeader));
+     }
+     bill_id_offset = db_header->bill_id_offset;
+ }
+ 
+ // Opens (or creates) the memory-mapped database. Only the header is read up
+ // front; customer and bill pages are loaded by the kernel when first touched,
+ // so startup time does not depend on how much data the file holds.
+ int openMappedDatabase() {
+     int created = 0;
+     db_fd = open(DB_FILENAME, O_RDWR);
+     if (db_fd == -1) {
+         db_fd = open(DB_FILENAME, O_RDWR | O_CREAT, 0644);
+         created = 1;
+     }
+     if (db_fd == -1) {
+         printf("Error opening database file %s!\n", DB_FILENAME);
+         exit(1);
+     }
+     
+     size_t header_bytes = pageAlign(sizeof(MappedHeader));
+     if (created && ftruncate(db_fd, header_bytes) != 0) {
+         printf("Error creating database file %s!\n", DB_FILENAME);
+         exit(1);
+     }
+     
+     db_header = mmap(NULL, header_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, db_fd, 0);
+     if (db_header == MAP_FAILED) {
+         printf("Error mapping database file %s!\n", DB_FILENAME);
+         exit(1);
+     }
+     
+     if (created) {
+         db_header->magic = DB_MAGIC;
+         db_header->version = DATA_VERSION;
+         db_header->customer_size = sizeof(Customer);
+         db_header->bill_chunk_size = sizeof(BillChunk);
+         db_header->file_size = header_bytes;
+         
+         // Carry over any existing data from the snapshot and log
+         importIntoMappedDatabase();
+         mapped_read_only = 0; // The import has to be written back
+         loadMappedBillIdOffset();
+         markMappedRollupsInUse();
+         printf("Database %s created with %d customers and %d bills.\n",
+                DB_FILENAME, customer_count, ledger_count);
+         return 0;
+     }
+     
+     if (db_header->magic == DB_MAGIC && db_header->version < DATA_VERSION &&
+         (db_header->customer_size == (int)CUSTOMER_V1_SIZE || db_header->customer_size == (int)sizeof(Customer)) &&
+         db_header->bill_chunk_size == (int)getBillChunkSize(db_header->version)) {
+         upgradeMappedDatabase();
+     }
+     
+     if (db_header->magic != DB_MAGIC || db_header->version != DATA_VERSION ||
+         db_header->customer_size != (int)sizeof(Customer) ||
+         db_header->bill_chunk_size != (int)sizeof(BillChunk)) {
+         printf("Unsupported database layout in %s!\n", DB_FILENAME);
+         exit(1);
+     }
+     
+     int customer_chunk_count = (db_header->customer_count + CUSTOMER_CHUNK_SIZE - 1) / CUSTOMER_CHUNK_SIZE;
+     for (int i = 0; i < customer_chunk_count; i++) {
+         customer_chunks[i] = mmap(NULL, CUSTOMER_CHUNK_SIZE * sizeof(Customer), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, db_fd, db_header->customer_chunk_offsets[i]);
+         if (customer_chunks[i] == MAP_FAILED) {
+             printf("Error mapping database file %s!\n", DB_FILENAME);
+             exit(1);
+         }
+     }
+     
+     int bill_chunk_count = (db_header->ledger_count + BILL_CHUNK_SIZE - 1) / BILL_CHUNK_SIZE;
+     for (int i = 0; i < bill_chunk_count; i++) {
+         bill_chunks[i] = mmap(NULL, sizeof(BillChunk), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, db_fd, db_header->bill_chunk_offsets[i]);
+         if (bill_chunks[i] == MAP_FAILED) {
+             printf("Error mapping database file %s!\n", DB_FILENAME);
+             exit(1);
+         }
+     }
+     
+     customer_count = db_header->customer_count;
+     ledger_count = db_header->ledger_count;
+     loadMappedBillIdOffset();
+     
+     if (openMappedIndex() != 0) {
+         buildMeterIndex();
+         flushMappedDatabase();
+     }
+     
+     int rollups_valid = openMappedRollups();
+     if (rollups_valid == -1) {
+         printf("Error mapping roll-up file %s!\n", ROLLUP_FILENAME);
+         exit(1);
+     }
+     if (rollups_valid == 0) {
+         printf("Rebuilding monthly roll-ups...\n");
+         rebuildRollups(&rollup_table);
+     }
+     if (!mapped_read_only) {
+         markMappedRollupsInUse();
+     }
+     
+     printf("Database mapped successfully! (%d customers, %d bills)\n", customer_count, ledger_count);
+     return 0;
+ }
+ 
+ static void flushMappedIndex() {
+     index_header->size = meter_index_size;
+     index_header->customer_count = customer_count;
+     flushMappedRange(index_header, sizeof(MappedIndexHeader) + meter_index_capacity * sizeof(int));
+ }
+ 
+ // Writes a changed customer record, plus the header and index, back to disk
+ void flushMappedCustomer(int customer_index) {
+     flushMappedRange(getCustomer(customer_index), sizeof(Customer));
+     flushMappedIndex();
+     flushMappedRange(db_header, sizeof(MappedHeader));
+ }
+ 
+ // Writes a changed bill back to disk. The row's columns are spread across its
+ // chunk, so the whole chunk is synced; only its dirty pages are written.
+ void flushMappedBill(int row) {
+     flushMappedRange(getBillChunk(row), sizeof(BillChunk));
+     flushMappedCustomer(BILL_FIELD(row, customer_index));
+ }
+ 
+ void flushMappedDatabase() {
+     for (int i = 0; i < MAX_CUSTOMER_CHUNKS && customer_chunks[i] != NULL; i++) {
+         flushMappedRange(customer_chunks[i], CUSTOMER_CHUNK_SIZE * sizeof(Customer));
+     }
+     for (int i = 0; i < MAX_BILL_CHUNKS && bill_chunks[i] != NULL; i++) {
+         flushMappedRange(bill_chunks[i], sizeof(BillChunk));
+     }
+     flushMappedIndex();
+     flushMappedRange(db_header, sizeof(MappedHeader));
+     if (rollup_header != NULL) {
+         flushMappedRollups();
+     }
+ }
+ 
+ // Writes everything back and marks the roll-ups clean on the way out, so
+ // the next start can trust them even if nothing was saved
+ void closeMappedDatabase() {
+     if (mapped_read_only) {
+         flushMappedRollups(); // Keeps them if they had to be rebuilt
+         return;
+     }
+     flushMappedDatabase();
+ }
+ 
+ // Today's day number. The local date is worked out once and reused until
+ // the clock leaves that day, so most calls cost one time() call.
+ DayNumber getToday() {
+     pthread_mutex_lock(&clock_lock);
+     if (!clock_pinned) {
+         time_t now = time(NULL);
+         if (clock_today == NO_DATE || now < clock_day_start || now >= clock_day_end) {
+             struct tm timeinfo;
+             localtime_r(&now, &timeinfo);
+             Date today = {timeinfo.tm_mday, timeinfo.tm_mon + 1, timeinfo.tm_year + 1900};
+             clock_today = getDayNumber(today);
+             
+             timeinfo.tm_hour = 0;
+             timeinfo.tm_min = 0;
+             timeinfo.tm_sec = 0;
+             timeinfo.tm_isdst = -1;
+             clock_day_start = mktime(&timeinfo);
+             timeinfo.tm_mday++;
+             timeinfo.tm_isdst = -1;
+             clock_day_end = mktime(&timeinfo);
+         }
+     }
+     DayNumber today = clock_today;
+     pthread_mutex_unlock(&clock_lock);
+     return today;
+ }
+ 
+ // Holds today's date fixed, so every bill of a batch run carries the same
+ // date even if the run crosses midnight
+ void pinClock() {
+     getToday();
+     pthread_mutex_lock(&clock_lock);
+     clock_pinned = 1;
+     pthread_mutex_unlock(&clock_lock);
+ }
+ 
+ void unpinClock() {
+     pthread_mutex_lock(&clock_lock);
+     clock_pinned = 0;
+     pthread_mutex_unlock(&clock_lock);
+ }
+ 
+ Date getCurrentDate() {
+     return getDateOfDay(getToday());
+ }
+ 
+ // Copies a customer into the next free slot, allocating a new chunk when the
+ // current one is full. Returns the new customer's index, or -1 if out of space.
+ int appendCustomer(const Customer *customer) {
+     int chunk = customer_count / CUSTOMER_CHUNK_SIZE;
+     
+     if (chunk >= MAX_CUSTOMER_CHUNKS) {
+         printf("Maximum number of customers reached!\n");
+         return -1;
+     }
+     
+     if (customer_chunks[chunk] == NULL) {
+         pthread_mutex_lock(&allocation_lock);
+         customer_chunks[chunk] = allocateChunk(CUSTOMER_CHUNK_SIZE * sizeof(Customer), 0, chunk);
+         pthread_mutex_unlock(&allocation_lock);
+         if (customer_chunks[chunk] == NULL) {
+             printf("Error allocating customer storage!\n");
+             return -1;
+         }
+     }
+     
+     // Readers that see the new count see the customer too
+     *getCustomer(customer_count) = *customer;
+     __atomic_store_n(&customer_count, customer_count + 1, __ATOMIC_RELEASE);
+     if (db_header != NULL) {
+         db_header->customer_count = customer_count;
+     }
+     return customer_count - 1;
+ }
+ 
+ // Releases all customer and bill storage and empties the customer indexes
+ void clearCustomers() {
+     for (int i = 0; i < MAX_CUSTOMER_CHUNKS && customer_chunks[i] != NULL; i++) {
+         releaseChunk(customer_chunks[i], CUSTOMER_CHUNK_SIZE * sizeof(Customer));
+         customer_chunks[i] = NULL;
+     }
+     customer_count = 0;
+     
+     for (int i = 0; i < MAX_BILL_CHUNKS && bill_chunks[i] != NULL; i++) {
+         releaseChunk(bill_chunks[i], sizeof(BillChunk));
+         bill_chunks[i] = NULL;
+     }
+     ledger_count = 0;
+     bill_id_offset = FIRST_BILL_ID;
+     
+     buildMeterIndex();
+     clearCustomerIdIndex();
+     clearSearchIndex();
+     clearRollups(&rollup_table);
+ }
+ 
+ // Reserves the next ledger row for a customer's new bill and links it into
+ // the customer's history. Returns the row, or -1 if the ledger is full.
+ int appendBill(int customer_index) {
+     pthread_mutex_lock(&allocation_lock);
+     int chunk_index = ledger_count / BILL_CHUNK_SIZE;
+     
+     if (chunk_index >= MAX_BILL_CHUNKS || ledger_count > 0x7fffffff - bill_id_offset) {
+         pthread_mutex_unlock(&allocation_lock);
+         printf("Maximum number of bills reached!\n");
+         return -1;
+     }
+     
+     if (bill_chunks[chunk_index] == NULL) {
+         bill_chunks[chunk_index] = allocateChunk(sizeof(BillChunk), 1, chunk_index);
+         if (bill_chunks[chunk_index] == NULL) {
+             pthread_mutex_unlock(&allocation_lock);
+             printf("Error allocating bill storage!\n");
+             return -1;
+         }
+     }
+     
+     // Readers that see the new count see the row's chunk too
+     int row = ledger_count;
+     __atomic_store_n(&ledger_count, row + 1, __ATOMIC_RELEASE);
+     if (db_header != NULL) {
+         db_header->ledger_count = ledger_count;
+     }
+     pthread_mutex_unlock(&allocation_lock);
+     
+     Customer *c = getCustomer(customer_index);
+     BillChunk *chunk = getBillChunk(row);
+     int i = row % BILL_CHUNK_SIZE;
+     
+     chunk->bill_id[i] = row + bill_id_offset;
+     chunk->customer_index[i] = customer_index;
+     chunk->prev_bill[i] = c->last_bill;
+     chunk->amount_received[i] = 0;
+     chunk->is_paid[i] = 0;
+     chunk->payment_method[i][0] = '\0';
+     chunk->payment_date[i] = NO_DATE;
+     
+     c->last_bill = row;
+     c->bill_count++;
+     return row;
+ }
+ 
+ // Returns the ledger row of a customer's bill, where bill_index 0 is the oldest
+ int getCustomerBill(int customer_index, int bill_index) {
+     Customer *c = getCustomer(customer_index);
+     int row = c->last_bill;
+     
+     for (int steps = c->bill_count - 1 - bill_index; steps > 0; steps--) {
+         row = BILL_FIELD(row, prev_bill);
+     }
+     return row;
+ }
+ 
+ // Fills rows with up to max_rows of the customer's most recent bills, oldest
+ // first, and returns how many were found.
+ int collectRecentBills(int customer_index, int *rows, int max_rows) {
+     Customer *c = getCustomer(customer_index);
+     int count = c->bill_count < max_rows ? c->bill_count : max_rows;
+     int row = c->last_bill;
+     
+     for (int i = count - 1; i >= 0; i--) {
+         rows[i] = row;
+         row = BILL_FIELD(row, prev_bill);
+     }
+     return count;
+ }
+ 
+ // Gathers one ledger row into a BillingInfo
+ BillingInfo getBill(int row) {
+     BillChunk *chunk = getBillChunk(row);
+     int i = row % BILL_CHUNK_SIZE;
+     BillingInfo bill;
+     
+     bill.bill_id = chunk->bill_id[i];
+     bill.bill_date = getDateOfDay(chunk->bill_date[i]);
+     bill.due_date = getDateOfDay(chunk->due_date[i]);
+     bill.meter_reading_start = chunk->meter_reading_start[i];
+     bill.meter_reading_end = chunk->meter_reading_end[i];
+     bill.total_usage = chunk->total_usage[i];
+     bill.tou_usage.peak_hours = chunk->peak_hours[i];
+     bill.tou_usage.off_peak_hours = chunk->off_peak_hours[i];
+     bill.amount = chunk->amount[i];
+     bill.is_paid = chunk->is_paid[i];
+     bill.payment_date = getDateOfDay(chunk->payment_date[i]);
+     memcpy(bill.payment_method, chunk->payment_method[i], 20);
+     
+     return bill;
+ }
+ 
+ // Converts a bill read from a file written before amounts were held in cents
+ void convertLegacyBill(const LegacyBillingInfo *legacy, BillingInfo *bill) {
+     bill->bill_id = legacy->bill_id;
+     bill->bill_date = legacy->bill_date;
+     bill->due_date = legacy->due_date;
+     bill->meter_reading_start = legacy->meter_reading_start;
+     bill->meter_reading_end = legacy->meter_reading_end;
+     bill->total_usage = legacy->total_usage;
+     bill->tou_usage = legacy->tou_usage;
+     bill->amount = toMoney(legacy->amount);
+     bill->is_paid = legacy->is_paid;
+     bill->payment_date = legacy->payment_date;
+     memcpy(bill->payment_method, legacy->payment_method, 20);
+ }
+ 
+ // Scatters a BillingInfo into the columns of an existing ledger row
+ void setBill(int row, const BillingInfo *bill) {
+     BillChunk *chunk = getBillChunk(row);
+     int i = row % BILL_CHUNK_SIZE;
+     
+     chunk->bill_id[i] = bill->bill_id;
+     chunk->bill_date[i] = getDayNumber(bill->bill_date);
+     chunk->due_date[i] = getDayNumber(bill->due_date);
+     chunk->meter_reading_start[i] = bill->meter_reading_start;
+     chunk->meter_reading_end[i] = bill->meter_reading_end;
+     chunk->total_usage[i] = bill->total_usage;
+     chunk->peak_hours[i] = bill->tou_usage.peak_hours;
+     chunk->off_peak_hours[i] = bill->tou_usage.off_peak_hours;
+     chunk->amount[i] = bill->amount;
+     chunk->is_paid[i] = bill->is_paid;
+     chunk->payment_date[i] = getDayNumber(bill->payment_date);
+     memcpy(chunk->payment_method[i], bill->payment_method, 20);
+     chunk->payment_method[i][19] = '\0';
+ }
+ 
+ void addCustomer() {
+     Customer new_customer;
+     new_customer.customer_id = customer_count + FIRST_CUSTOMER_ID;
+     new_customer.bill_count = 0;
+     new_customer.last_bill = -1;
+     new_customer.is_active = 1;
+     new_customer.connection_date = getCurrentDate();
+     
+     printf("Enter customer name: ");
+     fgets(new_customer.name, MAX_NAME_LENGTH, stdin);
+     new_customer.name[strcspn(new_customer.name, "\n")] = 0; // Remove newline
+     
+     printf("Enter address: ");
+     fgets(new_customer.address, MAX_ADDRESS_LENGTH, stdin);
+     new_customer.address[strcspn(new_customer.address, "\n")] = 0; // Remove newline
+     
+     printf("Enter phone number: ");
+     fgets(new_customer.phone, 15, stdin);
+     new_customer.phone[strcspn(new_customer.phone, "\n")] = 0; // Remove newline
+     
+     printf("Enter email: ");
+     fgets(new_customer.email, 50, stdin);
+     new_customer.email[strcspn(new_customer.email, "\n")] = 0; // Remove newline
+     
+     printf("Enter customer type (0-Residential, 1-Commercial, 2-Industrial): ");
+     int type = -1;
+     scanf("%d", &type);
+     getchar(); // Consume newline
+     if (type < RESIDENTIAL || type > INDUSTRIAL) {
+         printf("Invalid customer type!\n");
+         return;
+     }
+     new_customer.type = (CustomerType)type;
+     
+     showRatePlans();
+     printf("Enter rate plan (blank for the %s plan): ", getDefaultRatePlanName(new_customer.type));
+     fgets(new_customer.rate_plan, 20, stdin);
+     new_customer.rate_plan[strcspn(new_customer.rate_plan, "\n")] = 0; // Remove newline
+     if (new_customer.rate_plan[0] != '\0' && findRatePlan(new_customer.rate_plan) == -1) {
+         printf("Unknown rate plan %s!\n", new_customer.rate_plan);
+         return;
+     }
+     
+     printf("Enter meter number: ");
+     fgets(new_customer.meter_number, 20, stdin);
+     new_customer.meter_number[strcspn(new_customer.meter_number, "\n")] = 0; // Remove newline
+     
+     if (findCustomerByMeterNumber(new_customer.meter_number) != -1) {
+         printf("A customer with meter number %s already exists!\n", new_customer.meter_number);
+         return;
+     }
+     
+     int customer_index = appendCustomer(&new_customer);
+     if (customer_index == -1) {
+         return;
+     }
+     indexCustomerMeter(customer_index);
+     indexCustomerId(customer_index);
+     indexCustomerText(customer_index);
+     
+     printf("Customer added successfully! Customer ID: %d\n", new_customer.customer_id);
+     logCustomer(customer_index);
+ }
+ 
+ // FNV-1a hash of a meter number
+ static unsigned int hashMeterNumber(const char *meter_number) {
+     unsigned int hash = 2166136261u;
+     while (*meter_number) {
+         hash ^= (unsigned char)*meter_number++;
+         hash *= 16777619u;
+     }
+     return hash;
+ }
+ 
+ // Takes no lock, so any number of threads can look up meters while one adds
+ // customers. The index only grows into new slots, published once they are
+ // filled, and a probe that overlapped a change is repeated.
+ static int probeMeterIndex(const char *meter_number) {
+     unsigned int hash = hashMeterNumber(meter_number);
+     
+     while (1) {
+         unsigned int sequence = beginSequenceRead(&meter_index_sequence);
+         // Slots seen with a capacity are at least that large
+         int capacity = __atomic_load_n(&meter_index_capacity, __ATOMIC_ACQUIRE);
+         const int *slots = meter_index;
+         int found = -1;
+         
+         if (capacity > 0) {
+             unsigned int mask = capacity - 1;
+             unsigned int slot = hash & mask;
+             while (slots[slot] != -1) {
+                 if (strcmp(getCustomer(slots[slot])->meter_number, meter_number) == 0) {
+                     found = slots[slot];
+                     break;
+                 }
+                 slot = (slot + 1) & mask;
+             }
+         }
+         
+         if (!retrySequenceRead(&meter_index_sequence, sequence)) {
+             return found;
+         }
+     }
+ }
+ 
+ int findCustomerByMeterNumber(char *meter_number) {
+     STAT_BEGIN(find_start, STAT_FIND_METER);
+     int customer_index = probeMeterIndex(meter_number);
+     STAT_END(find_start, STAT_FIND_METER, 0);
+     return customer_index;
+ }
+ 
+ static void placeMeterSlot(int *slots, int capacity, int customer_index) {
+     unsigned int mask = capacity - 1;
+     unsigned int slot = hashMeterNumber(getCustomer(customer_index)->meter_number) & mask;
+     
+     while (slots[slot] != -1) {
+         slot = (slot + 1) & mask;
+     }
+     slots[slot] = customer_index;
+ }
+ 
+ static void insertMeterSlot(int customer_index) {
+     placeMeterSlot(meter_index, meter_index_capacity, customer_index);
+     meter_index_size++;
+ }
+ 
+ static void releaseRetiredMeterSlots() {
+     StorageMode mode = storage_mode;
+     for (int i = 0; i < retired_meter_count; i++) {
+         storage_mode = retired_meter_slots[i].mode;
+         releaseIndexSlots(retired_meter_slots[i].slots, retired_meter_slots[i].capacity);
+     }
+     storage_mode = mode;
+     retired_meter_count = 0;
+ }
+ 
+ // Moves the index into new slots. They are filled before being published,
+ // and the old ones kept for lookups that may still be probing them.
+ static void resizeMeterIndex(int capacity) {
+     int *slots = allocateIndexSlots(capacity);
+     if (slots == NULL) {
+         printf("Error allocating meter index!\n");
+         exit(1);
+     }
+     memset(slots, -1, capacity * sizeof(int));
+     for (int i = 0; i < meter_index_capacity; i++) {
+         if (meter_index[i] != -1) {
+             placeMeterSlot(slots, capacity, meter_index[i]);
+         }
+     }
+     
+     if (meter_index != NULL) {
+         retired_meter_slots[retired_meter_count++] = (RetiredSlots){meter_index, meter_index_capacity, storage_mode};
+     }
+     meter_index = slots;
+     __atomic_store_n(&meter_index_capacity, capacity, __ATOMIC_RELEASE);
+     
+     // The mapped index is built in a temporary file and swapped in once complete
+     if (storage_mode == STORAGE_MMAP) {
+         rename(INDEX_FILENAME ".tmp", INDEX_FILENAME);
+         index_header = (MappedIndexHeader *)meter_index - 1;
+     }
+ }
+ 
+ // Rebuilds the meter index from scratch, sized for the current customer count.
+ // No other thread may be using the store.
+ void buildMeterIndex() {
+     int capacity = 64;
+     while (capacity < customer_count * 2) {
+         capacity *= 2;
+     }
+     
+     releaseRetiredMeterSlots();
+     releaseIndexSlots(meter_index, meter_index_capacity);
+     meter_index = NULL;
+     meter_index_capacity = 0;
+     meter_index_size = 0;
+     resizeMeterIndex(capacity);
+     
+     for (int i = 0; i < customer_count; i++) {
+         insertMeterSlot(i);
+     }
+ }
+ 
+ void indexCustomerMeter(int customer_index) {
+     beginSequenceWrite(&meter_index_sequence);
+     // Keep the load factor at or below one half
+     if ((meter_index_size + 1) * 2 > meter_index_capacity) {
+         resizeMeterIndex(meter_index_capacity > 0 ? meter_index_capacity * 2 : 64);
+     }
+     insertMeterSlot(customer_index);
+     endSequenceWrite(&meter_index_sequence);
+ }
+ 
+ void unindexCustomerMeter(int customer_index) {
+     unsigned int mask = meter_index_capacity - 1;
+     unsigned int slot = hashMeterNumber(getCustomer(customer_index)->meter_number) & mask;
+     
+     while (meter_index[slot] != customer_index) {
+         if (meter_index[slot] == -1) {
+             return; // Not indexed
+         }
+         slot = (slot + 1) & mask;
+     }
+     
+     beginSequenceWrite(&meter_index_sequence);
+     // Backward-shift deletion keeps probe sequences intact without tombstones
+     unsigned int hole = slot;
+     slot = (slot + 1) & mask;
+     while (meter_index[slot] != -1) {
+         unsigned int home = hashMeterNumber(getCustomer(meter_index[slot])->meter_number) & mask;
+         if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+             meter_index[hole] = meter_index[slot];
+             hole = slot;
+         }
+         slot = (slot + 1) & mask;
+     }
+     meter_index[hole] = -1;
+     meter_index_size--;
+     endSequenceWrite(&meter_index_sequence);
+ }
+ 
+ // Thread-safe store operations. Any number of threads may call these at once.
+ // Readers take no lock; writers lock only the customer's shard, so bills and
+ // payments for customers in different shards proceed side by side. Everything
+ // else (the menu, reports, exports, search, loading and saving) expects to
+ // have the store to itself.
+ 
+ // Copies a customer, taking it again if a writer changed it meanwhile
+ void readCustomer(int customer_index, Customer *customer) {
+     CustomerShard *shard = getCustomerShard(customer_index);
+     unsigned int sequence;
+     do {
+         sequence = beginSequenceRead(&shard->sequence);
+         *customer = *getCustomer(customer_index);
+     } while (retrySequenceRead(&shard->sequence, sequence));
+ }
+ 
+ // Returns the index of the customer with this meter number, copied into
+ // customer, or -1 if there is none
+ int readCustomerByMeter(const char *meter_number, Customer *customer) {
+     int customer_index = probeMeterIndex(meter_number);
+     if (customer_index != -1) {
+         readCustomer(customer_index, customer);
+     }
+     return customer_index;
+ }
+ 
+ // Copies up to max_bills of a customer's most recent bills, oldest first,
+ // and returns how many were copied
+ int readRecentBills(int customer_index, BillingInfo *bills, int max_bills) {
+     CustomerShard *shard = getCustomerShard(customer_index);
+     unsigned int sequence;
+     int count;
+     do {
+         sequence = beginSequenceRead(&shard->sequence);
+         Customer *c = getCustomer(customer_index);
+         int rows = __atomic_load_n(&ledger_count, __ATOMIC_ACQUIRE);
+         int row = c->last_bill;
+         count = c->bill_count < max_bills ? c->bill_count : max_bills;
+         
+         // A copy torn by a writer may hold any row, so stay inside the ledger
+         for (int i = count - 1; i >= 0 && row >= 0 && row < rows; i--) {
+             bills[i] = getBill(row);
+             row = BILL_FIELD(row, prev_bill);
+         }
+     } while (retrySequenceRead(&shard->sequence, sequence));
+     return count;
+ }
+ 
+ static void beginCustomerWrite(int customer_index) {
+     CustomerShard *shard = getCustomerShard(customer_index);
+     pthread_mutex_lock(&shard->lock);
+     beginSequenceWrite(&shard->sequence);
+     in_store_operation = 1;
+ }
+ 
+ // Runs a checkpoint the log asked for while store operations held locks.
+ // Taking every lock a writer could hold means no change is half made.
+ static void runDueCheckpoint() {
+     if (__atomic_load_n(&log_records, __ATOMIC_RELAXED) < CHECKPOINT_INTERVAL) {
+         return;
+     }
+     pthread_mutex_lock(&customer_add_lock);
+     for (int i = 0; i < CUSTOMER_SHARDS; i++) {
+         pthread_mutex_lock(&customer_shards[i].lock);
+     }
+     if (log_records >= CHECKPOINT_INTERVAL) {
+         checkpoint();
+     }
+     for (int i = CUSTOMER_SHARDS - 1; i >= 0; i--) {
+         pthread_mutex_unlock(&customer_shards[i].lock);
+     }
+     pthread_mutex_unlock(&customer_add_lock);
+ }
+ 
+ static void endCustomerWrite(int customer_index) {
+     CustomerShard *shard = getCustomerShard(customer_index);
+     in_store_operation = 0;
+     endSequenceWrite(&shard->sequence);
+     pthread_mutex_unlock(&shard->lock);
+     if (commit_mode == COMMIT_WAIT) {
+         waitForLogCommit();
+     }
+     runDueCheckpoint();
+ }
+ 
+ // Adds and logs a bill for the customer. The reading is checked under the
+ // customer's lock, so two bills for one meter cannot both pass the check.
+ // Returns the bill's ledger row, -1 if the ledger is full, or -2 if the
+ // reading is below the previous one.
+ int addBillLocked(int customer_index, float meter_reading_end, TimeOfUseUsage tou_usage) {
+     beginCustomerWrite(customer_index);
+     Customer *c = getCustomer(customer_index);
+     int row = -2;
+     if (c->last_bill == -1 || meter_reading_end >= BILL_FIELD(c->last_bill, meter_reading_end)) {
+         // Replay adds new bills in row order, so no other row may be
+         // reserved between this one and its log record
+         int logging = log_file != NULL;
+         if (logging) {
+             pthread_mutex_lock(&new_bill_lock);
+         }
+         row = createBill(customer_index, meter_reading_end, tou_usage) == -1 ? -1 : c->last_bill;
+         if (row >= 0) {
+             logBill(row);
+         }
+         if (logging) {
+             pthread_mutex_unlock(&new_bill_lock);
+         }
+     }
+     endCustomerWrite(customer_index);
+     return row;
+ }
+ 
+ // Marks one of the customer's bills paid and logs it. Returns 0 on success,
+ // 1 if it was already paid, or -1 if the customer has no bill with that ID.
+ int payBillLocked(int customer_index, int bill_id, const char *payment_method) {
+     beginCustomerWrite(customer_index);
+     int row = getCustomer(customer_index)->last_bill;
+     while (row != -1 && BILL_FIELD(row, bill_id) != bill_id) {
+         row = BILL_FIELD(row, prev_bill);
+     }
+     
+     int result = -1;
+     if (row != -1) {
+         result = BILL_FIELD(row, is_paid) ? 1 : 0;
+         if (result == 0) {
+             markBillPaid(row, payment_method);
+         }
+     }
+     endCustomerWrite(customer_index);
+     return result;
+ }
+ 
+ // Adds, logs and indexes a customer, giving it the next customer ID (the
+ // caller's customer_id is ignored). Lookups carry on meanwhile; adds wait
+ // for each other. The customer is logged before it can be found by meter
+ // number, so its bills follow it in the log. Returns the new customer's
+ // index, or -1 if the meter number or the ID is taken or the store is full.
+ int addCustomerLocked(const Customer *customer) {
+     pthread_mutex_lock(&customer_add_lock);
+     in_store_operation = 1;
+     int customer_index = -1;
+     Customer added = *customer;
+     added.customer_id = customer_count + FIRST_CUSTOMER_ID;
+     if (probeMeterIndex(added.meter_number) == -1 && findCustomerById(added.customer_id) == -1) {
+         customer_index = appendCustomer(&added);
+     }
+     if (customer_index != -1) {
+         logCustomer(customer_index);
+         indexCustomerMeter(customer_index);
+         indexCustomerId(customer_index);
+         indexCustomerText(customer_index);
+     }
+     in_store_operation = 0;
+     pthread_mutex_unlock(&customer_add_lock);
+     if (commit_mode == COMMIT_WAIT) {
+         waitForLogCommit();
+     }
+     runDueCheckpoint();
+     return customer_index;
+ }
+ 
+ static inline unsigned int hashCustomerId(int customer_id) {
+     unsigned int hash = (unsigned int)customer_id * 2654435769u;
+     return hash ^ (hash >> 16);
+ }
+ 
+ static void insertSparseId(int customer_id, int customer_index) {
+     // Keep the load factor at or below one half
+     if ((sparse_id_size + 1) * 2 > sparse_id_capacity) {
+         int capacity = sparse_id_capacity > 0 ? sparse_id_capacity * 2 : 64;
+         IdSlot *slots = (IdSlot *)malloc(capacity * sizeof(IdSlot));
+         if (slots == NULL) {
+             printf("Error allocating customer ID index!\n");
+             exit(1);
+         }
+         for (int i = 0; i < capacity; i++) {
+             slots[i].customer_index = -1;
+         }
+         for (int i = 0; i < sparse_id_capacity; i++) {
+             if (sparse_id_index[i].customer_index != -1) {
+                 unsigned int slot = hashCustomerId(sparse_id_index[i].customer_id) & (capacity - 1);
+                 while (slots[slot].customer_index != -1) {
+                     slot = (slot + 1) & (capacity - 1);
+                 }
+                 slots[slot] = sparse_id_index[i];
+             }
+         }
+         free(sparse_id_index);
+         sparse_id_index = slots;
+         sparse_id_capacity = capacity;
+     }
+     
+     unsigned int mask = sparse_id_capacity - 1;
+     unsigned int slot = hashCustomerId(customer_id) & mask;
+     while (sparse_id_index[slot].customer_index != -1) {
+         slot = (slot + 1) & mask;
+     }
+     sparse_id_index[slot].customer_id = customer_id;
+     sparse_id_index[slot].customer_index = customer_index;
+     sparse_id_size++;
+ }
+ 
+ static void insertCustomerId(int customer_index) {
+     int customer_id = getCustomer(customer_index)->customer_id;
+     if (findCustomerById(customer_id) != -1) {
+         return; // The first customer with an ID keeps it, as the old scan did
+     }
+     
+     long long offset = (long long)customer_id - FIRST_CUSTOMER_ID;
+     if (offset >= id_index_capacity && offset >= 0 && offset < (long long)customer_count * 2 + 1024) {
+         int capacity = id_index_capacity > 0 ? id_index_capacity : 1024;
+         while (capacity <= offset) {
+             capacity *= 2;
+         }
+         int *slots = (int *)realloc(id_index, capacity * sizeof(int));
+         if (slots == NULL) {
+             printf("Error allocating customer ID index!\n");
+             exit(1);
+         }
+         memset(slots + id_index_capacity, -1, (capacity - id_index_capacity) * sizeof(int));
+         id_index = slots;
+         id_index_capacity = capacity;
+     }
+     
+     if (offset >= 0 && offset < id_index_capacity) {
+         id_index[offset] = customer_index;
+     } else {
+         insertSparseId(customer_id, customer_index);
+     }
+ }
+ 
+ // Picks the offset that numbers the next bill one above the highest ID in
+ // the ledger. Once bills are numbered by row, the last bill holds the
+ // highest ID, so the offset comes out the same at every load.
+ void setBillIdOffset() {
+     int highest = FIRST_BILL_ID - 1;
+     for (int row = 0; row < ledger_count; row++) {
+         if (BILL_FIELD(row, bill_id) > highest) {
+             highest = BILL_FIELD(row, bill_id);
+         }
+     }
+     bill_id_offset = highest + 1 - ledger_count;
+ }
+ 
+ // Returns the ledger row of the bill with the given ID, or -1
+ int findBillById(int bill_id) {
+     long long row = (long long)bill_id - bill_id_offset;
+     if (row >= 0 && row < ledger_count && BILL_FIELD(row, bill_id) == bill_id) {
+         return (int)row;
+     }
+     
+     // Bills numbered before IDs followed the row start with their customer's ID
+     int customer_index = findCustomerById((bill_id - 1) / 100);
+     if (bill_id <= 0 || customer_index == -1) {
+         return -1;
+     }
+     int found = getCustomer(customer_index)->last_bill;
+     while (found != -1 && BILL_FIELD(found, bill_id) != bill_id) {
+         found = BILL_FIELD(found, prev_bill);
+     }
+     return found;
+ }
+ 
+ // Returns the index of the customer with the given ID, or -1
+ int findCustomerById(int customer_id) {
+     if (!id_index_built) {
+         buildCustomerIdIndex();
+     }
+     
+     long long offset = (long long)customer_id - FIRST_CUSTOMER_ID;
+     if (offset >= 0 && offset < id_index_capacity && id_index[offset] != -1) {
+         return id_index[offset];
+     }
+     if (sparse_id_size == 0) {
+         return -1;
+     }
+     
+     // An ID can be in the hash table if it was added before the direct
+     // table grew to cover it
+     unsigned int mask = sparse_id_capacity - 1;
+     unsigned int slot = hashCustomerId(customer_id) & mask;
+     while (sparse_id_index[slot].customer_index != -1) {
+         if (sparse_id_index[slot].customer_id == customer_id) {
+             return sparse_id_index[slot].customer_index;
+         }
+         slot = (slot + 1) & mask;
+     }
+     return -1;
+ }
+ 
+ void clearCustomerIdIndex() {
+     free(id_index);
+     id_index = NULL;
+     id_index_capacity = 0;
+     free(sparse_id_index);
+     sparse_id_index = NULL;
+     sparse_id_capacity = 0;
+     sparse_id_size = 0;
+     id_index_built = 0;
+ }
+ 
+ void buildCustomerIdIndex() {
+     clearCustomerIdIndex();
+     id_index_built = 1;
+     for (int i = 0; i < customer_count; i++) {
+         insertCustomerId(i);
+     }
+ }
+ 
+ // Call after a customer is added
+ void indexCustomerId(int customer_index) {
+     if (id_index_built) {
+         insertCustomerId(customer_index);
+     }
+ }
+ 
+ static const char *getSearchFieldText(const Customer *c, SearchField field) {
+     switch (field) {
+         case SEARCH_NAME:
+             return c->name;
+         case SEARCH_METER_NUMBER:
+             return c->meter_number;
+         default:
+             return c->phone;
+     }
+ }
+ 
+ // Packs the field and the three characters at text into one key. Characters
+ // are never zero, so no key is zero.
+ static inline unsigned int getTrigramKey(SearchField field, const char *text) {
+     return ((unsigned int)field + 1) << 24 |
+            (unsigned int)(unsigned char)text[0] << 16 |
+            (unsigned int)(unsigned char)text[1] << 8 |
+            (unsigned int)(unsigned char)text[2];
+ }
+ 
+ static inline unsigned int hashTrigramKey(unsigned int key) {
+     key ^= key >> 16;
+     key *= 0x45d9f3bu;
+     key ^= key >> 16;
+     return key;
+ }
+ 
+ // Returns the posting list of a trigram, adding an empty one if create is set
+ static TrigramPostings *findTrigramPostings(unsigned int key, int create) {
+     if (create && (trigram_count + 1) * 2 > trigram_capacity) {
+         int capacity = trigram_capacity > 0 ? trigram_capacity * 2 : 4096;
+         TrigramPostings *table = (TrigramPostings *)calloc(capacity, sizeof(TrigramPostings));
+         if (table == NULL) {
+             printf("Error allocating search index!\n");
+             exit(1);
+         }
+         for (int i = 0; i < trigram_capacity; i++) {
+             if (trigram_table[i].key != 0) {
+                 unsigned int slot = hashTrigramKey(trigram_table[i].key) & (capacity - 1);
+                 while (table[slot].key != 0) {
+                     slot = (slot + 1) & (capacity - 1);
+                 }
+                 table[slot] = trigram_table[i];
+             }
+         }
+         free(trigram_table);
+         trigram_table = table;
+         trigram_capacity = capacity;
+     }
+     if (trigram_capacity == 0) {
+         return NULL;
+     }
+     
+     unsigned int mask = trigram_capacity - 1;
+     unsigned int slot = hashTrigramKey(key) & mask;
+     while (trigram_table[slot].key != key) {
+         if (trigram_table[slot].key == 0) {
+             if (!create) {
+                 return NULL;
+             }
+             trigram_table[slot].key = key;
+             trigram_count++;
+             break;
+         }
+         slot = (slot + 1) & mask;
+     }
+     return &trigram_table[slot];
+ }
+ 
+ // Position of customer_index in a posting list, or where it would be inserted
+ static int findPosting(const TrigramPostings *postings, int customer_index) {
+     int low = 0, high = postings->count;
+     while (low < high) {
+         int mid = (low + high) / 2;
+         if (postings->customers[mid] < customer_index) {
+             low = mid + 1;
+         } else {
+             high = mid;
+         }
+     }
+     return low;
+ }
+ 
+ static void addPosting(TrigramPostings *postings, int customer_index) {
+     // Customers are usually indexed in order, so most additions append
+     int pos = postings->count;
+     if (pos > 0 && postings->customers[pos - 1] >= customer_index) {
+         pos = findPosting(postings, customer_index);
+         if (postings->customers[pos] == customer_index) {
+             return; // The trigram occurs more than once in the field
+         }
+     }
+     
+     if (postings->count == postings->capacity) {
+         int capacity = postings->capacity > 0 ? postings->capacity * 2 : 4;
+         int *customers = (int *)realloc(postings->customers, capacity * sizeof(int));
+         if (customers == NULL) {
+             printf("Error allocating search index!\n");
+             exit(1);
+         }
+         postings->customers = customers;
+         postings->capacity = capacity;
+     }
+     memmove(&postings->customers[pos + 1], &postings->customers[pos],
+             (postings->count - pos) * sizeof(int));
+     postings->customers[pos] = customer_index;
+     postings->count++;
+ }
+ 
+ static void removePosting(TrigramPostings *postings, int customer_index) {
+     int pos = findPosting(postings, customer_index);
+     if (pos < postings->count && postings->customers[pos] == customer_index) {
+         memmove(&postings->customers[pos], &postings->customers[pos + 1],
+                 (postings->count - pos - 1) * sizeof(int));
+         postings->count--;
+     }
+ }
+ 
+ static void updateSearchTerms(int customer_index, int adding) {
+     const Customer *c = getCustomer(customer_index);
+     for (SearchField field = SEARCH_NAME; field <= SEARCH_PHONE; field++) {
+         const char *text = getSearchFieldText(c, field);
+         for (int i = 0; text[i] != '\0' && text[i + 1] != '\0' && text[i + 2] != '\0'; i++) {
+             TrigramPostings *postings = findTrigramPostings(getTrigramKey(field, text + i), adding);
+             if (adding) {
+                 addPosting(postings, customer_index);
+             } else if (postings != NULL) {
+                 removePosting(postings, customer_index);
+             }
+         }
+     }
+ }
+ 
+ // Releases the search index; the next search builds it again
+ void clearSearchIndex() {
+     for (int i = 0; i < trigram_capacity; i++) {
+         free(trigram_table[i].customers);
+     }
+     free(trigram_table);
+     trigram_table = NULL;
+     trigram_capacity = 0;
+     trigram_count = 0;
+     search_index_built = 0;
+ }
+ 
+ void buildSearchIndex() {
+     clearSearchIndex();
+     search_index_built = 1;
+     for (int i = 0; i < customer_count; i++) {
+         updateSearchTerms(i, 1);
+     }
+ }
+ 
+ // Call after a customer is added or its searchable fields change
+ void indexCustomerText(int customer_index) {
+     if (search_index_built) {
+         updateSearchTerms(customer_index, 1);
+     }
+ }
+ 
+ // Call before a customer's searchable fields change
+ void unindexCustomerText(int customer_index) {
+     if (search_index_built) {
+         updateSearchTerms(customer_index, 0);
+     }
+ }
+ 
+ // Finds the customers whose field contains term, in customer order. Terms of
+ // three or more characters are looked up in the search index and only the
+ // customers holding all of their trigrams are checked; shorter terms are
+ // matched against every customer. Returns the number of matches and sets
+ // matches to a malloc'd array of customer indexes, or returns -1.
+ int findCustomersByText(SearchField field, const char *term, int **matches) {
+     int term_length = strlen(term);
+     int count = 0;
+     *matches = NULL;
+     
+     if (term_length < 3) {
+         *matches = (int *)malloc((customer_count > 0 ? customer_count : 1) * sizeof(int));
+         if (*matches == NULL) {
+             return -1;
+         }
+         for (int i = 0; i < customer_count; i++) {
+             if (strstr(getSearchFieldText(getCustomer(i), field), term) != NULL) {
+                 (*matches)[count++] = i;
+             }
+         }
+         return count;
+     }
+     
+     if (!search_index_built) {
+         buildSearchIndex();
+     }
+     
+     // Intersect the posting lists from the shortest up, so the candidate set
+     // shrinks as early as possible
+     int list_count = term_length - 2;
+     TrigramPostings **lists = (TrigramPostings **)malloc(list_count * sizeof(TrigramPostings *));
+     if (lists == NULL) {
+         return -1;
+     }
+     for (int i = 0; i < list_count; i++) {
+         TrigramPostings *postings = findTrigramPostings(getTrigramKey(field, term + i), 0);
+         if (postings == NULL || postings->count == 0) {
+             free(lists);
+             return 0;
+         }
+         int j = i;
+         while (j > 0 && lists[j - 1]->count > postings->count) {
+             lists[j] = lists[j - 1];
+             j--;
+         }
+         lists[j] = postings;
+     }
+     
+     *matches = (int *)malloc(lists[0]->count * sizeof(int));
+     if (*matches == NULL) {
+         free(lists);
+         return -1;
+     }
+     memcpy(*matches, lists[0]->customers, lists[0]->count * sizeof(int));
+     count = lists[0]->count;
+     
+     for (int i = 1; i < list_count && count > 0; i++) {
+         const int *customers = lists[i]->customers;
+         int list_size = lists[i]->count;
+         int pos = 0, kept = 0;
+         for (int m = 0; m < count && pos < list_size; m++) {
+             // Candidates ascend, so gallop forward from the last position
+             int target = (*matches)[m];
+             int step = 1;
+             while (pos + step < list_size && customers[pos + step] < target) {
+                 pos += step;
+                 step *= 2;
+             }
+             int low = pos, high = pos + step < list_size ? pos + step + 1 : list_size;
+             while (low < high) {
+                 int mid = (low + high) / 2;
+                 if (customers[mid] < target) {
+                     low = mid + 1;
+                 } else {
+                     high = mid;
+                 }
+             }
+             pos = low;
+             if (pos < list_size && customers[pos] == target) {
+                 (*matches)[kept++] = target;
+             }
+         }
+         count = kept;
+     }
+     free(lists);
+     
+     // Holding every trigram does not mean they are in the right order
+     int kept = 0;
+     for (int m = 0; m < count; m++) {
+         if (strstr(getSearchFieldText(getCustomer((*matches)[m]), field), term) != NULL) {
+             (*matches)[kept++] = (*matches)[m];
+         }
+     }
+     return kept;
+ }
+ 
+ void displayCustomer(int index) {
+     Customer c = *getCustomer(index);
+     printf("\n------ Customer Details ------\n");
+     printf("ID: %d\n", c.customer_id);
+     printf("Name: %s\n", c.name);
+     printf("Address: %s\n", c.address);
+     printf("Phone: %s\n", c.phone);
+     printf("Email: %s\n", c.email);
+     printf("Meter Number: %s\n", c.meter_number);
+     printf("Customer Type: %s\n", c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"));
+     printf("Rate Plan: %s\n", rate_plans[getCustomerRatePlan(&c)].name);
+     printf("Connection Date: %02d/%02d/%d\n", c.connection_date.day, c.connection_date.month, c.connection_date.year);
+     printf("Active Status: %s\n", c.is_active ? "Active" : "Inactive");
+     printf("Number of Bills: %d\n", c.bill_count);
+     printf("-----------------------------\n");
+ }
+ 
+ // Compiles a plan's tiers into cumulative costs and pads the unused tiers.
+ // Tier starts must begin at 0 and increase. Returns 0 on success, -1 if the
+ // tiers are invalid.
+ int compileRatePlan(RatePlan *plan) {
+     if (plan->tier_count < 1 || plan->tier_count > MAX_RATE_TIERS || plan->tier_start[0] != 0) {
+         return -1;
+     }
+     
+     plan->tier_cost[0] = 0;
+     for (int k = 1; k < plan->tier_count; k++) {
+         if (plan->tier_start[k] <= plan->tier_start[k - 1]) {
+             return -1;
+         }
+         plan->tier_cost[k] = plan->tier_cost[k - 1] +
+                              (plan->tier_start[k] - plan->tier_start[k - 1]) * plan->tier_rate[k - 1];
+     }
+     
+     for (int k = plan->tier_count; k < MAX_RATE_TIERS; k++) {
+         plan->tier_start[k] = INFINITY;
+         plan->tier_rate[k] = 0;
+         plan->tier_cost[k] = 0;
+     }
+     return 0;
+ }
+ 
+ int findRatePlan(const char *name) {
+     for (int i = 0; i < rate_plan_count; i++) {
+         if (strcmp(rate_plans[i].name, name) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ // Adds a plan, replacing any plan of the same name. Returns its index, or -1
+ // if the table is full.
+ static int addRatePlan(const RatePlan *plan) {
+     int index = findRatePlan(plan->name);
+     if (index == -1) {
+         if (rate_plan_count == MAX_RATE_PLANS) {
+             return -1;
+         }
+         index = rate_plan_count++;
+     }
+     rate_plans[index] = *plan;
+     return index;
+ }
+ 
+ const char *getDefaultRatePlanName(CustomerType type) {
+     return type == RESIDENTIAL ? "residential" : (type == COMMERCIAL ? "commercial" : "industrial");
+ }
+ 
+ // Loads the built-in plans, then the plans in filename if it exists.
+ // A plan starts with a line
+ //     plan <name> <base charge> <peak rate> <off-peak rate> <tax rate>
+ // followed by one line per tier, in order:
+ //     tier <first unit> <rate per unit>
+ // The first tier starts at 0 and the last one has no upper limit. Blank lines
+ // and lines starting with '#' are ignored. Plans named after a customer type
+ // replace that type's built-in plan.
+ void loadRatePlans(const char *filename) {
+     rate_plan_count = 0;
+     for (int i = 0; i < 3; i++) {
+         RatePlan plan;
+         memset(&plan, 0, sizeof(RatePlan));
+         snprintf(plan.name, sizeof(plan.name), "%s", getDefaultRatePlanName(rates[i].type));
+         plan.base_charge = rates[i].base_charge;
+         plan.peak_rate = rates[i].peak_rate;
+         plan.off_peak_rate = rates[i].off_peak_rate;
+         plan.tax_rate = rates[i].tax_rate;
+         plan.tier_count = 3;
+         plan.tier_start[1] = 100;
+         plan.tier_start[2] = 300;
+         plan.tier_rate[0] = rates[i].tier1_rate;
+         plan.tier_rate[1] = rates[i].tier2_rate;
+         plan.tier_rate[2] = rates[i].tier3_rate;
+         compileRatePlan(&plan);
+         addRatePlan(&plan);
+     }
+     
+     FILE *file = fopen(filename, "r");
+     if (file == NULL) {
+         return;
+     }
+     
+     char line[256];
+     int line_number = 0;
+     int loaded = 0;
+     int have_plan = 0;
+     RatePlan plan;
+     
+     // Each plan is compiled and added once the next one starts, or at the end
+     for (;;) {
+         char *keyword = NULL;
+         char *rest = NULL;
+         char name[sizeof(plan.name)];
+         double values[4];
+         int at_end = fgets(line, sizeof(line), file) == NULL;
+         
+         if (!at_end) {
+             line_number++;
+             keyword = strtok(line, " \t\r\n");
+             if (keyword == NULL || keyword[0] == '#') {
+                 continue;
+             }
+             rest = strtok(NULL, "");
+         }
+         
+         if (have_plan && (at_end || strcmp(keyword, "plan") == 0)) {
+             if (compileRatePlan(&plan) != 0) {
+                 printf("Rate plan %s has invalid tiers, skipped\n", plan.name);
+             } else if (addRatePlan(&plan) == -1) {
+                 printf("Too many rate plans, %s skipped\n", plan.name);
+             } else {
+                 loaded++;
+             }
+             have_plan = 0;
+         }
+         if (at_end) {
+             break;
+         }
+         
+         if (strcmp(keyword, "plan") == 0 && rest != NULL &&
+             sscanf(rest, "%19s %lf %lf %lf %lf", name, &values[0], &values[1], &values[2], &values[3]) == 5) {
+             memset(&plan, 0, sizeof(RatePlan));
+             strcpy(plan.name, name);
+             plan.base_charge = values[0];
+             plan.peak_rate = values[1];
+             plan.off_peak_rate = values[2];
+             plan.tax_rate = values[3];
+             have_plan = 1;
+         } else if (strcmp(keyword, "tier") == 0 && have_plan && rest != NULL &&
+                    sscanf(rest, "%lf %lf", &values[0], &values[1]) == 2) {
+             if (plan.tier_count >= MAX_RATE_TIERS) {
+                 plan.tier_count = MAX_RATE_TIERS + 1; // Too many tiers, rejected when compiled
+                 continue;
+             }
+             plan.tier_start[plan.tier_count] = values[0];
+             plan.tier_rate[plan.tier_count] = values[1];
+             plan.tier_count++;
+         } else {
+             printf("Line %d: invalid rate plan line, skipped\n", line_number);
+         }
+     }
+     
+     fclose(file);
+     printf("Loaded %d rate plans from %s.\n", loaded, filename);
+ }
+ 
+ // The customer's own plan, or the default plan for their type if they have
+ // none or it is no longer defined
+ int getCustomerRatePlan(const Customer *c) {
+     int plan = c->rate_plan[0] != '\0' ? findRatePlan(c->rate_plan) : -1;
+     return plan != -1 ? plan : findRatePlan(getDefaultRatePlanName(c->type));
+ }
+ 
+ void showRatePlans() {
+     printf("\n===== Rate Plans =====\n");
+     printf("%-20s %-8s %-8s %-10s %-6s %s\n", "Plan", "Base", "Peak", "Off-Peak", "Tax", "Tiers (from units: rate)");
+     printf("----------------------------------------------------------------------\n");
+     for (int i = 0; i < rate_plan_count; i++) {
+         RatePlan *plan = &rate_plans[i];
+         printf("%-20s %-8.2f %-8.2f %-10.2f %-6.2f", plan->name, plan->base_charge, plan->peak_rate,
+                plan->off_peak_rate, plan->tax_rate);
+         for (int k = 0; k < plan->tier_count; k++) {
+             printf(" %.0f: %.2f", plan->tier_start[k], plan->tier_rate[k]);
+         }
+         printf("\n");
+     }
+     printf("----------------------------------------------------------------------\n");
+ }
+ 
+ // Index of the tier that usage falls in: a binary search that always takes
+ // log2(MAX_RATE_TIERS) steps
+ static inline int findRateTier(const RatePlan *plan, double usage) {
+     int tier = 0;
+     for (int step = MAX_RATE_TIERS / 2; step > 0; step /= 2) {
+         tier += (usage >= plan->tier_start[tier + step]) * step;
+     }
+     return tier;
+ }
+ 
+ // Rates a bill in double precision and rounds the total to cents once
+ Money calculateBillAmount(const RatePlan *plan, float usage, TimeOfUseUsage tou_usage) {
+     STAT_BEGIN(rate_start, STAT_CALCULATE_BILL);
+     double amount = plan->base_charge;
+     
+     // Cost of the lower tiers plus the usage within this one
+     int tier = findRateTier(plan, usage);
+     amount += plan->tier_cost[tier] + (usage - plan->tier_start[tier]) * plan->tier_rate[tier];
+     
+     // Add time-of-use charges
+     amount += tou_usage.peak_hours * plan->peak_rate;
+     amount += tou_usage.off_peak_hours * plan->off_peak_rate;
+     
+     // Add tax
+     amount += amount * plan->tax_rate;
+     
+     Money total = toMoney(amount);
+     STAT_END(rate_start, STAT_CALCULATE_BILL, 0);
+     return total;
+ }
+ 
+ // Rates TARIFF_LANES bills without branching. Each lane's tier is found with
+ // the fixed-step search and its rates gathered from its own plan; the rest is
+ // lane-wise arithmetic, with the terms added and rounded in the same order as
+ // calculateBillAmount() so the results are exactly the same.
+ static inline void rateLanes(const int *plans, FloatLanes usage, FloatLanes peak, FloatLanes off_peak,
+                              Money *amounts) {
+     DoubleLanes start, rate, cost, amount, peak_rate, off_peak_rate, tax_rate;
+     for (int l = 0; l < TARIFF_LANES; l++) {
+         const RatePlan *plan = &rate_plans[plans[l]];
+         int tier = findRateTier(plan, usage[l]);
+         start[l] = plan->tier_start[tier];
+         rate[l] = plan->tier_rate[tier];
+         cost[l] = plan->tier_cost[tier];
+         amount[l] = plan->base_charge;
+         peak_rate[l] = plan->peak_rate;
+         off_peak_rate[l] = plan->off_peak_rate;
+         tax_rate[l] = plan->tax_rate;
+     }
+     
+     amount += cost + (__builtin_convertvector(usage, DoubleLanes) - start) * rate;
+     amount += __builtin_convertvector(peak, DoubleLanes) * peak_rate;
+     amount += __builtin_convertvector(off_peak, DoubleLanes) * off_peak_rate;
+     amount += amount * tax_rate;
+     
+     // Round to cents as toMoney() does, halves away from zero
+     MoneyLanes negative = amount < 0;
+     DoubleLanes half = (DoubleLanes){0} + 0.5;
+     DoubleLanes rounding = (DoubleLanes)(((MoneyLanes)-half & negative) | ((MoneyLanes)half & ~negative));
+     MoneyLanes cents = __builtin_convertvector(amount * MONEY_SCALE + rounding, MoneyLanes);
+     memcpy(amounts, &cents, sizeof(cents));
+ }
+ 
+ // Rates count bills at once; amounts[i] equals calculateBillAmount() for
+ // rate plan plans[i], usages[i] and the time-of-use split in peak_hours[i]
+ // and off_peak_hours[i].
+ void calculateBillAmounts(const int *plans, const float *usages, const float *peak_hours,
+                           const float *off_peak_hours, Money *amounts, int count) {
+     STAT_BEGIN(batch_start, STAT_RATE_BATCH);
+     FloatLanes usage, peak, off_peak;
+     int i = 0;
+     
+     for (; i + TARIFF_LANES <= count; i += TARIFF_LANES) {
+         memcpy(&usage, &usages[i], sizeof(usage));
+         memcpy(&peak, &peak_hours[i], sizeof(peak));
+         memcpy(&off_peak, &off_peak_hours[i], sizeof(off_peak));
+         rateLanes(&plans[i], usage, peak, off_peak, &amounts[i]);
+     }
+     
+     // The last few bills go through the same lanes, padded with zeros
+     int left = count - i;
+     if (left > 0) {
+         int plan[TARIFF_LANES] = {0};
+         Money amount[TARIFF_LANES];
+         memset(&usage, 0, sizeof(usage));
+         memset(&peak, 0, sizeof(peak));
+         memset(&off_peak, 0, sizeof(off_peak));
+         memcpy(plan, &plans[i], left * sizeof(int));
+         memcpy(&usage, &usages[i], left * sizeof(float));
+         memcpy(&peak, &peak_hours[i], left * sizeof(float));
+         memcpy(&off_peak, &off_peak_hours[i], left * sizeof(float));
+         rateLanes(plan, usage, peak, off_peak, amount);
+         memcpy(&amounts[i], amount, left * sizeof(Money));
+     }
+     STAT_END(batch_start, STAT_RATE_BATCH, 0);
+ }
+ 
+ // Appends a bill with its readings filled in but not yet rated or added to
+ // the roll-ups. Returns the ledger row, or -1 if the ledger is full.
+ static int appendUnratedBill(int customer_index, float meter_reading_end, TimeOfUseUsage tou_usage) {
+     Customer *c = getCustomer(customer_index);
+     
+     // The new bill starts where the previous one ended
+     float previous_reading = 0;
+     if (c->last_bill != -1) {
+         previous_reading = BILL_FIELD(c->last_bill, meter_reading_end);
+     }
+     
+     int row = appendBill(customer_index);
+     if (row == -1) {
+         return -1;
+     }
+     
+     BillChunk *chunk = getBillChunk(row);
+     int i = row % BILL_CHUNK_SIZE;
+     
+     chunk->bill_date[i] = getToday();
+     chunk->due_date[i] = chunk->bill_date[i] + 15; // Due in 15 days
+     
+     chunk->meter_reading_start[i] = previous_reading;
+     chunk->meter_reading_end[i] = meter_reading_end;
+     chunk->total_usage[i] = meter_reading_end - previous_reading;
+     chunk->peak_hours[i] = tou_usage.peak_hours;
+     chunk->off_peak_hours[i] = tou_usage.off_peak_hours;
+     
+     return row;
+ }
+ 
+ // Appends a new bill for the customer and returns its index in the billing history,
+ // or -1 if the ledger is full. Does not prompt or persist; callers are responsible for saving.
+ int createBill(int customer_index, float meter_reading_end, TimeOfUseUsage tou_usage) {
+     Customer *c = getCustomer(customer_index);
+     int bill_index = c->bill_count;
+     int row = appendUnratedBill(customer_index, meter_reading_end, tou_usage);
+     if (row == -1) {
+         return -1;
+     }
+     
+     // Calculate bill amount
+     BILL_FIELD(row, amount) = calculateBillAmount(&rate_plans[getCustomerRatePlan(c)], BILL_FIELD(row, total_usage),
+                                                   tou_usage);
+     
+     pthread_mutex_lock(&rollup_lock);
+     applyBillToRollups(&rollup_table, row, 1);
+     pthread_mutex_unlock(&rollup_lock);
+     return bill_index;
+ }
+ 
+ void generateBill(int customer_index) {
+     float meter_reading_end;
+     TimeOfUseUsage tou_usage;
+     
+     printf("Enter current meter reading: ");
+     scanf("%f", &meter_reading_end);
+     getchar(); // Consume newline
+     
+     printf("Enter peak hours usage (2pm-8pm): ");
+     scanf("%f", &tou_usage.peak_hours);
+     getchar(); // Consume newline
+     
+     printf("Enter off-peak hours usage (8pm-2pm): ");
+     scanf("%f", &tou_usage.off_peak_hours);
+     getchar(); // Consume newline
+     
+     int bill_index = createBill(customer_index, meter_reading_end, tou_usage);
+     if (bill_index == -1) {
+         return;
+     }
+     
+     printf("Bill generated successfully!\n");
+     displayBill(customer_index, bill_index);
+     logBill(getCustomer(customer_index)->last_bill);
+ }
+ 
+ void displayBill(int customer_index, int bill_index) {
+     Customer c = *getCustomer(customer_index);
+     BillingInfo bill = getBill(getCustomerBill(customer_index, bill_index));
+     
+     printf("\n========== ELECTRIC BILL ==========\n");
+     printf("Bill ID: %d\n", bill.bill_id);
+     printf("Date: %02d/%02d/%d\n", bill.bill_date.day, bill.bill_date.month, bill.bill_date.year);
+     printf("Due Date: %02d/%02d/%d\n", bill.due_date.day, bill.due_date.month, bill.due_date.year);
+     printf("Customer ID: %d\n", c.customer_id);
+     printf("Name: %s\n", c.name);
+     printf("Address: %s\n", c.address);
+     printf("Meter Number: %s\n", c.meter_number);
+     printf("Customer Type: %s\n", c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"));
+     printf("-------------------------------\n");
+     printf("Previous Reading: %.2f units\n", bill.meter_reading_start);
+     printf("Current Reading: %.2f units\n", bill.meter_reading_end);
+     printf("Total Consumption: %.2f units\n", bill.total_usage);
+     printf("-------------------------------\n");
+     printf("Peak Hours Usage (2pm-8pm): %.2f units\n", bill.tou_usage.peak_hours);
+     printf("Off-Peak Hours Usage (8pm-2pm): %.2f units\n", bill.tou_usage.off_peak_hours);
+     printf("-------------------------------\n");
+     printf("Total Amount Due: $%.2f\n", moneyToUnits(bill.amount));
+     printf("Payment Status: %s\n", bill.is_paid ? "Paid" : "Unpaid");
+     
+     Money received = BILL_FIELD(getCustomerBill(customer_index, bill_index), amount_received);
+     if (!bill.is_paid && received > 0) {
+         printf("Part Payments: $%.2f (Balance: $%.2f)\n", moneyToUnits(received), moneyToUnits(bill.amount - received));
+     }
+     
+     if (bill.is_paid) {
+         printf("Payment Date: %02d/%02d/%d\n", bill.payment_date.day, bill.payment_date.month, bill.payment_date.year);
+         printf("Payment Method: %s\n", bill.payment_method);
+     }
+     
+     printf("===============================\n");
+ }
+ 
+ void recordPayment(int customer_index, int bill_index) {
+     int row = getCustomerBill(customer_index, bill_index);
+     
+     if (BILL_FIELD(row, is_paid)) {
+         printf("This bill is already paid!\n");
+         return;
+     }
+     
+     char payment_method[20];
+     printf("Enter payment method (Cash/Credit Card/Bank Transfer): ");
+     fgets(payment_method, 20, stdin);
+     payment_method[strcspn(payment_method, "\n")] = 0; // Remove newline
+     markBillPaid(row, payment_method);
+     
+     printf("Payment recorded successfully!\n");
+ }
+ 
+ // Marks a bill paid on the given day and updates the roll-ups. The caller
+ // logs or saves the change.
+ void applyBillPayment(int row, const char *payment_method, DayNumber payment_date) {
+     BillChunk *chunk = getBillChunk(row);
+     int i = row % BILL_CHUNK_SIZE;
+     
+     pthread_mutex_lock(&rollup_lock);
+     applyBillToRollups(&rollup_table, row, -1);
+     chunk->is_paid[i] = 1;
+     chunk->payment_date[i] = payment_date;
+     snprintf(chunk->payment_method[i], 20, "%s", payment_method);
+     applyBillToRollups(&rollup_table, row, 1);
+     pthread_mutex_unlock(&rollup_lock);
+ }
+ 
+ // Records money received towards a bill that still leaves it open and
+ // updates the roll-ups. The caller logs or saves the change.
+ void applyPartPayment(int row, Money amount) {
+     BillChunk *chunk = getBillChunk(row);
+     int i = row % BILL_CHUNK_SIZE;
+     
+     pthread_mutex_lock(&rollup_lock);
+     applyBillToRollups(&rollup_table, row, -1);
+     chunk->amount_received[i] += amount;
+     applyBillToRollups(&rollup_table, row, 1);
+     pthread_mutex_unlock(&rollup_lock);
+ }
+ 
+ // Marks a bill paid today, updates the roll-ups and logs the change
+ void markBillPaid(int row, const char *payment_method) {
+     applyBillPayment(row, payment_method, getToday());
+     logBill(row);
+ }
+ 
+ void showPaymentHistory(int customer_index) {
+     Customer c = *getCustomer(customer_index);
+     
+     printf("\n===== Payment History for %s =====\n", c.name);
+     
+     if (c.bill_count == 0) {
+         printf("No payment history found!\n");
+         return;
+     }
+     
+     int *rows = malloc(c.bill_count * sizeof(int));
+     if (rows == NULL) {
+         printf("Error allocating payment history!\n");
+         return;
+     }
+     int bill_count = collectRecentBills(customer_index, rows, c.bill_count);
+     
+     for (int i = 0; i < bill_count; i++) {
+         BillingInfo bill = getBill(rows[i]);
+         printf("Bill ID: %d, Date: %02d/%02d/%d, Amount: $%.2f, Status: %s\n",
+                bill.bill_id, bill.bill_date.day, bill.bill_date.month, bill.bill_date.year,
+                moneyToUnits(bill.amount), bill.is_paid ? "Paid" : "Unpaid");
+         
+         if (bill.is_paid) {
+             printf("  Payment Date: %02d/%02d/%d, Method: %s\n",
+                    bill.payment_date.day, bill.payment_date.month, bill.payment_date.year,
+                    bill.payment_method);
+         }
+     }
+     
+     free(rows);
+     printf("===================================\n");
+ }
+ 
+ void compareWithPreviousBill(int customer_index) {
+     Customer c = *getCustomer(customer_index);
+     
+     if (c.bill_count < 2) {
+         printf("Not enough bills for comparison!\n");
+         return;
+     }
+     
+     BillingInfo current = getBill(c.last_bill);
+     BillingInfo previous = getBill(BILL_FIELD(c.last_bill, prev_bill));
+     
+     float usage_diff = current.total_usage - previous.total_usage;
+     Money amount_diff = current.amount - previous.amount;
+     float usage_diff_percent = (usage_diff / previous.total_usage) * 100;
+     float amount_diff_percent = (double)amount_diff / previous.amount * 100;
+     
+     printf("\n===== Bill Comparison =====\n");
+     printf("Current Bill (%02d/%02d/%d): $%.2f, %.2f units\n",
+            current.bill_date.day, current.bill_date.month, current.bill_date.year,
+            moneyToUnits(current.amount), current.total_usage);
+     
+     printf("Previous Bill (%02d/%02d/%d): $%.2f, %.2f units\n",
+            previous.bill_date.day, previous.bill_date.month, previous.bill_date.year,
+            moneyToUnits(previous.amount), previous.total_usage);
+     
+     printf("---------------------------\n");
+     printf("Usage Difference: %.2f units (%.2f%%)\n", usage_diff, usage_diff_percent);
+     printf("Amount Difference: $%.2f (%.2f%%)\n", moneyToUnits(amount_diff), amount_diff_percent);
+     printf("===========================\n");
+     
+     if (usage_diff_percent > 20) {
+         printf("\nALERT: Your usage has increased by more than 20%% compared to last month!\n");
+         printf("Tips to reduce consumption:\n");
+         printf("1. Turn off lights when not in use\n");
+         printf("2. Use energy-efficient appliances\n");
+         printf("3. Reduce air conditioning usage\n");
+         printf("4. Check for electrical leakages\n");
+     }
+ }
+ 
+ // Projects next month's usage and amount from the trend of the recent bills.
+ // Returns -1 if the customer has no bills.
+ int getBillProjection(int customer_index, float *projected_usage, Money *projected_amount) {
+     Customer *c = getCustomer(customer_index);
+     if (c->bill_count == 0) {
+         return -1;
+     }
+     
+     int rows[MAX_HISTORY];
+     int bill_count = collectRecentBills(customer_index, rows, MAX_HISTORY);
+     BillingInfo last_bill = getBill(rows[bill_count - 1]);
+     
+     // Get average increase if we have multiple bills
+     float avg_usage_increase = 0;
+     if (bill_count > 1) {
+         float total_increase = 0;
+         for (int i = 1; i < bill_count; i++) {
+             total_increase += BILL_FIELD(rows[i], total_usage) - BILL_FIELD(rows[i - 1], total_usage);
+         }
+         avg_usage_increase = total_increase / (bill_count - 1);
+     }
+     
+     *projected_usage = last_bill.total_usage + avg_usage_increase;
+     
+     // Assume same time-of-use distribution
+     TimeOfUseUsage projected_tou;
+     float tou_ratio = last_bill.total_usage > 0 ? 
+                      (last_bill.tou_usage.peak_hours / last_bill.total_usage) : 0.3;
+     
+     projected_tou.peak_hours = *projected_usage * tou_ratio;
+     projected_tou.off_peak_hours = *projected_usage * (1 - tou_ratio);
+     
+     *projected_amount = calculateBillAmount(&rate_plans[getCustomerRatePlan(c)], *projected_usage, projected_tou);
+     return 0;
+ }
+ 
+ void projectNextBill(int customer_index) {
+     float projected_usage;
+     Money projected_amount;
+     if (getBillProjection(customer_index, &projected_usage, &projected_amount) != 0) {
+         printf("No previous bill found for projection!\n");
+         return;
+     }
+     BillingInfo last_bill = getBill(getCustomer(customer_index)->last_bill);
+     
+     printf("\n===== Next Month's Bill Projection =====\n");
+     printf("Projected Usage: %.2f units\n", projected_usage);
+     printf("Projected Amount: $%.2f\n", moneyToUnits(projected_amount));
+     printf("---------------------------------------\n");
+     printf("Last Month's Usage: %.2f units\n", last_bill.total_usage);
+     printf("Last Month's Amount: $%.2f\n", moneyToUnits(last_bill.amount));
+     printf("=======================================\n");
+     
+     // Provide energy-saving tips
+     printf("\nEnergy-Saving Tips:\n");
+     printf("1. Switch to LED bulbs to save up to 80%% on lighting costs\n");
+     printf("2. Use smart power strips to eliminate phantom power usage\n");
+     printf("3. Adjust your thermostat by 1-2 degrees to save up to 10%% on heating/cooling\n");
+     printf("4. Shift energy-intensive activities to off-peak hours (8pm-2pm)\n");
+ }
+ 
+ // Compares the latest bill's usage with the average of the recent bills.
+ // Returns -1 if the customer has no bills.
+ int getUsageAlert(int customer_index, UsageAlert *alert) {
+     if (getCustomer(customer_index)->bill_count == 0) {
+         return -1;
+     }
+     
+     int rows[MAX_HISTORY];
+     int bill_count = collectRecentBills(customer_index, rows, MAX_HISTORY);
+     int last_row = rows[bill_count - 1];
+     
+     // Calculate average usage from recent bills
+     float total_usage = 0;
+     for (int i = 0; i < bill_count; i++) {
+         total_usage += BILL_FIELD(rows[i], total_usage);
+     }
+     alert->last_usage = BILL_FIELD(last_row, total_usage);
+     alert->average_usage = total_usage / bill_count;
+     
+     alert->has_change = bill_count > 1;
+     alert->monthly_change = 0;
+     if (alert->has_change) {
+         float previous_usage = BILL_FIELD(rows[bill_count - 2], total_usage);
+         alert->monthly_change = ((alert->last_usage - previous_usage) / previous_usage) * 100;
+     }
+     
+     if (alert->last_usage > alert->average_usage * 1.2) {
+         alert->level = 1;
+     } else if (alert->last_usage < alert->average_usage * 0.8) {
+         alert->level = -1;
+     } else {
+         alert->level = 0;
+     }
+     alert->peak_percentage = (BILL_FIELD(last_row, peak_hours) / alert->last_usage) * 100;
+     return 0;
+ }
+ 
+ void generateEnergyUsageAlert(int customer_index) {
+     Customer c = *getCustomer(customer_index);
+     UsageAlert alert;
+     
+     if (getUsageAlert(customer_index, &alert) != 0) {
+         printf("No bills found for analysis!\n");
+         return;
+     }
+     
+     printf("\n===== Energy Usage Analysis =====\n");
+     printf("Customer: %s\n", c.name);
+     printf("Meter Number: %s\n", c.meter_number);
+     printf("Last Month's Usage: %.2f units\n", alert.last_usage);
+     printf("Average Monthly Usage: %.2f units\n", alert.average_usage);
+     
+     if (alert.has_change) {
+         printf("Monthly Change: %.2f%%\n", alert.monthly_change);
+     }
+     
+     printf("-------------------------------\n");
+     
+     if (alert.level > 0) {
+         printf("ALERT: Your usage is %.2f%% above your average!\n", 
+               ((alert.last_usage / alert.average_usage) - 1) * 100);
+         
+         printf("\nPossible causes of high consumption:\n");
+         printf("1. Weather changes (heating/cooling)\n");
+         printf("2. New appliances or electronic devices\n");
+         printf("3. Increased occupancy\n");
+         printf("4. Faulty appliances or electrical leakages\n");
+         
+         printf("\nRecommended actions:\n");
+         printf("1. Schedule an energy audit\n");
+         printf("2. Check for appliances left on standby\n");
+         printf("3. Inspect for electrical leakages\n");
+         printf("4. Consider smart home energy monitoring\n");
+     } else if (alert.level < 0) {
+         printf("NOTICE: Your usage is %.2f%% below your average. Good job!\n", 
+               (1 - (alert.last_usage / alert.average_usage)) * 100);
+     } else {
+         printf("Your usage is within normal range.\n");
+     }
+     
+     // Time of use analysis
+     printf("\nPeak Hours Usage: %.2f%% of total\n", alert.peak_percentage);
+     
+     if (alert.peak_percentage > 40) {
+         printf("TIP: You can save money by shifting usage to off-peak hours (8pm-2pm).\n");
+         printf("Activities to consider shifting:\n");
+         printf("- Laundry\n");
+         printf("- Dishwashing\n");
+         printf("- Electric vehicle charging\n");
+         printf("- Heavy machinery operation\n");
+     }
+     
+     printf("===============================\n");
+ }
+ 
+ void updateCustomerInfo(int customer_index) {
+    if (customer_index == -1) {
+        printf("Enter meter number: ");
+        char meter_number[20];
+        fgets(meter_number, 20, stdin);
+        meter_number[strcspn(meter_number, "\n")] = 0; // Remove newline
+        
+        customer_index = findCustomerByMeterNumber(meter_number);
+        
+        if (customer_index == -1) {
+            printf("Customer not found!\n");
+            return;
+        }
+    }
+    
+    Customer *c = getCustomer(customer_index);
+    int choice;
+    
+    printf("\n===== Update Customer Information =====\n");
+    printf("1. Update Name\n");
+    printf("2. Update Address\n");
+    printf("3. Update Phone\n");
+    printf("4. Update Email\n");
+    printf("5. Update Customer Type\n");
+    printf("6. Change Active Status\n");
+    printf("7. Update Meter Number\n");
+    printf("8. Update Rate Plan\n");
+    printf("0. Back to Main Menu\n");
+    printf("Enter your choice: ");
+    scanf("%d", &choice);
+    getchar(); // Consume newline
+    
+    switch (choice) {
+        case 1:
+            printf("Current Name: %s\n", c->name);
+            printf("Enter new name: ");
+            unindexCustomerText(customer_index);
+            fgets(c->name, MAX_NAME_LENGTH, stdin);
+            c->name[strcspn(c->name, "\n")] = 0; // Remove newline
+            indexCustomerText(customer_index);
+            printf("Name updated successfully!\n");
+            break;
+            
+        case 2:
+            printf("Current Address: %s\n", c->address);
+            printf("Enter new address: ");
+            fgets(c->address, MAX_ADDRESS_LENGTH, stdin);
+            c->address[strcspn(c->address, "\n")] = 0; // Remove newline
+            printf("Address updated successfully!\n");
+            break;
+            
+        case 3:
+            printf("Current Phone: %s\n", c->phone);
+            printf("Enter new phone: ");
+            unindexCustomerText(customer_index);
+            fgets(c->phone, 15, stdin);
+            c->phone[strcspn(c->phone, "\n")] = 0; // Remove newline
+            indexCustomerText(customer_index);
+            printf("Phone updated successfully!\n");
+            break;
+            
+        case 4:
+            printf("Current Email: %s\n", c->email);
+            printf("Enter new email: ");
+            fgets(c->email, 50, stdin);
+            c->email[strcspn(c->email, "\n")] = 0; // Remove newline
+            printf("Email updated successfully!\n");
+            break;
+            
+        case 5:
+            printf("Current Customer Type: %s\n", 
+                   c->type == RESIDENTIAL ? "Residential" : 
+                   (c->type == COMMERCIAL ? "Commercial" : "Industrial"));
+            printf("Enter new customer type (0-Residential, 1-Commercial, 2-Industrial): ");
+            int type;
+            scanf("%d", &type);
+            getchar(); // Consume newline
+            if (type < RESIDENTIAL || type > INDUSTRIAL) {
+                printf("Invalid customer type!\n");
+                return;
+            }
+            // The customer's bills now count towards the new type's totals
+            applyCustomerToRollups(&rollup_table, customer_index, -1);
+            c->type = (CustomerType)type;
+            applyCustomerToRollups(&rollup_table, customer_index, 1);
+            printf("Customer type updated successfully!\n");
+            break;
+            
+        case 6:
+            printf("Current Status: %s\n", c->is_active ? "Active" : "Inactive");
+            printf("Change status to %s? (1-Yes, 0-No): ", c->is_active ? "Inactive" : "Active");
+            int status;
+            scanf("%d", &status);
+            getchar(); // Consume newline
+            if (status == 1) {
+                c->is_active = !c->is_active;
+                printf("Status updated successfully!\n");
+            }
+            break;
+            
+        case 7: {
+            printf("Current Meter Number: %s\n", c->meter_number);
+            printf("Enter new meter number: ");
+            char new_meter_number[20];
+            fgets(new_meter_number, 20, stdin);
+            new_meter_number[strcspn(new_meter_number, "\n")] = 0; // Remove newline
+            
+            if (findCustomerByMeterNumber(new_meter_number) != -1) {
+                printf("A customer with meter number %s already exists!\n", new_meter_number);
+                return;
+            }
+            
+            unindexCustomerMeter(customer_index);
+            unindexCustomerText(customer_index);
+            strcpy(c->meter_number, new_meter_number);
+            indexCustomerMeter(customer_index);
+            indexCustomerText(customer_index);
+            printf("Meter number updated successfully!\n");
+            break;
+        }
+            
+        case 8: {
+            printf("Current Rate Plan: %s\n", rate_plans[getCustomerRatePlan(c)].name);
+            showRatePlans();
+            printf("Enter new rate plan (blank for the %s plan): ", getDefaultRatePlanName(c->type));
+            char new_rate_plan[20];
+            fgets(new_rate_plan, 20, stdin);
+            new_rate_plan[strcspn(new_rate_plan, "\n")] = 0; // Remove newline
+            
+            if (new_rate_plan[0] != '\0' && findRatePlan(new_rate_plan) == -1) {
+                printf("Unknown rate plan %s!\n", new_rate_plan);
+                return;
+            }
+            
+            // Only bills generated from now on use the new plan
+            strcpy(c->rate_plan, new_rate_plan);
+            printf("Rate plan updated successfully!\n");
+            break;
+        }
+            
+        case 0:
+            return;
+            
+        default:
+            printf("Invalid choice!\n");
+            return;
+    }
+    
+    logCustomer(customer_index);
+}
+
+void showAllCustomers() {
+    if (customer_count == 0) {
+        printf("No customers found!\n");
+        return;
+    }
+    
+    printf("\n===== All Customers =====\n");
+    printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
+    printf("---------------------------------------------------------------\n");
+    
+    for (int i = 0; i < customer_count; i++) {
+        Customer c = *getCustomer(i);
+        printf("%-5d %-20s %-15s %-15s %-10s\n", 
+               c.customer_id, 
+               c.name, 
+               c.meter_number, 
+               c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
+               c.is_active ? "Active" : "Inactive");
+    }
+    
+    printf("---------------------------------------------------------------\n");
+    printf("Total Customers: %d\n", customer_count);
+}
+
+void searchCustomer() {
+    if (customer_count == 0) {
+        printf("No customers found!\n");
+        return;
+    }
+    
+    int choice;
+    printf("\n===== Search Customer =====\n");
+    printf("1. Search by Name\n");
+    printf("2. Search by Meter Number\n");
+    printf("3. Search by Customer ID\n");
+    printf("4. Search by Phone\n");
+    printf("Enter your choice: ");
+    scanf("%d", &choice);
+    getchar(); // Consume newline
+    
+    char search_term[MAX_NAME_LENGTH];
+    int found = 0;
+    int *matches = NULL;
+    int match_count = 0;
+    
+    switch (choice) {
+        case 1:
+            printf("Enter customer name: ");
+            fgets(search_term, MAX_NAME_LENGTH, stdin);
+            search_term[strcspn(search_term, "\n")] = 0; // Remove newline
+            
+            printf("\n--- Search Results ---\n");
+            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
+            printf("---------------------------------------------------------------\n");
+            
+            match_count = findCustomersByText(SEARCH_NAME, search_term, &matches);
+            for (int m = 0; m < match_count; m++) {
+                Customer c = *getCustomer(matches[m]);
+                printf("%-5d %-20s %-15s %-15s %-10s\n", 
+                       c.customer_id, 
+                       c.name, 
+                       c.meter_number, 
+                       c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
+                       c.is_active ? "Active" : "Inactive");
+                found++;
+            }
+            break;
+            
+        case 2:
+            printf("Enter meter number: ");
+            fgets(search_term, MAX_NAME_LENGTH, stdin);
+            search_term[strcspn(search_term, "\n")] = 0; // Remove newline
+            
+            printf("\n--- Search Results ---\n");
+            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
+            printf("---------------------------------------------------------------\n");
+            
+            match_count = findCustomersByText(SEARCH_METER_NUMBER, search_term, &matches);
+            for (int m = 0; m < match_count; m++) {
+                Customer c = *getCustomer(matches[m]);
+                printf("%-5d %-20s %-15s %-15s %-10s\n", 
+                       c.customer_id, 
+                       c.name, 
+                       c.meter_number, 
+                       c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
+                       c.is_active ? "Active" : "Inactive");
+                found++;
+            }
+            break;
+            
+        case 3:
+            printf("Enter customer ID: ");
+            int search_id;
+            scanf("%d", &search_id);
+            getchar(); // Consume newline
+            
+            printf("\n--- Search Results ---\n");
+            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
+            printf("---------------------------------------------------------------\n");
+            
+            int id_match = findCustomerById(search_id);
+            if (id_match != -1) {
+                Customer c = *getCustomer(id_match);
+                printf("%-5d %-20s %-15s %-15s %-10s\n", 
+                       c.customer_id, 
+                       c.name, 
+                       c.meter_number, 
+                       c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
+                       c.is_active ? "Active" : "Inactive");
+                found++;
+            }
+            break;
+            
+        case 4:
+            printf("Enter phone number: ");
+            fgets(search_term, MAX_NAME_LENGTH, stdin);
+            search_term[strcspn(search_term, "\n")] = 0; // Remove newline
+            
+            printf("\n--- Search Results ---\n");
+            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
+            printf("---------------------------------------------------------------\n");
+            
+            match_count = findCustomersByText(SEARCH_PHONE, search_term, &matches);
+            for (int m = 0; m < match_count; m++) {
+                Customer c = *getCustomer(matches[m]);
+                printf("%-5d %-20s %-15s %-15s %-10s\n", 
+                       c.customer_id, 
+                       c.name, 
+                       c.meter_number, 
+                       c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
+                       c.is_active ? "Active" : "Inactive");
+                found++;
+            }
+            break;
+            
+        default:
+            printf("Invalid choice!\n");
+            return;
+    }
+    free(matches);
+    if (match_count < 0) {
+        printf("Error allocating search results!\n");
+        return;
+    }
+    
+    printf("---------------------------------------------------------------\n");
+    printf("Total Results: %d\n", found);
+    
+    if (found > 0) {
+        printf("\nDo you want to view details of any customer? (1-Yes, 0-No): ");
+        int view;
+        scanf("%d", &view);
+        getchar(); // Consume newline
+        
+        if (view == 1) {
+            printf("Enter Customer ID: ");
+            int id;
+            scanf("%d", &id);
+            getchar(); // Consume newline
+            
+            int id_match = findCustomerById(id);
+            if (id_match != -1) {
+                displayCustomer(id_match);
+                return;
+            }
+            
+            printf("Customer with ID %d not found!\n", id);
+        }
+    }
+}
+static inline double getRankingValue(const ConsumerRanking *ranking, RankingKey key) {
+    return key == RANK_BY_AMOUNT ? ranking->amount : ranking->usage;
+}
+
+// Returns 1 if a ranks ahead of b: a larger key, with ties going to the
+// lower customer index so that rankings never depend on the order of offers
+static inline int ranksAhead(const ConsumerRanking *a, const ConsumerRanking *b, RankingKey key) {
+    double value_a = getRankingValue(a, key);
+    double value_b = getRankingValue(b, key);
+    if (value_a != value_b) {
+        return value_a > value_b;
+    }
+    return a->customer_index < b->customer_index;
+}
+
+// Restores the heap below pos in a min-heap of rankings (lowest-ranked at the root)
+static void siftRankingDown(ConsumerRanking *heap, int count, int pos, RankingKey key) {
+    ConsumerRanking moving = heap[pos];
+    while (1) {
+        int child = pos * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && ranksAhead(&heap[child], &heap[child + 1], key)) {
+            child++;
+        }
+        if (!ranksAhead(&moving, &heap[child], key)) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = moving;
+}
+
+// Returns 0 on success, -1 if memory ran out
+int initTopConsumers(TopConsumers *top, int k, RankingKey key) {
+    top->capacity = k > 0 ? k : 1;
+    top->count = 0;
+    top->key = key;
+    top->entries = malloc(top->capacity * sizeof(ConsumerRanking));
+    return top->entries != NULL ? 0 : -1;
+}
+
+// Keeps the candidate if it ranks among the K best seen so far. O(log K).
+void offerTopConsumer(TopConsumers *top, const ConsumerRanking *candidate) {
+    if (top->count < top->capacity) {
+        // Sift up from the new leaf
+        int pos = top->count++;
+        while (pos > 0) {
+            int parent = (pos - 1) / 2;
+            if (!ranksAhead(&top->entries[parent], candidate, top->key)) {
+                break;
+            }
+            top->entries[pos] = top->entries[parent];
+            pos = parent;
+        }
+        top->entries[pos] = *candidate;
+    } else if (ranksAhead(candidate, &top->entries[0], top->key)) {
+        top->entries[0] = *candidate;
+        siftRankingDown(top->entries, top->count, 0, top->key);
+    }
+}
+
+// Sorts the entries best first and returns how many there are. No more
+// candidates may be offered afterwards.
+int finishTopConsumers(TopConsumers *top) {
+    // Heap sort: moving the lowest-ranked root to the end leaves the best first
+    for (int end = top->count - 1; end > 0; end--) {
+        ConsumerRanking lowest = top->entries[0];
+        top->entries[0] = top->entries[end];
+        top->entries[end] = lowest;
+        siftRankingDown(top->entries, end, 0, top->key);
+    }
+    return top->count;
+}
+
+void freeTopConsumers(TopConsumers *top) {
+    free(top->entries);
+    top->entries = NULL;
+    top->count = 0;
+}
+
+static inline int hashCustomerIndex(int customer_index, int slot_capacity) {
+    return (int)(((unsigned int)customer_index * 2654435761u) & (unsigned int)(slot_capacity - 1));
+}
+
+static void swapMonitoredHeap(ApproxTopConsumers *approx, int a, int b) {
+    int entry = approx->heap[a];
+    approx->heap[a] = approx->heap[b];
+    approx->heap[b] = entry;
+    approx->entries[approx->heap[a]].heap_position = a;
+    approx->entries[approx->heap[b]].heap_position = b;
+}
+
+// Moves a monitored customer whose total grew towards the leaves of the heap
+static void siftMonitoredDown(ApproxTopConsumers *approx, int pos) {
+    while (1) {
+        int child = pos * 2 + 1;
+        if (child >= approx->count) {
+            break;
+        }
+        if (child + 1 < approx->count &&
+            ranksAhead(&approx->entries[approx->heap[child]].ranking,
+                       &approx->entries[approx->heap[child + 1]].ranking, approx->key)) {
+            child++;
+        }
+        if (!ranksAhead(&approx->entries[approx->heap[pos]].ranking,
+                        &approx->entries[approx->heap[child]].ranking, approx->key)) {
+            break;
+        }
+        swapMonitoredHeap(approx, pos, child);
+        pos = child;
+    }
+}
+
+// Removes a customer from the slot table, shifting later slots of the probe
+// sequence back so lookups never stop early
+static void removeMonitoredSlot(ApproxTopConsumers *approx, int customer_index) {
+    int mask = approx->slot_capacity - 1;
+    int slot = hashCustomerIndex(customer_index, approx->slot_capacity);
+    while (approx->entries[approx->slots[slot]].ranking.customer_index != customer_index) {
+        slot = (slot + 1) & mask;
+    }
+    
+    int next = (slot + 1) & mask;
+    while (approx->slots[next] != -1) {
+        int home = hashCustomerIndex(approx->entries[approx->slots[next]].ranking.customer_index, approx->slot_capacity);
+        // Move the entry back if its home is not between the hole and its slot
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            approx->slots[slot] = approx->slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    approx->slots[slot] = -1;
+}
+
+// Monitors at most capacity customers. Returns 0 on success, -1 if memory ran out.
+int initApproxTopConsumers(ApproxTopConsumers *approx, int capacity, RankingKey key) {
+    approx->capacity = capacity > 0 ? capacity : 1;
+    approx->count = 0;
+    approx->key = key;
+    approx->slot_capacity = 1;
+    while (approx->slot_capacity < approx->capacity * 2) {
+        approx->slot_capacity *= 2;
+    }
+    
+    approx->entries = malloc(approx->capacity * sizeof(MonitoredConsumer));
+    approx->heap = malloc(approx->capacity * sizeof(int));
+    approx->slots = malloc(approx->slot_capacity * sizeof(int));
+    if (approx->entries == NULL || approx->heap == NULL || approx->slots == NULL) {
+        freeApproxTopConsumers(approx);
+        return -1;
+    }
+    for (int i = 0; i < approx->slot_capacity; i++) {
+        approx->slots[i] = -1;
+    }
+    return 0;
+}
+
+// Adds one bill's usage and amount to a customer's running total
+void addApproxConsumerUsage(ApproxTopConsumers *approx, int customer_index, float usage, Money amount) {
+    int mask = approx->slot_capacity - 1;
+    int slot = hashCustomerIndex(customer_index, approx->slot_capacity);
+    while (approx->slots[slot] != -1) {
+        MonitoredConsumer *monitored = &approx->entries[approx->slots[slot]];
+        if (monitored->ranking.customer_index == customer_index) {
+            monitored->ranking.usage += usage;
+            monitored->ranking.amount += amount;
+            siftMonitoredDown(approx, monitored->heap_position);
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    
+    int entry;
+    if (approx->count < approx->capacity) {
+        // A free counter: append it as a leaf and sift it up
+        entry = approx->count;
+        MonitoredConsumer *monitored = &approx->entries[entry];
+        monitored->ranking.customer_index = customer_index;
+        monitored->ranking.usage = usage;
+        monitored->ranking.amount = amount;
+        monitored->error = 0;
+        monitored->heap_position = approx->count;
+        approx->heap[approx->count++] = entry;
+        
+        int pos = monitored->heap_position;
+        while (pos > 0 && ranksAhead(&approx->entries[approx->heap[(pos - 1) / 2]].ranking,
+                                     &monitored->ranking, approx->key)) {
+            swapMonitoredHeap(approx, pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
+        }
+    } else {
+        // Take over the lowest-ranked counter, keeping its total as the error
+        entry = approx->heap[0];
+        MonitoredConsumer *monitored = &approx->entries[entry];
+        removeMonitoredSlot(approx, monitored->ranking.customer_index);
+        
+        monitored->error = getRankingValue(&monitored->ranking, approx->key);
+        monitored->ranking.customer_index = customer_index;
+        monitored->ranking.usage += usage;
+        monitored->ranking.amount += amount;
+        siftMonitoredDown(approx, 0);
+        
+        // The removal may have shifted slots, so probe again for a free one
+        slot = hashCustomerIndex(customer_index, approx->slot_capacity);
+        while (approx->slots[slot] != -1) {
+            slot = (slot + 1) & mask;
+        }
+    }
+    approx->slots[slot] = entry;
+}
+
+// Fills top (already initialised, with its own K and key) with the
+// best-ranked monitored customers, best first. Their totals are upper bounds.
+// Returns the number of entries.
+int getApproxTopConsumers(ApproxTopConsumers *approx, TopConsumers *top) {
+    for (int i = 0; i < approx->count; i++) {
+        offerTopConsumer(top, &approx->entries[i].ranking);
+    }
+    return finishTopConsumers(top);
+}
+
+void freeApproxTopConsumers(ApproxTopConsumers *approx) {
+    free(approx->entries);
+    free(approx->heap);
+    free(approx->slots);
+    approx->entries = NULL;
+    approx->heap = NULL;
+    approx->slots = NULL;
+    approx->count = 0;
+}
+
+// Adds the bills in ledger rows [first_row, end_row) to a partial report.
+// Each bill is visited once and updates every section's accumulators.
+static void aggregateReportRows(Date report_date, int first_row, int end_row, ReportTotals *partial) {
+    DayNumber month_start = getMonthStart(report_date.year, report_date.month);
+    DayNumber month_end = getMonthStart(report_date.year, report_date.month + 1);
+    
+    for (int row = first_row; row < end_row; row++) {
+        BillChunk *chunk = getBillChunk(row);
+        int i = row % BILL_CHUNK_SIZE;
+        
+        // Check if the bill is from the report month
+        if (chunk->bill_date[i] >= month_start && chunk->bill_date[i] < month_end) {
+            
+            float usage = chunk->total_usage[i];
+            Money amount = chunk->amount[i];
+            int customer_index = chunk->customer_index[i];
+            Customer *c = getCustomer(customer_index);
+            
+            partial->bills_generated++;
+            partial->total_billed_amount += amount;
+            partial->total_usage += usage;
+            
+            if (chunk->is_paid[i]) {
+                partial->bills_paid++;
+                partial->total_collected_amount += amount;
+            } else {
+                // Part payments are collected; the rest is outstanding
+                partial->total_collected_amount += chunk->amount_received[i];
+                partial->total_outstanding_amount += amount - chunk->amount_received[i];
+            }
+            
+            partial->usage_by_type[c->type] += usage;
+            partial->amount_by_type[c->type] += amount;
+            
+            partial->peak_usage += chunk->peak_hours[i];
+            partial->off_peak_usage += chunk->off_peak_hours[i];
+            
+            // A customer's monthly total is taken once, at their newest bill.
+            // Bills are appended in date order, so the earlier bills of the
+            // month are the ones just behind it in the customer's history.
+            if (c->last_bill == row) {
+                float monthly_usage = 0;
+                Money monthly_amount = 0;
+                for (int r = row; r != -1; r = BILL_FIELD(r, prev_bill)) {
+                    if (BILL_FIELD(r, bill_date) < month_start) {
+                        break;
+                    }
+                    monthly_usage += BILL_FIELD(r, total_usage);
+                    monthly_amount += BILL_FIELD(r, amount);
+                }
+                
+                if (monthly_usage > 0) {
+                    ConsumerRanking ranking = {customer_index, monthly_usage, monthly_amount};
+                    offerTopConsumer(&partial->top_consumers, &ranking);
+                }
+            }
+        }
+        
+        // Payment methods count bills paid in the report month
+        if (chunk->is_paid[i] && 
+            chunk->payment_date[i] >= month_start && chunk->payment_date[i] < month_end) {
+            
+            // Check if payment method already exists in stats
+            int found = 0;
+            for (int k = 0; k < partial->payment_methods_count; k++) {
+                if (strcmp(partial->payment_stats[k].method, chunk->payment_method[i]) == 0) {
+                    partial->payment_stats[k].count++;
+                    partial->payment_stats[k].amount += chunk->amount[i];
+                    found = 1;
+                    break;
+                }
+            }
+            
+            // If payment method not found, add it
+            if (!found && partial->payment_methods_count < MAX_PAYMENT_METHODS) {
+                PaymentMethodStats *stats = &partial->payment_stats[partial->payment_methods_count++];
+                strcpy(stats->method, chunk->payment_method[i]);
+                stats->count = 1;
+                stats->amount = chunk->amount[i];
+            }
+        }
+    }
+}
+
+// Adds one block's partial report to the running totals. Payment methods
+// keep the order in which their bills appear in the ledger.
+static void mergeReportTotals(ReportTotals *totals, const ReportTotals *partial) {
+    totals->bills_generated += partial->bills_generated;
+    totals->bills_paid += partial->bills_paid;
+    totals->total_billed_amount += partial->total_billed_amount;
+    totals->total_collected_amount += partial->total_collected_amount;
+    totals->total_outstanding_amount += partial->total_outstanding_amount;
+    totals->total_usage += partial->total_usage;
+    for (int type = RESIDENTIAL; type <= INDUSTRIAL; type++) {
+        totals->usage_by_type[type] += partial->usage_by_type[type];
+        totals->amount_by_type[type] += partial->amount_by_type[type];
+    }
+    totals->peak_usage += partial->peak_usage;
+    totals->off_peak_usage += partial->off_peak_usage;
+    
+    // Each customer ranks in exactly one block, so the top consumers of all
+    // blocks' candidates are the top consumers overall
+    for (int i = 0; i < partial->top_consumers.count; i++) {
+        offerTopConsumer(&totals->top_consumers, &partial->top_consumers.entries[i]);
+    }
+    
+    for (int i = 0; i < partial->payment_methods_count; i++) {
+        const PaymentMethodStats *stats = &partial->payment_stats[i];
+        int found = 0;
+        for (int k = 0; k < totals->payment_methods_count; k++) {
+            if (strcmp(totals->payment_stats[k].method, stats->method) == 0) {
+                totals->payment_stats[k].count += stats->count;
+                totals->payment_stats[k].amount += stats->amount;
+                found = 1;
+                break;
+            }
+        }
+        if (!found && totals->payment_methods_count < MAX_PAYMENT_METHODS) {
+            totals->payment_stats[totals->payment_methods_count++] = *stats;
+        }
+    }
+}
+
+// A report worker aggregates every stride-th block of ledger rows, starting
+// at first_block, each into its own partial
+typedef struct {
+    Date report_date;
+    ReportTotals *partials;   // one per block, shared by all workers
+    int block_count;
+    int first_block;
+    int stride;
+} ReportWorker;
+
+static void *runReportWorker(void *arg) {
+    ReportWorker *worker = arg;
+    
+    for (int block = worker->first_block; block < worker->block_count; block += worker->stride) {
+        int first_row = block * REPORT_BLOCK_ROWS;
+        int end_row = ledger_count - first_row < REPORT_BLOCK_ROWS ? ledger_count : first_row + REPORT_BLOCK_ROWS;
+        aggregateReportRows(worker->report_date, first_row, end_row, &worker->partials[block]);
+    }
+    return NULL;
+}
+
+// Returns the number of report worker threads to use for block_count blocks
+int getReportThreadCount(int block_count) {
+    int threads = report_threads;
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > MAX_REPORT_THREADS) {
+        threads = MAX_REPORT_THREADS;
+    }
+    if (threads > block_count) {
+        threads = block_count;
+    }
+    return threads > 0 ? threads : 1;
+}
+
+// Fills every report section. The ledger is cut into fixed blocks of
+// REPORT_BLOCK_ROWS rows that worker threads aggregate into private partials;
+// the partials are then merged in block order. Because the blocks and the
+// merge order never depend on the number of threads, neither do the sums,
+// and the report is byte-identical however many threads ran.
+// Returns 0 on success, -1 if memory ran out. On success the caller frees
+// the top consumers with freeTopConsumers().
+int aggregateReport(Date report_date, ReportTotals *totals) {
+    memset(totals, 0, sizeof(ReportTotals));
+    
+    for (int i = 0; i < customer_count; i++) {
+        Customer *c = getCustomer(i);
+        if (c->is_active) {
+            totals->active_customers++;
+        }
+        totals->customers_by_type[c->type]++;
+    }
+    
+    int block_count = (ledger_count + REPORT_BLOCK_ROWS - 1) / REPORT_BLOCK_ROWS;
+    ReportTotals *partials = calloc(block_count > 0 ? block_count : 1, sizeof(ReportTotals));
+    if (partials == NULL) {
+        return -1;
+    }
+    
+    int status = initTopConsumers(&totals->top_consumers, REPORT_TOP_CONSUMERS, RANK_BY_USAGE);
+    for (int block = 0; block < block_count && status == 0; block++) {
+        status = initTopConsumers(&partials[block].top_consumers, REPORT_TOP_CONSUMERS, RANK_BY_USAGE);
+    }
+    
+    if (status == 0) {
+        int thread_count = getReportThreadCount(block_count);
+        ReportWorker workers[MAX_REPORT_THREADS];
+        pthread_t threads[MAX_REPORT_THREADS];
+        int started[MAX_REPORT_THREADS];
+        
+        for (int t = 0; t < thread_count; t++) {
+            workers[t].report_date = report_date;
+            workers[t].partials = partials;
+            workers[t].block_count = block_count;
+            workers[t].first_block = t;
+            workers[t].stride = thread_count;
+            
+            // Worker 0 runs on this thread; a worker that cannot be started does too
+            started[t] = t > 0 && pthread_create(&threads[t], NULL, runReportWorker, &workers[t]) == 0;
+        }
+        for (int t = 0; t < thread_count; t++) {
+            if (!started[t]) {
+                runReportWorker(&workers[t]);
+            }
+        }
+        for (int t = 0; t < thread_count; t++) {
+            if (started[t]) {
+                pthread_join(threads[t], NULL);
+            }
+        }
+        
+        for (int block = 0; block < block_count; block++) {
+            mergeReportTotals(totals, &partials[block]);
+        }
+        finishTopConsumers(&totals->top_consumers);
+    }
+    
+    for (int block = 0; block < block_count; block++) {
+        freeTopConsumers(&partials[block].top_consumers);
+    }
+    free(partials);
+    
+    if (status != 0) {
+        freeTopConsumers(&totals->top_consumers);
+    }
+    return status;
+}
+
+// Returns the roll-up for a month, or NULL if there is none. With create set,
+// a missing month is added in order; NULL then means the table is full.
+MonthRollup *getRollup(RollupTable *table, int year, int month, int create) {
+    int key = year * 12 + month;
+    int low = 0, high = table->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int mid_key = table->months[mid].year * 12 + table->months[mid].month;
+        if (mid_key == key) {
+            return &table->months[mid];
+        }
+        if (mid_key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    
+    if (!create || table->months == NULL || table->count >= MAX_ROLLUP_MONTHS) {
+        return NULL;
+    }
+    memmove(&table->months[low + 1], &table->months[low], (table->count - low) * sizeof(MonthRollup));
+    table->count++;
+    
+    MonthRollup *rollup = &table->months[low];
+    memset(rollup, 0, sizeof(MonthRollup));
+    rollup->year = year;
+    rollup->month = month;
+    return rollup;
+}
+
+// Sums a customer's bills dated in the given month. Bills are linked newest
+// first in date order, so the walk stops at the first older month.
+static void getCustomerMonthTotals(int customer_index, int year, int month, float *usage, Money *amount) {
+    DayNumber month_start = getMonthStart(year, month);
+    DayNumber month_end = getMonthStart(year, month + 1);
+    *usage = 0;
+    *amount = 0;
+    
+    for (int row = getCustomer(customer_index)->last_bill; row != -1; row = BILL_FIELD(row, prev_bill)) {
+        DayNumber bill_date = BILL_FIELD(row, bill_date);
+        if (bill_date < month_start) {
+            break;
+        }
+        if (bill_date < month_end) {
+            *usage += BILL_FIELD(row, total_usage);
+            *amount += BILL_FIELD(row, amount);
+        }
+    }
+}
+
+// Replaces a customer's entry in a month's top consumers with their current
+// monthly totals. A customer's totals only grow as bills are added, so the
+// customers that drop out can never come back ahead of the ones kept.
+static void updateRollupTopConsumers(MonthRollup *rollup, const ConsumerRanking *ranking) {
+    int count = rollup->top_consumer_count;
+    for (int i = 0; i < count; i++) {
+        if (rollup->top_consumers[i].customer_index == ranking->customer_index) {
+            memmove(&rollup->top_consumers[i], &rollup->top_consumers[i + 1], (count - i - 1) * sizeof(ConsumerRanking));
+            count--;
+            break;
+        }
+    }
+    
+    if (ranking->usage > 0) {
+        int pos = count;
+        while (pos > 0 && ranksAhead(ranking, &rollup->top_consumers[pos - 1], RANK_BY_USAGE)) {
+            pos--;
+        }
+        if (pos < REPORT_TOP_CONSUMERS) {
+            int moved = count < REPORT_TOP_CONSUMERS ? count - pos : REPORT_TOP_CONSUMERS - pos - 1;
+            memmove(&rollup->top_consumers[pos + 1], &rollup->top_consumers[pos], moved * sizeof(ConsumerRanking));
+            rollup->top_consumers[pos] = *ranking;
+            if (count < REPORT_TOP_CONSUMERS) {
+                count++;
+            }
+        }
+    }
+    rollup->top_consumer_count = count;
+}
+
+// Adds (direction 1) or removes (direction -1) one bill's contribution to the
+// roll-ups. A bill that changes is removed in its old state and added back in
+// its new one.
+void applyBillToRollups(RollupTable *table, int row, int direction) {
+    BillChunk *chunk = getBillChunk(row);
+    int i = row % BILL_CHUNK_SIZE;
+    int customer_index = chunk->customer_index[i];
+    Customer *c = getCustomer(customer_index);
+    
+    Date bill_date = getDateOfDay(chunk->bill_date[i]);
+    MonthRollup *rollup = getRollup(table, bill_date.year, bill_date.month, direction > 0);
+    if (rollup != NULL) {
+        Money amount = direction * chunk->amount[i];
+        double usage = direction * (double)chunk->total_usage[i];
+        
+        rollup->bills_generated += direction;
+        rollup->total_billed_amount += amount;
+        rollup->total_usage += usage;
+        if (chunk->is_paid[i]) {
+            rollup->bills_paid += direction;
+            rollup->total_collected_amount += amount;
+        } else {
+            Money received = direction * chunk->amount_received[i];
+            rollup->total_collected_amount += received;
+            rollup->total_outstanding_amount += amount - received;
+        }
+        rollup->usage_by_type[c->type] += usage;
+        rollup->amount_by_type[c->type] += amount;
+        rollup->peak_usage += direction * (double)chunk->peak_hours[i];
+        rollup->off_peak_usage += direction * (double)chunk->off_peak_hours[i];
+        
+        if (direction > 0) {
+            ConsumerRanking ranking;
+            ranking.customer_index = customer_index;
+            getCustomerMonthTotals(customer_index, rollup->year, rollup->month, &ranking.usage, &ranking.amount);
+            updateRollupTopConsumers(rollup, &ranking);
+        }
+    }
+    
+    if (!chunk->is_paid[i]) {
+        return;
+    }
+    
+    // Payment methods are counted in the month the bill was paid
+    Date payment_date = getDateOfDay(chunk->payment_date[i]);
+    rollup = getRollup(table, payment_date.year, payment_date.month, direction > 0);
+    if (rollup == NULL) {
+        return;
+    }
+    for (int k = 0; k < rollup->payment_methods_count; k++) {
+        PaymentMethodStats *stats = &rollup->payment_stats[k];
+        if (strcmp(stats->method, chunk->payment_method[i]) == 0) {
+            stats->count += direction;
+            stats->amount += direction * chunk->amount[i];
+            if (stats->count == 0) {
+                memmove(stats, stats + 1, (rollup->payment_methods_count - k - 1) * sizeof(PaymentMethodStats));
+                rollup->payment_methods_count--;
+            }
+            return;
+        }
+    }
+    if (direction > 0 && rollup->payment_methods_count < MAX_PAYMENT_METHODS) {
+        PaymentMethodStats *stats = &rollup->payment_stats[rollup->payment_methods_count++];
+        strcpy(stats->method, chunk->payment_method[i]);
+        stats->count = 1;
+        stats->amount = chunk->amount[i];
+    }
+}
+
+// Adds or removes all of a customer's bills, e.g. around a change of
+// customer type, which moves their usage to another type's totals
+void applyCustomerToRollups(RollupTable *table, int customer_index, int direction) {
+    for (int row = getCustomer(customer_index)->last_bill; row != -1; row = BILL_FIELD(row, prev_bill)) {
+        applyBillToRollups(table, row, direction);
+    }
+}
+
+// Empties the table, allocating its storage the first time (file mode)
+void clearRollups(RollupTable *table) {
+    if (table->months == NULL) {
+        table->months = malloc(MAX_ROLLUP_MONTHS * sizeof(MonthRollup));
+    }
+    table->count = 0;
+}
+
+// Recomputes a table from every bill in the ledger.
+// Returns 0 on success, -1 if memory ran out.
+int rebuildRollups(RollupTable *table) {
+    clearRollups(table);
+    if (table->months == NULL) {
+        return -1;
+    }
+    for (int row = 0; row < ledger_count; row++) {
+        applyBillToRollups(table, row, 1);
+    }
+    return 0;
+}
+
+// Usage sums are floating point, so a maintained sum may differ from the
+// rebuilt one in the last bits; amounts are cents and must match exactly
+static int rollupSumsDiffer(double maintained, double rebuilt) {
+    double difference = maintained - rebuilt;
+    double scale = rebuilt < 0 ? -rebuilt : rebuilt;
+    return (difference < 0 ? -difference : difference) > 1e-9 * scale + 1e-6;
+}
+
+// Prints how a maintained month differs from the one rebuilt from the
+// ledger and returns 1 if they differ, 0 if they agree
+static int diffRollup(const MonthRollup *maintained, const MonthRollup *rebuilt) {
+    static const MonthRollup empty;
+    const MonthRollup *a = maintained != NULL ? maintained : &empty;
+    const MonthRollup *b = rebuilt != NULL ? rebuilt : &empty;
+    int year = maintained != NULL ? maintained->year : rebuilt->year;
+    int month = maintained != NULL ? maintained->month : rebuilt->month;
+    int differs = 0;
+    
+    if (a->bills_generated != b->bills_generated || a->bills_paid != b->bills_paid) {
+        printf("%02d/%d: bills generated/paid %d/%d, expected %d/%d\n", month, year,
+               a->bills_generated, a->bills_paid, b->bills_generated, b->bills_paid);
+        differs = 1;
+    }
+    
+    const char *amount_names[] = {
+        "billed amount", "collected amount", "outstanding amount",
+        "residential amount", "commercial amount", "industrial amount"
+    };
+    const Money *amounts_a = &a->total_billed_amount;
+    const Money *amounts_b = &b->total_billed_amount;
+    for (int i = 0; i < 6; i++) {
+        if (amounts_a[i] != amounts_b[i]) {
+            printf("%02d/%d: %s %.2f, expected %.2f\n", month, year, amount_names[i],
+                   moneyToUnits(amounts_a[i]), moneyToUnits(amounts_b[i]));
+            differs = 1;
+        }
+    }
+    
+    const char *usage_names[] = {
+        "usage", "residential usage", "commercial usage", "industrial usage", "peak usage", "off-peak usage"
+    };
+    const double *usages_a = &a->total_usage;
+    const double *usages_b = &b->total_usage;
+    for (int i = 0; i < 6; i++) {
+        if (rollupSumsDiffer(usages_a[i], usages_b[i])) {
+            printf("%02d/%d: %s %.2f, expected %.2f\n", month, year, usage_names[i], usages_a[i], usages_b[i]);
+            differs = 1;
+        }
+    }
+    
+    // Payment methods are listed in the order they were first used, which
+    // differs between the two, so they are matched by name
+    if (a->payment_methods_count != b->payment_methods_count) {
+        printf("%02d/%d: %d payment methods, expected %d\n", month, year,
+               a->payment_methods_count, b->payment_methods_count);
+        differs = 1;
+    }
+    for (int i = 0; i < b->payment_methods_count; i++) {
+        const PaymentMethodStats *expected = &b->payment_stats[i];
+        const PaymentMethodStats *found = NULL;
+        for (int k = 0; k < a->payment_methods_count; k++) {
+            if (strcmp(a->payment_stats[k].method, expected->method) == 0) {
+                found = &a->payment_stats[k];
+            }
+        }
+        if (found == NULL || found->count != expected->count || found->amount != expected->amount) {
+            printf("%02d/%d: payment method \"%s\" %d payments $%.2f, expected %d payments $%.2f\n",
+                   month, year, expected->method,
+                   found != NULL ? found->count : 0, found != NULL ? moneyToUnits(found->amount) : 0,
+                   expected->count, moneyToUnits(expected->amount));
+            differs = 1;
+        }
+    }
+    
+    if (a->top_consumer_count != b->top_consumer_count ||
+        memcmp(a->top_consumers, b->top_consumers, b->top_consumer_count * sizeof(ConsumerRanking)) != 0) {
+        printf("%02d/%d: top consumers differ\n", month, year);
+        differs = 1;
+    }
+    return differs;
+}
+
+// Rebuilds the roll-ups from the raw bills and compares them with the
+// maintained ones month by month, printing every difference. Returns the
+// number of months that differ, or -1 if memory ran out.
+int checkRollups() {
+    RollupTable rebuilt = {NULL, 0};
+    if (rebuildRollups(&rebuilt) != 0) {
+        return -1;
+    }
+    
+    int mismatched = 0;
+    int a = 0, b = 0;
+    while (a < rollup_table.count || b < rebuilt.count) {
+        const MonthRollup *maintained = a < rollup_table.count ? &rollup_table.months[a] : NULL;
+        const MonthRollup *expected = b < rebuilt.count ? &rebuilt.months[b] : NULL;
+        int key_a = maintained != NULL ? maintained->year * 12 + maintained->month : 0x7fffffff;
+        int key_b = expected != NULL ? expected->year * 12 + expected->month : 0x7fffffff;
+        
+        if (key_a < key_b) {
+            expected = NULL;
+            a++;
+        } else if (key_b < key_a) {
+            maintained = NULL;
+            b++;
+        } else {
+            a++;
+            b++;
+        }
+        mismatched += diffRollup(maintained, expected);
+    }
+    
+    free(rebuilt.months);
+    return mismatched;
+}
+
+// Fills the report for a month from its roll-up, without reading any bills.
+// Returns 0 on success, -1 if memory ran out. On success the caller frees
+// the top consumers with freeTopConsumers().
+int getRollupReport(Date report_date, ReportTotals *totals) {
+    memset(totals, 0, sizeof(ReportTotals));
+    
+    for (int i = 0; i < customer_count; i++) {
+        Customer *c = getCustomer(i);
+        if (c->is_active) {
+            totals->active_customers++;
+        }
+        totals->customers_by_type[c->type]++;
+    }
+    
+    if (initTopConsumers(&totals->top_consumers, REPORT_TOP_CONSUMERS, RANK_BY_USAGE) != 0) {
+        return -1;
+    }
+    
+    MonthRollup *rollup = getRollup(&rollup_table, report_date.year, report_date.month, 0);
+    if (rollup == NULL) {
+        return 0; // No bills dated or paid this month
+    }
+    
+    totals->bills_generated = rollup->bills_generated;
+    totals->bills_paid = rollup->bills_paid;
+    totals->total_billed_amount = rollup->total_billed_amount;
+    totals->total_collected_amount = rollup->total_collected_amount;
+    totals->total_outstanding_amount = rollup->total_outstanding_amount;
+    totals->total_usage = rollup->total_usage;
+    memcpy(totals->usage_by_type, rollup->usage_by_type, sizeof(totals->usage_by_type));
+    memcpy(totals->amount_by_type, rollup->amount_by_type, sizeof(totals->amount_by_type));
+    totals->peak_usage = rollup->peak_usage;
+    totals->off_peak_usage = rollup->off_peak_usage;
+    
+    memcpy(totals->payment_stats, rollup->payment_stats, sizeof(totals->payment_stats));
+    totals->payment_methods_count = rollup->payment_methods_count;
+    
+    memcpy(totals->top_consumers.entries, rollup->top_consumers, rollup->top_consumer_count * sizeof(ConsumerRanking));
+    totals->top_consumers.count = rollup->top_consumer_count;
+    return 0;
+}
+
+void generateReport() {
+    if (customer_count == 0) {
+        printf("No customers found!\n");
+        return;
+    }
+    
+    Date current_date = getCurrentDate();
+    char dated_filename[50];
+    sprintf(dated_filename, "report_%02d_%02d_%d.txt", current_date.day, current_date.month, current_date.year);
+    const char *filename = report_filename != NULL ? report_filename : dated_filename;
+    
+    // The month's totals are kept up to date as bills are generated and paid
+    ReportTotals totals;
+    STAT_BEGIN(totals_start, STAT_REPORT_TOTALS);
+    if (getRollupReport(current_date, &totals) != 0) {
+        printf("Error allocating report rankings!\n");
+        return;
+    }
+    STAT_END(totals_start, STAT_REPORT_TOTALS, 0);
+    
+    FILE *report_file = fopen(filename, "w");
+    if (report_file == NULL) {
+        printf("Error creating report file!\n");
+        freeTopConsumers(&totals.top_consumers);
+        return;
+    }
+    
+    // Report header
+    fprintf(report_file, "===============================================\n");
+    fprintf(report_file, "          ELECTRIC BILLING SYSTEM REPORT       \n");
+    fprintf(report_file, "                %02d/%02d/%d                   \n", 
+            current_date.day, current_date.month, current_date.year);
+    fprintf(report_file, "===============================================\n\n");
+    
+    // Customer summary
+    STAT_BEGIN(customers_start, STAT_REPORT_CUSTOMERS);
+    fprintf(report_file, "CUSTOMER SUMMARY\n");
+    fprintf(report_file, "-----------------\n");
+    fprintf(report_file, "Total Customers: %d\n", customer_count);
+    
+    int active_customers = totals.active_customers;
+    int residential = totals.customers_by_type[RESIDENTIAL];
+    int commercial = totals.customers_by_type[COMMERCIAL];
+    int industrial = totals.customers_by_type[INDUSTRIAL];
+    
+    fprintf(report_file, "Active Customers: %d (%.1f%%)\n", 
+            active_customers, (float)active_customers / customer_count * 100);
+    fprintf(report_file, "Inactive Customers: %d (%.1f%%)\n", 
+            customer_count - active_customers, (float)(customer_count - active_customers) / customer_count * 100);
+    fprintf(report_file, "Customer Types:\n");
+    fprintf(report_file, "  - Residential: %d (%.1f%%)\n", 
+            residential, (float)residential / customer_count * 100);
+    fprintf(report_file, "  - Commercial: %d (%.1f%%)\n", 
+            commercial, (float)commercial / customer_count * 100);
+    fprintf(report_file, "  - Industrial: %d (%.1f%%)\n\n", 
+            industrial, (float)industrial / customer_count * 100);
+    
+    STAT_END(customers_start, STAT_REPORT_CUSTOMERS, 0);
+    
+    // Billing summary for current month
+    STAT_BEGIN(billing_start, STAT_REPORT_BILLING);
+    fprintf(report_file, "BILLING SUMMARY FOR %02d/%d\n", current_date.month, current_date.year);
+    fprintf(report_file, "------------------------\n");
+    
+    int bills_generated = totals.bills_generated;
+    int bills_paid = totals.bills_paid;
+    double total_billed_amount = moneyToUnits(totals.total_billed_amount);
+    double total_collected_amount = moneyToUnits(totals.total_collected_amount);
+    double total_outstanding_amount = moneyToUnits(totals.total_outstanding_amount);
+    double total_usage = totals.total_usage;
+    
+    fprintf(report_file, "Bills Generated: %d\n", bills_generated);
+    fprintf(report_file, "Bills Paid: %d (%.1f%%)\n", 
+            bills_paid, bills_generated > 0 ? (float)bills_paid / bills_generated * 100 : 0);
+    fprintf(report_file, "Bills Unpaid: %d (%.1f%%)\n", 
+            bills_generated - bills_paid, 
+            bills_generated > 0 ? (float)(bills_generated - bills_paid) / bills_generated * 100 : 0);
+    fprintf(report_file, "Total Billed Amount: $%.2f\n", total_billed_amount);
+    fprintf(report_file, "Total Collected Amount: $%.2f (%.1f%%)\n", 
+            total_collected_amount, 
+            total_billed_amount > 0 ? total_collected_amount / total_billed_amount * 100 : 0);
+    fprintf(report_file, "Total Outstanding Amount: $%.2f (%.1f%%)\n", 
+            total_outstanding_amount, 
+            total_billed_amount > 0 ? total_outstanding_amount / total_billed_amount * 100 : 0);
+    fprintf(report_file, "Total Energy Usage: %.2f units\n\n", total_usage);
+    
+    STAT_END(billing_start, STAT_REPORT_BILLING, 0);
+    
+    // Usage by customer type
+    STAT_BEGIN(usage_start, STAT_REPORT_USAGE);
+    fprintf(report_file, "USAGE BY CUSTOMER TYPE\n");
+    fprintf(report_file, "---------------------\n");
+    
+    const char *type_names[] = {"Residential", "Commercial", "Industrial"};
+    for (int type = RESIDENTIAL; type <= INDUSTRIAL; type++) {
+        fprintf(report_file, "%s:\n", type_names[type]);
+        fprintf(report_file, "  - Usage: %.2f units (%.1f%%)\n", 
+                totals.usage_by_type[type], 
+                total_usage > 0 ? totals.usage_by_type[type] / total_usage * 100 : 0);
+        fprintf(report_file, "  - Amount: $%.2f (%.1f%%)\n%s", 
+                moneyToUnits(totals.amount_by_type[type]), 
+                total_billed_amount > 0 ? moneyToUnits(totals.amount_by_type[type]) / total_billed_amount * 100 : 0,
+                type == INDUSTRIAL ? "\n" : "");
+    }
+    
+    STAT_END(usage_start, STAT_REPORT_USAGE, 0);
+    
+    // Time of use analysis
+    STAT_BEGIN(time_of_use_start, STAT_REPORT_TIME_OF_USE);
+    fprintf(report_file, "TIME OF USE ANALYSIS\n");
+    fprintf(report_file, "-------------------\n");
+    
+    fprintf(report_file, "Peak Hours Usage (2pm-8pm): %.2f units (%.1f%%)\n", 
+            totals.peak_usage, 
+            total_usage > 0 ? totals.peak_usage / total_usage * 100 : 0);
+    fprintf(report_file, "Off-Peak Hours Usage (8pm-2pm): %.2f units (%.1f%%)\n\n", 
+            totals.off_peak_usage, 
+            total_usage > 0 ? totals.off_peak_usage / total_usage * 100 : 0);
+    
+    STAT_END(time_of_use_start, STAT_REPORT_TIME_OF_USE, 0);
+    
+    // Top consumers
+    STAT_BEGIN(top_start, STAT_REPORT_TOP_CONSUMERS);
+    fprintf(report_file, "TOP %d CONSUMERS\n", REPORT_TOP_CONSUMERS);
+    fprintf(report_file, "-------------\n");
+    
+    // aggregateReport() leaves the top consumers best first
+    ConsumerRanking *rankings = totals.top_consumers.entries;
+    int top_count = totals.top_consumers.count;
+    
+    fprintf(report_file, "%-5s %-20s %-15s %-15s %-15s\n", 
+            "Rank", "Customer Name", "Meter Number", "Usage (units)", "Amount ($)");
+    fprintf(report_file, "----------------------------------------------------------------------\n");
+    
+    for (int i = 0; i < top_count; i++) {
+        int idx = rankings[i].customer_index;
+        fprintf(report_file, "%-5d %-20s %-15s %-15.2f %-15.2f\n", 
+                i + 1, 
+                getCustomer(idx)->name, 
+                getCustomer(idx)->meter_number, 
+                rankings[i].usage, 
+                moneyToUnits(rankings[i].amount));
+    }
+    fprintf(report_file, "\n");
+    freeTopConsumers(&totals.top_consumers);
+    STAT_END(top_start, STAT_REPORT_TOP_CONSUMERS, 0);
+    
+    // Payment methods analysis (for paid bills in current month)
+    STAT_BEGIN(payments_start, STAT_REPORT_PAYMENTS);
+    fprintf(report_file, "PAYMENT METHODS ANALYSIS\n");
+    fprintf(report_file, "-----------------------\n");
+    
+    fprintf(report_file, "%-20s %-10s %-15s %-10s\n", 
+            "Payment Method", "Count", "Amount ($)", "Percentage");
+    fprintf(report_file, "------------------------------------------------------\n");
+    
+    for (int i = 0; i < totals.payment_methods_count; i++) {
+        fprintf(report_file, "%-20s %-10d %-15.2f %-10.1f%%\n", 
+                totals.payment_stats[i].method, 
+                totals.payment_stats[i].count, 
+                moneyToUnits(totals.payment_stats[i].amount),
+                total_collected_amount > 0 ? moneyToUnits(totals.payment_stats[i].amount) / total_collected_amount * 100 : 0);
+    }
+    
+    fprintf(report_file, "\n");
+    fprintf(report_file, "===============================================\n");
+    fprintf(report_file, "               END OF REPORT                   \n");
+    fprintf(report_file, "===============================================\n");
+    STAT_END(payments_start, STAT_REPORT_PAYMENTS, 0);
+    
+    // The report is buffered, so most of the writing happens here
+    STAT_BEGIN(close_start, STAT_REPORT_CLOSE);
+    fflush(report_file);
+    STAT_END(close_start, STAT_REPORT_CLOSE, ftell(report_file));
+    fclose(report_file);
+    
+    printf("Report generated successfully! Saved as %s\n", filename);
+}
+
+static const char *const customer_export_fields[] = {
+    "customer_id", "name", "address", "phone", "email", "type", "meter_number",
+    "rate_plan", "connection_date", "is_active", "bill_count", NULL
+};
+
+static const char *const bill_export_fields[] = {
+    "bill_id", "customer_id", "meter_number", "bill_date", "due_date", "meter_reading_start",
+    "meter_reading_end", "total_usage", "peak_usage", "off_peak_usage", "amount", "is_paid",
+    "payment_date", "payment_method", NULL
+};
+
+static const char *const payment_export_fields[] = {
+    "bill_id", "customer_id", "meter_number", "payment_date", "amount", "payment_method", NULL
+};
+
+static const char *const report_export_fields[] = {
+    "month", "bills_generated", "bills_paid", "billed_amount", "collected_amount",
+    "outstanding_amount", "total_usage", "peak_usage", "off_peak_usage",
+    "residential_usage", "commercial_usage", "industrial_usage",
+    "residential_amount", "commercial_amount", "industrial_amount", NULL
+};
+
+static void flushExport(ExportWriter *writer) {
+    size_t written = 0;
+    while (written < writer->used && !writer->failed) {
+        ssize_t n = write(writer->fd, writer->buffer + written, writer->used - written);
+        if (n <= 0) {
+            writer->failed = 1;
+        } else {
+            written += n;
+        }
+    }
+    writer->bytes += writer->used;
+    writer->used = 0;
+}
+
+// Makes sure a whole record fits in the buffer, so the field writers below
+// never have to check for room
+static inline void beginExportRecord(ExportWriter *writer) {
+    if (writer->used > EXPORT_BUFFER_SIZE - EXPORT_RECORD_MAX) {
+        flushExport(writer);
+    }
+}
+
+static inline void exportChar(ExportWriter *writer, char c) {
+    writer->buffer[writer->used++] = c;
+}
+
+static inline void exportText(ExportWriter *writer, const char *text, size_t length) {
+    memcpy(writer->buffer + writer->used, text, length);
+    writer->used += length;
+}
+
+// Writes the separator and, in JSON, the name of the next field
+static inline void beginExportField(ExportWriter *writer) {
+    if (writer->format == EXPORT_CSV) {
+        if (writer->field > 0) {
+            exportChar(writer, ',');
+        }
+    } else {
+        const char *name = writer->fields[writer->field];
+        exportText(writer, writer->field > 0 ? ",\"" : "{\"", 2);
+        exportText(writer, name, strlen(name));
+        exportText(writer, "\":", 2);
+    }
+    writer->field++;
+}
+
+static inline void endExportRecord(ExportWriter *writer) {
+    if (writer->format == EXPORT_JSONL) {
+        exportChar(writer, '}');
+    }
+    exportChar(writer, '\n');
+    writer->field = 0;
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes value in decimal with at least min_digits digits, two digits per step
+static inline void exportDigits(ExportWriter *writer, unsigned long long value, int min_digits) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[value * 2], 2);
+    } else {
+        *--p = (char)('0' + value);
+    }
+    while (end - p < min_digits) {
+        *--p = '0';
+    }
+    exportText(writer, p, end - p);
+}
+
+static void exportInt(ExportWriter *writer, long long value) {
+    beginExportField(writer);
+    if (value < 0) {
+        exportChar(writer, '-');
+    }
+    exportDigits(writer, value < 0 ? -(unsigned long long)value : (unsigned long long)value, 1);
+}
+
+// Writes a whole number of hundredths with two decimals, as amounts are shown
+static void exportHundredths(ExportWriter *writer, long long hundredths) {
+    beginExportField(writer);
+    unsigned long long magnitude = hundredths < 0 ? -(unsigned long long)hundredths : (unsigned long long)hundredths;
+    if (hundredths < 0) {
+        exportChar(writer, '-');
+    }
+    exportDigits(writer, magnitude / 100, 1);
+    exportChar(writer, '.');
+    exportText(writer, &digit_pairs[(magnitude % 100) * 2], 2);
+}
+
+static void exportMoney(ExportWriter *writer, Money amount) {
+    exportHundredths(writer, amount);
+}
+
+// Usage is written rounded to two decimals, as in the report
+static void exportUsage(ExportWriter *writer, double usage) {
+    exportHundredths(writer, toMoney(usage));
+}
+
+static void exportString(ExportWriter *writer, const char *text) {
+    beginExportField(writer);
+    
+    if (writer->format == EXPORT_CSV) {
+        // Quoted only when needed, with quotes doubled
+        size_t plain = strcspn(text, ",\"\r\n");
+        if (text[plain] == '\0') {
+            exportText(writer, text, plain);
+            return;
+        }
+        exportChar(writer, '"');
+        for (const char *c = text; *c; c++) {
+            if (*c == '"') {
+                exportChar(writer, '"');
+            }
+            exportChar(writer, *c);
+        }
+        exportChar(writer, '"');
+        return;
+    }
+    
+    exportChar(writer, '"');
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            exportChar(writer, '\\');
+            exportChar(writer, (char)*c);
+        } else if (*c < 0x20) {
+            exportText(writer, "\\u00", 4);
+            exportChar(writer, "0123456789abcdef"[*c >> 4]);
+            exportChar(writer, "0123456789abcdef"[*c & 15]);
+        } else {
+            exportChar(writer, (char)*c);
+        }
+    }
+    exportChar(writer, '"');
+}
+
+// Dates are written as YYYY-MM-DD, or left empty (null in JSON) when unset.
+// Bills of one run share their dates, so recent days are kept formatted.
+static void exportDay(ExportWriter *writer, DayNumber day) {
+    beginExportField(writer);
+    if (day == NO_DATE) {
+        if (writer->format == EXPORT_JSONL) {
+            exportText(writer, "null", 4);
+        }
+        return;
+    }
+    
+    int slot = day & (EXPORT_DATE_CACHE - 1);
+    if (writer->cached_days[slot] != day) {
+        Date date = getDateOfDay(day);
+        char *text = writer->cached_dates[slot];
+        memcpy(text, &digit_pairs[(date.year / 100 % 100) * 2], 2);
+        memcpy(text + 2, &digit_pairs[(date.year % 100) * 2], 2);
+        text[4] = '-';
+        memcpy(text + 5, &digit_pairs[date.month * 2], 2);
+        text[7] = '-';
+        memcpy(text + 8, &digit_pairs[date.day * 2], 2);
+        writer->cached_days[slot] = day;
+    }
+    
+    if (writer->format == EXPORT_JSONL) {
+        exportChar(writer, '"');
+    }
+    exportText(writer, writer->cached_dates[slot], 10);
+    if (writer->format == EXPORT_JSONL) {
+        exportChar(writer, '"');
+    }
+}
+
+static void exportBool(ExportWriter *writer, int value) {
+    beginExportField(writer);
+    if (writer->format == EXPORT_JSONL) {
+        exportText(writer, value ? "true" : "false", value ? 4 : 5);
+    } else {
+        exportChar(writer, value ? '1' : '0');
+    }
+}
+
+static void exportCustomers(ExportWriter *writer, long long *rows) {
+    const char *type_names[] = {"Residential", "Commercial", "Industrial"};
+    for (int i = 0; i < customer_count; i++) {
+        Customer *c = getCustomer(i);
+        beginExportRecord(writer);
+        exportInt(writer, c->customer_id);
+        exportString(writer, c->name);
+        exportString(writer, c->address);
+        exportString(writer, c->phone);
+        exportString(writer, c->email);
+        exportString(writer, type_names[c->type]);
+        exportString(writer, c->meter_number);
+        exportString(writer, rate_plans[getCustomerRatePlan(c)].name);
+        exportDay(writer, getDayNumber(c->connection_date));
+        exportBool(writer, c->is_active);
+        exportInt(writer, c->bill_count);
+        endExportRecord(writer);
+    }
+    *rows = customer_count;
+}
+
+// Bills and payments are streamed straight from the ledger columns in row order
+static void exportBills(ExportWriter *writer, int paid_only, long long *rows) {
+    long long count = 0;
+    for (int row = 0; row < ledger_count; row++) {
+        BillChunk *chunk = getBillChunk(row);
+        int i = row % BILL_CHUNK_SIZE;
+        if (paid_only && !chunk->is_paid[i]) {
+            continue;
+        }
+        Customer *c = getCustomer(chunk->customer_index[i]);
+        
+        beginExportRecord(writer);
+        exportInt(writer, chunk->bill_id[i]);
+        exportInt(writer, c->customer_id);
+        exportString(writer, c->meter_number);
+        if (paid_only) {
+            exportDay(writer, chunk->payment_date[i]);
+            exportMoney(writer, chunk->amount[i]);
+            exportString(writer, chunk->payment_method[i]);
+        } else {
+            exportDay(writer, chunk->bill_date[i]);
+            exportDay(writer, chunk->due_date[i]);
+            exportUsage(writer, chunk->meter_reading_start[i]);
+            exportUsage(writer, chunk->meter_reading_end[i]);
+            exportUsage(writer, chunk->total_usage[i]);
+            exportUsage(writer, chunk->peak_hours[i]);
+            exportUsage(writer, chunk->off_peak_hours[i]);
+            exportMoney(writer, chunk->amount[i]);
+            exportBool(writer, chunk->is_paid[i]);
+            exportDay(writer, chunk->payment_date[i]);
+            exportString(writer, chunk->payment_method[i]);
+        }
+        endExportRecord(writer);
+        count++;
+    }
+    *rows = count;
+}
+
+static void exportReport(ExportWriter *writer, long long *rows) {
+    for (int m = 0; m < rollup_table.count; m++) {
+        const MonthRollup *rollup = &rollup_table.months[m];
+        beginExportRecord(writer);
+        
+        // The month as YYYY-MM
+        beginExportField(writer);
+        if (writer->format == EXPORT_JSONL) {
+            exportChar(writer, '"');
+        }
+        exportDigits(writer, rollup->year, 4);
+        exportChar(writer, '-');
+        exportDigits(writer, rollup->month, 2);
+        if (writer->format == EXPORT_JSONL) {
+            exportChar(writer, '"');
+        }
+        
+        exportInt(writer, rollup->bills_generated);
+        exportInt(writer, rollup->bills_paid);
+        exportMoney(writer, rollup->total_billed_amount);
+        exportMoney(writer, rollup->total_collected_amount);
+        exportMoney(writer, rollup->total_outstanding_amount);
+        exportUsage(writer, rollup->total_usage);
+        exportUsage(writer, rollup->peak_usage);
+        exportUsage(writer, rollup->off_peak_usage);
+        for (int type = RESIDENTIAL; type <= INDUSTRIAL; type++) {
+            exportUsage(writer, rollup->usage_by_type[type]);
+        }
+        for (int type = RESIDENTIAL; type <= INDUSTRIAL; type++) {
+            exportMoney(writer, rollup->amount_by_type[type]);
+        }
+        endExportRecord(writer);
+    }
+    *rows = rollup_table.count;
+}
+
+// Creates filename and, for CSV, writes the header line. Returns 0 on
+// success, -1 on error.
+static int openExportWriter(ExportWriter *writer, ExportFormat format, const char *const *fields, const char *filename) {
+    memset(writer, 0, sizeof(ExportWriter));
+    writer->format = format;
+    writer->fields = fields;
+    for (int i = 0; i < EXPORT_DATE_CACHE; i++) {
+        writer->cached_days[i] = NO_DATE;
+    }
+    
+    writer->buffer = malloc(EXPORT_BUFFER_SIZE);
+    if (writer->buffer == NULL) {
+        return -1;
+    }
+    writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd == -1) {
+        free(writer->buffer);
+        return -1;
+    }
+    
+    if (format == EXPORT_CSV) {
+        for (int i = 0; fields[i] != NULL; i++) {
+            if (i > 0) {
+                exportChar(writer, ',');
+            }
+            exportText(writer, fields[i], strlen(fields[i]));
+        }
+        exportChar(writer, '\n');
+    }
+    return 0;
+}
+
+// Writes out what is buffered and closes the file. Returns 0 if everything
+// was written, -1 otherwise.
+static int closeExportWriter(ExportWriter *writer) {
+    flushExport(writer);
+    writer->failed |= close(writer->fd) != 0;
+    free(writer->buffer);
+    return writer->failed ? -1 : 0;
+}
+
+// Writes a dataset to filename as CSV with a header line, or as JSON Lines.
+// Sets rows and bytes to what was written. Returns 0 on success, -1 on error.
+int exportData(ExportDataset dataset, ExportFormat format, const char *filename, long long *rows, long long *bytes) {
+    const char *const *dataset_fields[] = {
+        customer_export_fields, bill_export_fields, payment_export_fields, report_export_fields
+    };
+    ExportWriter writer;
+    *rows = 0;
+    *bytes = 0;
+    if (openExportWriter(&writer, format, dataset_fields[dataset], filename) != 0) {
+        return -1;
+    }
+    
+    switch (dataset) {
+        case EXPORT_CUSTOMERS:
+            exportCustomers(&writer, rows);
+            break;
+        case EXPORT_BILLS:
+            exportBills(&writer, 0, rows);
+            break;
+        case EXPORT_PAYMENTS:
+            exportBills(&writer, 1, rows);
+            break;
+        default:
+            exportReport(&writer, rows);
+            break;
+    }
+    int result = closeExportWriter(&writer);
+    *bytes = writer.bytes;
+    return result;
+}
+
+static int parseExportDataset(const char *name) {
+    const char *names[] = {"customers", "bills", "payments", "report"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void printExportSummary(const char *filename, long long rows, long long bytes, double seconds) {
+    printf("Exported %lld records (%.1f MB) to %s in %.3f s", rows, bytes / (1024.0 * 1024.0), filename, seconds);
+    if (seconds > 0) {
+        printf(" (%.0f records/sec, %.1f MB/s)", rows / seconds, bytes / (1024.0 * 1024.0) / seconds);
+    }
+    printf("\n");
+}
+
+// --export <dataset> <format> <file>. Returns 0 on success, -1 on error.
+int runExportCommand(const char *dataset_name, const char *format_name, const char *filename) {
+    int dataset = parseExportDataset(dataset_name);
+    if (dataset == -1) {
+        printf("Unknown export dataset %s! Use customers, bills, payments or report.\n", dataset_name);
+        return -1;
+    }
+    if (strcmp(format_name, "csv") != 0 && strcmp(format_name, "jsonl") != 0) {
+        printf("Unknown export format %s! Use csv or jsonl.\n", format_name);
+        return -1;
+    }
+    ExportFormat format = strcmp(format_name, "csv") == 0 ? EXPORT_CSV : EXPORT_JSONL;
+    
+    long long rows, bytes;
+    double start = getTimeSeconds();
+    if (exportData((ExportDataset)dataset, format, filename, &rows, &bytes) != 0) {
+        printf("Error writing export file %s!\n", filename);
+        return -1;
+    }
+    printExportSummary(filename, rows, bytes, getTimeSeconds() - start);
+    return 0;
+}
+
+void exportMenu() {
+    int dataset, format;
+    char filename[256];
+    
+    printf("\n===== Export Data =====\n");
+    printf("1. Customers\n");
+    printf("2. Bills\n");
+    printf("3. Payments\n");
+    printf("4. Monthly Report Totals\n");
+    printf("Enter your choice: ");
+    scanf("%d", &dataset);
+    getchar(); // Consume newline
+    if (dataset < 1 || dataset > 4) {
+        printf("Invalid choice!\n");
+        return;
+    }
+    
+    printf("Enter format (1-CSV, 2-JSON Lines): ");
+    scanf("%d", &format);
+    getchar(); // Consume newline
+    if (format < 1 || format > 2) {
+        printf("Invalid format!\n");
+        return;
+    }
+    
+    printf("Enter file name: ");
+    fgets(filename, sizeof(filename), stdin);
+    filename[strcspn(filename, "\n")] = 0; // Remove newline
+    
+    long long rows, bytes;
+    double start = getTimeSeconds();
+    if (exportData((ExportDataset)(dataset - 1), format == 1 ? EXPORT_CSV : EXPORT_JSONL, filename, &rows, &bytes) != 0) {
+        printf("Error writing export file %s!\n", filename);
+        return;
+    }
+    printExportSummary(filename, rows, bytes, getTimeSeconds() - start);
+}
+
+double getTimeSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Rates a batch of unrated ledger rows with the batch tariff kernel, then
+// adds them to the roll-ups
+static void rateBillRows(const int *rows, int count) {
+    int plans[BILL_RUN_BATCH];
+    float usages[BILL_RUN_BATCH], peak_hours[BILL_RUN_BATCH], off_peak_hours[BILL_RUN_BATCH];
+    Money amounts[BILL_RUN_BATCH];
+    if (count <= 0) {
+        return;
+    }
+    
+    // At least one bill, which lets the compiler see the inputs are set
+    int i = 0;
+    do {
+        plans[i] = getCustomerRatePlan(getCustomer(BILL_FIELD(rows[i], customer_index)));
+        usages[i] = BILL_FIELD(rows[i], total_usage);
+        peak_hours[i] = BILL_FIELD(rows[i], peak_hours);
+        off_peak_hours[i] = BILL_FIELD(rows[i], off_peak_hours);
+    } while (++i < count);
+    
+    calculateBillAmounts(plans, usages, peak_hours, off_peak_hours, amounts, count);
+    
+    for (int i = 0; i < count; i++) {
+        BILL_FIELD(rows[i], amount) = amounts[i];
+    }
+    for (int i = 0; i < count; i++) {
+        applyBillToRollups(&rollup_table, rows[i], 1);
+    }
+}
+
+// Batch bill run: rates every reading in the file in one pass and persists once.
+// Each line holds: meter_number, end reading, peak usage, off-peak usage
+// separated by commas or whitespace. Blank lines and lines starting with '#' are ignored.
+
+void runBillBatch(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Error opening readings file %s!\n", filename);
+        return;
+    }
+    
+    char line[256];
+    int line_number = 0;
+    int bills_generated = 0;
+    int not_found = 0;
+    int invalid = 0;
+    
+    // Bills are appended as lines are read and rated BILL_RUN_BATCH at a time
+    int pending[BILL_RUN_BATCH];
+    int pending_count = 0;
+    
+    double start_time = getTimeSeconds();
+    pinClock();
+    
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        
+        char *meter_number = strtok(line, " ,\t\r\n");
+        if (meter_number == NULL || meter_number[0] == '#') {
+            continue;
+        }
+        
+        char *fields[3];
+        int field_count = 0;
+        while (field_count < 3 && (fields[field_count] = strtok(NULL, " ,\t\r\n")) != NULL) {
+            field_count++;
+        }
+        
+        float values[3];
+        int valid = field_count == 3;
+        for (int i = 0; valid && i < 3; i++) {
+            char *end;
+            values[i] = strtof(fields[i], &end);
+            if (end == fields[i] || *end != '\0' || values[i] < 0) {
+                valid = 0;
+            }
+        }
+        
+        if (!valid) {
+            if (invalid < 20) {
+                printf("Line %d: invalid reading, skipped\n", line_number);
+            }
+            invalid++;
+            continue;
+        }
+        
+        int customer_index = findCustomerByMeterNumber(meter_number);
+        if (customer_index == -1) {
+            if (not_found < 20) {
+                printf("Line %d: meter %s not found, skipped\n", line_number, meter_number);
+            }
+            not_found++;
+            continue;
+        }
+        
+        Customer *c = getCustomer(customer_index);
+        if (c->last_bill != -1 && values[0] < BILL_FIELD(c->last_bill, meter_reading_end)) {
+            if (invalid < 20) {
+                printf("Line %d: reading for meter %s is below the previous reading, skipped\n",
+                       line_number, meter_number);
+            }
+            invalid++;
+            continue;
+        }
+        
+        TimeOfUseUsage tou_usage = {values[1], values[2]};
+        int row = appendUnratedBill(customer_index, values[0], tou_usage);
+        if (row == -1) {
+            break;
+        }
+        bills_generated++;
+        
+        pending[pending_count++] = row;
+        if (pending_count == BILL_RUN_BATCH) {
+            rateBillRows(pending, pending_count);
+            pending_count = 0;
+        }
+    }
+    rateBillRows(pending, pending_count);
+    unpinClock();
+    
+    fclose(file);
+    
+    double rating_time = getTimeSeconds() - start_time;
+    
+    if (bills_generated > 0) {
+        saveData();
+    }
+    
+    double total_time = getTimeSeconds() - start_time;
+    
+    printf("\n===== Bill Run Summary =====\n");
+    printf("Lines Read: %d\n", line_number);
+    printf("Bills Generated: %d\n", bills_generated);
+    printf("Unknown Meters: %d\n", not_found);
+    printf("Invalid Lines: %d\n", invalid);
+    printf("Rating Time: %.3f s\n", rating_time);
+    printf("Save Time: %.3f s\n", total_time - rating_time);
+    printf("Total Time: %.3f s\n", total_time);
+    printf("Throughput: %.0f bills/sec\n", total_time > 0 ? bills_generated / total_time : 0);
+    printf("============================\n");
+}
+
+// Splits a CSV line into fields in place. Quoted fields may hold commas and
+// doubled quotes; unquoted fields are trimmed. Returns the number of fields,
+// or -1 if there are too many or a quote is left open.
+static int splitCsvLine(char *line, char **fields, int max_fields) {
+    int count = 0;
+    char *p = line;
+    
+    while (1) {
+        if (count == max_fields) {
+            return -1;
+        }
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        
+        char *out = p;
+        fields[count++] = p;
+        if (*p == '"') {
+            p++;
+            while (1) {
+                if (*p == '\0' || *p == '\r' || *p == '\n') {
+                    return -1;
+                }
+                if (*p == '"') {
+                    if (p[1] != '"') {
+                        break;
+                    }
+                    p++;
+                }
+                *out++ = *p++;
+            }
+            p++; // Closing quote
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if (*p != ',' && *p != '\0' && *p != '\r' && *p != '\n') {
+                return -1;
+            }
+        } else {
+            while (*p != ',' && *p != '\0' && *p != '\r' && *p != '\n') {
+                *out++ = *p++;
+            }
+            while (out > fields[count - 1] && (out[-1] == ' ' || out[-1] == '\t')) {
+                out--;
+            }
+        }
+        
+        int more = *p == ',';
+        *out = '\0';
+        if (!more) {
+            return count;
+        }
+        p++;
+    }
+}
+
+enum {
+    IMPORT_BAD_LINE,
+    IMPORT_MISSING_FIELD,
+    IMPORT_TOO_LONG,
+    IMPORT_BAD_TYPE,
+    IMPORT_BAD_METER,
+    IMPORT_BAD_EMAIL,
+    IMPORT_UNKNOWN_PLAN,
+    IMPORT_EXISTING_METER,
+    IMPORT_REPEATED_METER,
+    IMPORT_REJECTION_COUNT
+};
+
+static const char *const import_rejections[] = {
+    "Malformed line", "Missing name or meter", "Field too long", "Invalid customer type",
+    "Invalid meter number", "Invalid email", "Unknown rate plan", "Meter already registered",
+    "Meter repeated in file"
+};
+
+static int copyImportField(char *destination, const char *field, size_t size) {
+    size_t length = strlen(field);
+    if (length >= size) {
+        return -1;
+    }
+    memcpy(destination, field, length + 1);
+    return 0;
+}
+
+// Fills a customer from one row of the import file. Returns -1 if the row is
+// valid, or the reason it was rejected.
+static int parseImportRow(char **fields, int field_count, Customer *customer) {
+    const char *type_names[] = {"Residential", "Commercial", "Industrial"};
+    
+    if (field_count < IMPORT_MAX_FIELDS - 1) {
+        return IMPORT_BAD_LINE;
+    }
+    if (fields[0][0] == '\0' || fields[5][0] == '\0') {
+        return IMPORT_MISSING_FIELD;
+    }
+    if (copyImportField(customer->name, fields[0], MAX_NAME_LENGTH) != 0 ||
+        copyImportField(customer->address, fields[1], MAX_ADDRESS_LENGTH) != 0 ||
+        copyImportField(customer->phone, fields[2], 15) != 0 ||
+        copyImportField(customer->email, fields[3], 50) != 0 ||
+        copyImportField(customer->meter_number, fields[5], 20) != 0) {
+        return IMPORT_TOO_LONG;
+    }
+    
+    // The type by number, as the menu takes it, or by name, as exports write it
+    int type = -1;
+    for (int t = RESIDENTIAL; t <= INDUSTRIAL; t++) {
+        if (strcasecmp(fields[4], type_names[t]) == 0 || (fields[4][0] == '0' + t && fields[4][1] == '\0')) {
+            type = t;
+        }
+    }
+    if (type == -1) {
+        return IMPORT_BAD_TYPE;
+    }
+    customer->type = (CustomerType)type;
+    
+    // Bill runs separate a meter number from its readings by commas and whitespace
+    if (strpbrk(customer->meter_number, " \t,") != NULL) {
+        return IMPORT_BAD_METER;
+    }
+    if (customer->email[0] != '\0' && strchr(customer->email, '@') == NULL) {
+        return IMPORT_BAD_EMAIL;
+    }
+    
+    customer->rate_plan[0] = '\0';
+    if (field_count == IMPORT_MAX_FIELDS && fields[6][0] != '\0') {
+        if (copyImportField(customer->rate_plan, fields[6], 20) != 0) {
+            return IMPORT_TOO_LONG;
+        }
+        if (findRatePlan(customer->rate_plan) == -1) {
+            return IMPORT_UNKNOWN_PLAN;
+        }
+    }
+    return -1;
+}
+
+// Bulk customer import: adds every valid row of a CSV file and persists once.
+// Each line holds: name, address, phone, email, type, meter number and an
+// optional rate plan. A first line starting with "name," is taken as a header.
+void runCustomerImport(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Error opening import file %s!\n", filename);
+        return;
+    }
+    
+    char line[1024];
+    int line_number = 0;
+    int imported = 0;
+    int rejected = 0;
+    int rejections[IMPORT_REJECTION_COUNT] = {0};
+    int first_new = customer_count;
+    int first_id = customer_count + FIRST_CUSTOMER_ID;
+    
+    Customer customer;
+    memset(&customer, 0, sizeof(Customer));
+    customer.last_bill = -1;
+    customer.is_active = 1;
+    customer.connection_date = getCurrentDate();
+    
+    double start_time = getTimeSeconds();
+    
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        
+        int reason = -1;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            // Longer than any valid row; skip the rest of it
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+            reason = IMPORT_TOO_LONG;
+        } else {
+            char *text = line + strspn(line, " \t");
+            if (*text == '\0' || *text == '\r' || *text == '\n' || *text == '#') {
+                continue;
+            }
+            if (line_number == 1 && strncasecmp(text, "name,", 5) == 0) {
+                continue;
+            }
+            
+            char *fields[IMPORT_MAX_FIELDS];
+            int field_count = splitCsvLine(line, fields, IMPORT_MAX_FIELDS);
+            reason = field_count == -1 ? IMPORT_BAD_LINE : parseImportRow(fields, field_count, &customer);
+        }
+        
+        if (reason == -1) {
+            int existing = findCustomerByMeterNumber(customer.meter_number);
+            if (existing != -1) {
+                reason = existing >= first_new ? IMPORT_REPEATED_METER : IMPORT_EXISTING_METER;
+            }
+        }
+        
+        if (reason != -1) {
+            if (rejected < 20) {
+                printf("Line %d: %s, skipped\n", line_number, import_rejections[reason]);
+            }
+            rejections[reason]++;
+            rejected++;
+            continue;
+        }
+        
+        customer.customer_id = customer_count + FIRST_CUSTOMER_ID;
+        int customer_index = appendCustomer(&customer);
+        if (customer_index == -1) {
+            break;
+        }
+        indexCustomerMeter(customer_index);
+        indexCustomerId(customer_index);
+        indexCustomerText(customer_index);
+        imported++;
+    }
+    
+    fclose(file);
+    
+    double import_time = getTimeSeconds() - start_time;
+    
+    if (imported > 0) {
+        saveData();
+    }
+    
+    double total_time = getTimeSeconds() - start_time;
+    
+    printf("\n===== Customer Import Summary =====\n");
+    printf("Lines Read: %d\n", line_number);
+    printf("Customers Imported: %d\n", imported);
+    if (imported > 0) {
+        printf("Customer IDs: %d - %d\n", first_id, first_id + imported - 1);
+    }
+    printf("Rows Rejected: %d\n", rejected);
+    for (int i = 0; i < IMPORT_REJECTION_COUNT; i++) {
+        if (rejections[i] > 0) {
+            printf("  %s: %d\n", import_rejections[i], rejections[i]);
+        }
+    }
+    printf("Import Time: %.3f s\n", import_time);
+    printf("Save Time: %.3f s\n", total_time - import_time);
+    printf("Total Time: %.3f s\n", total_time);
+    printf("Throughput: %.0f rows/sec\n", total_time > 0 ? (imported + rejected) / total_time : 0);
+    printf("===================================\n");
+}
+
+enum {
+    RECONCILE_BAD_LINE,
+    RECONCILE_BAD_AMOUNT,
+    RECONCILE_BAD_DATE,
+    RECONCILE_UNMATCHED,
+    RECONCILE_NO_OPEN_BILL,
+    RECONCILE_ALREADY_PAID,
+    RECONCILE_DUPLICATE,
+    RECONCILE_OVERPAYMENT,
+    RECONCILE_PARTIAL,
+    RECONCILE_EXCEPTION_COUNT
+};
+
+static const char *const reconcile_exceptions[] = {
+    "Malformed line", "Invalid amount", "Invalid date", "No matching bill or meter",
+    "No open bill for meter", "Bill already paid", "Bill paid earlier in file", "Overpayment",
+    "Partial payment"
+};
+
+static const char *const reconcile_exception_fields[] = {
+    "line", "reference", "amount", "payment_date", "payment_method", "exception",
+    "bill_id", "bill_amount", "balance", NULL
+};
+
+// A bill that lines of the payments file were matched to
+typedef struct {
+    int row;
+    int line;                 // first line paying it
+    Money received;           // total of the file's payments towards it, on
+                              // top of part payments recorded earlier
+    DayNumber payment_date;   // of the latest of those payments
+    char reference[20];       // as given on the first line
+    char payment_method[20];  // as given on the latest line
+} ReconciledBill;
+
+// Matched bills by ledger row, in the order they were first matched
+typedef struct {
+    ReconciledBill *entries;
+    int count;
+    int capacity;
+    int *slots;               // entry in each slot, -1 when empty
+    int slot_capacity;        // a power of two, twice capacity
+} ReconcileTable;
+
+static inline unsigned int hashLedgerRow(int row) {
+    unsigned int hash = (unsigned int)row * 2654435769u;
+    return hash ^ (hash >> 16);
+}
+
+static ReconciledBill *findReconciledBill(ReconcileTable *table, int row) {
+    if (table->count == 0) {
+        return NULL;
+    }
+    unsigned int mask = table->slot_capacity - 1;
+    unsigned int slot = hashLedgerRow(row) & mask;
+    while (table->slots[slot] != -1) {
+        if (table->entries[table->slots[slot]].row == row) {
+            return &table->entries[table->slots[slot]];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+// Adds a bill that is not in the table yet. Returns its entry, or NULL if
+// memory ran out. Entries move when the table grows.
+static ReconciledBill *addReconciledBill(ReconcileTable *table, int row) {
+    if (table->count == table->capacity) {
+        int capacity = table->capacity > 0 ? table->capacity * 2 : 1024;
+        ReconciledBill *entries = realloc(table->entries, capacity * sizeof(ReconciledBill));
+        int *slots = malloc(capacity * 2 * sizeof(int));
+        if (entries == NULL || slots == NULL) {
+            if (entries != NULL) {
+                table->entries = entries;
+            }
+            free(slots);
+            return NULL;
+        }
+        for (int i = 0; i < capacity * 2; i++) {
+            slots[i] = -1;
+        }
+        for (int i = 0; i < table->count; i++) {
+            unsigned int slot = hashLedgerRow(entries[i].row) & (capacity * 2 - 1);
+            while (slots[slot] != -1) {
+                slot = (slot + 1) & (capacity * 2 - 1);
+            }
+            slots[slot] = i;
+        }
+        free(table->slots);
+        table->entries = entries;
+        table->slots = slots;
+        table->capacity = capacity;
+        table->slot_capacity = capacity * 2;
+    }
+    
+    unsigned int mask = table->slot_capacity - 1;
+    unsigned int slot = hashLedgerRow(row) & mask;
+    while (table->slots[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    table->slots[slot] = table->count;
+    ReconciledBill *entry = &table->entries[table->count++];
+    memset(entry, 0, sizeof(ReconciledBill));
+    entry->row = row;
+    return entry;
+}
+
+// What is left to pay on an open bill after its recorded part payments
+static inline Money getBillBalance(int row) {
+    return BILL_FIELD(row, amount) - BILL_FIELD(row, amount_received);
+}
+
+// A positive amount in currency units, rounded to the cent. Returns -1 if
+// the text is not one.
+static Money parseReconcileAmount(const char *text) {
+    char *end;
+    double units = strtod(text, &end);
+    if (end == text || *end != '\0' || !(units > 0 && units < 1e12)) {
+        return -1;
+    }
+    return toMoney(units);
+}
+
+// A YYYY-MM-DD date no later than today, or NO_DATE if the text is not one
+static DayNumber parseReconcileDate(const char *text) {
+    Date date;
+    char extra;
+    if (sscanf(text, "%d-%d-%d%c", &date.year, &date.month, &date.day, &extra) != 3 ||
+        date.year < 1970 || date.month < 1 || date.month > 12 || date.day < 1) {
+        return NO_DATE;
+    }
+    DayNumber day = getDayNumber(date);
+    if (getDateOfDay(day).day != date.day || day > getToday()) {
+        return NO_DATE; // Past the end of its month, or in the future
+    }
+    return day;
+}
+
+// Finds the bill a payment reference names. A reference of digits only is a
+// bill ID if a bill has that ID. Otherwise it
+// is a meter number, and the customer's oldest bill that is neither paid nor
+// settled earlier in the file is taken. Returns the ledger row, or -1 with
+// the reason in *reason.
+static int matchPaymentReference(ReconcileTable *table, char *reference, int *reason) {
+    size_t digits = strspn(reference, "0123456789");
+    if (digits > 0 && digits <= 9 && reference[digits] == '\0') {
+        int row = findBillById(atoi(reference));
+        if (row != -1) {
+            return row;
+        }
+    }
+    
+    int customer_index = findCustomerByMeterNumber(reference);
+    if (customer_index == -1) {
+        *reason = RECONCILE_UNMATCHED;
+        return -1;
+    }
+    int oldest_open = -1;
+    for (int row = getCustomer(customer_index)->last_bill; row != -1; row = BILL_FIELD(row, prev_bill)) {
+        if (BILL_FIELD(row, is_paid)) {
+            continue;
+        }
+        ReconciledBill *entry = findReconciledBill(table, row);
+        if (entry == NULL || entry->received < getBillBalance(row)) {
+            oldest_open = row;
+        }
+    }
+    if (oldest_open == -1) {
+        *reason = RECONCILE_NO_OPEN_BILL;
+    }
+    return oldest_open;
+}
+
+// Writes a line of the payments file to the exceptions file, with the bill
+// it matched (row -1 for none) and what is left to pay on it (NULL to leave
+// it out). Fields past field_count are left empty.
+static void exportReconcileLine(ExportWriter *writer, int line_number, char **fields, int field_count,
+                                int reason, int row, const Money *balance) {
+    beginExportRecord(writer);
+    exportInt(writer, line_number);
+    for (int i = 0; i < RECONCILE_MAX_FIELDS; i++) {
+        exportString(writer, i < field_count ? fields[i] : "");
+    }
+    exportString(writer, reconcile_exceptions[reason]);
+    if (row != -1) {
+        exportInt(writer, BILL_FIELD(row, bill_id));
+        exportMoney(writer, BILL_FIELD(row, amount));
+    } else {
+        exportString(writer, "");
+        exportString(writer, "");
+    }
+    if (balance != NULL) {
+        exportMoney(writer, *balance);
+    } else {
+        exportString(writer, "");
+    }
+    endExportRecord(writer);
+}
+
+// Bulk payment reconciliation: matches each line of a bank or lockbox file
+// to an open bill, pays the bills the file covers, records part payments
+// towards the rest and persists once. Each line holds a bill ID or meter
+// number, the amount, the payment date (YYYY-MM-DD) and the payment method.
+// Lines that cannot be applied as they stand, and bills paid only in part,
+// are written to the exceptions file.
+void runPaymentReconciliation(const char *filename, const char *exceptions_filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Error opening payments file %s!\n", filename);
+        return;
+    }
+    ExportWriter writer;
+    if (openExportWriter(&writer, EXPORT_CSV, reconcile_exception_fields, exceptions_filename) != 0) {
+        printf("Error creating exceptions file %s!\n", exceptions_filename);
+        fclose(file);
+        return;
+    }
+    
+    char line[512];
+    char raw_line[sizeof(line)]; // as read, for lines that cannot be split
+    int line_number = 0;
+    int payments_matched = 0;
+    int exception_count = 0;
+    int exceptions[RECONCILE_EXCEPTION_COUNT] = {0};
+    ReconcileTable table = {NULL, 0, 0, NULL, 0};
+    int out_of_memory = 0;
+    
+    double start_time = getTimeSeconds();
+    
+    // Nothing is changed until the whole file has been matched
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        
+        char *fields[RECONCILE_MAX_FIELDS];
+        int field_count = -1;
+        size_t length = strlen(line);
+        memcpy(raw_line, line, length + 1);
+        raw_line[strcspn(raw_line, "\r\n")] = '\0';
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            // Longer than any valid line; skip the rest of it
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+        } else {
+            char *text = line + strspn(line, " \t");
+            if (*text == '\0' || *text == '\r' || *text == '\n' || *text == '#') {
+                continue;
+            }
+            field_count = splitCsvLine(line, fields, RECONCILE_MAX_FIELDS);
+            // A first line without an amount is taken as a header
+            if (line_number == 1 && field_count == RECONCILE_MAX_FIELDS && parseReconcileAmount(fields[1]) == -1) {
+                continue;
+            }
+        }
+        
+        int reason = -1;
+        int row = -1;
+        Money amount = 0;
+        DayNumber payment_date = NO_DATE;
+        if (field_count != RECONCILE_MAX_FIELDS || fields[0][0] == '\0' || fields[3][0] == '\0' ||
+            strlen(fields[3]) >= 20) {
+            reason = RECONCILE_BAD_LINE;
+        } else if ((amount = parseReconcileAmount(fields[1])) == -1) {
+            reason = RECONCILE_BAD_AMOUNT;
+        } else if ((payment_date = parseReconcileDate(fields[2])) == NO_DATE) {
+            reason = RECONCILE_BAD_DATE;
+        } else {
+            row = matchPaymentReference(&table, fields[0], &reason);
+        }
+        
+        ReconciledBill *entry = NULL;
+        if (row != -1) {
+            entry = findReconciledBill(&table, row);
+            if (BILL_FIELD(row, is_paid)) {
+                reason = RECONCILE_ALREADY_PAID;
+            } else if (entry != NULL && entry->received >= getBillBalance(row)) {
+                reason = RECONCILE_DUPLICATE;
+            } else if (entry == NULL && (entry = addReconciledBill(&table, row)) == NULL) {
+                out_of_memory = 1;
+                break;
+            }
+        }
+        
+        if (reason != -1) {
+            // A line that could not be split is written whole as its reference
+            if (field_count == -1) {
+                fields[0] = raw_line;
+                field_count = 1;
+            }
+            exportReconcileLine(&writer, line_number, fields, field_count, reason, row, NULL);
+            exceptions[reason]++;
+            exception_count++;
+            continue;
+        }
+        
+        if (entry->line == 0) {
+            entry->line = line_number;
+            snprintf(entry->reference, 20, "%s", fields[0]);
+        }
+        entry->received += amount;
+        entry->payment_date = payment_date;
+        snprintf(entry->payment_method, 20, "%s", fields[3]);
+        payments_matched++;
+        
+        // The bill is paid, but the excess has nothing to go to
+        Money balance = getBillBalance(row) - entry->received;
+        if (balance < 0) {
+            exportReconcileLine(&writer, line_number, fields, RECONCILE_MAX_FIELDS, RECONCILE_OVERPAYMENT,
+                                row, &balance);
+            exceptions[RECONCILE_OVERPAYMENT]++;
+            exception_count++;
+        }
+    }
+    fclose(file);
+    
+    if (out_of_memory) {
+        printf("Error allocating reconciliation data at line %d! No payments were applied.\n", line_number);
+        closeExportWriter(&writer);
+        remove(exceptions_filename);
+        free(table.entries);
+        free(table.slots);
+        return;
+    }
+    
+    double match_time = getTimeSeconds() - start_time;
+    
+    // Apply every bill the file covers in full. The rest stay open with what
+    // the file paid recorded towards them, and are listed with their first
+    // line, the file's total for them and what is still owed.
+    int bills_paid = 0;
+    int bills_part_paid = 0;
+    Money amount_paid = 0;
+    Money amount_part_paid = 0;
+    for (int i = 0; i < table.count; i++) {
+        ReconciledBill *entry = &table.entries[i];
+        Money balance = getBillBalance(entry->row) - entry->received;
+        if (balance <= 0) {
+            amount_paid += getBillBalance(entry->row);
+            applyBillPayment(entry->row, entry->payment_method, entry->payment_date);
+            bills_paid++;
+            continue;
+        }
+        
+        applyPartPayment(entry->row, entry->received);
+        bills_part_paid++;
+        amount_part_paid += entry->received;
+        
+        beginExportRecord(&writer);
+        exportInt(&writer, entry->line);
+        exportString(&writer, entry->reference);
+        exportMoney(&writer, entry->received);
+        exportDay(&writer, entry->payment_date);
+        exportString(&writer, entry->payment_method);
+        exportString(&writer, reconcile_exceptions[RECONCILE_PARTIAL]);
+        exportInt(&writer, BILL_FIELD(entry->row, bill_id));
+        exportMoney(&writer, BILL_FIELD(entry->row, amount));
+        exportMoney(&writer, balance);
+        endExportRecord(&writer);
+        exceptions[RECONCILE_PARTIAL]++;
+        exception_count++;
+    }
+    free(table.entries);
+    free(table.slots);
+    
+    if (closeExportWriter(&writer) != 0) {
+        printf("Error writing exceptions file %s!\n", exceptions_filename);
+    }
+    
+    if (bills_paid > 0 || bills_part_paid > 0) {
+        saveData();
+    }
+    
+    double total_time = getTimeSeconds() - start_time;
+    
+    printf("\n===== Payment Reconciliation Summary =====\n");
+    printf("Lines Read: %d\n", line_number);
+    printf("Payments Matched: %d\n", payments_matched);
+    printf("Bills Paid: %d ($%.2f)\n", bills_paid, moneyToUnits(amount_paid));
+    printf("Bills Part Paid: %d ($%.2f)\n", bills_part_paid, moneyToUnits(amount_part_paid));
+    printf("Exceptions: %d (written to %s)\n", exception_count, exceptions_filename);
+    for (int i = 0; i < RECONCILE_EXCEPTION_COUNT; i++) {
+        if (exceptions[i] > 0) {
+            printf("  %s: %d\n", reconcile_exceptions[i], exceptions[i]);
+        }
+    }
+    printf("Matching Time: %.3f s\n", match_time);
+    printf("Posting Time: %.3f s\n", total_time - match_time);
+    printf("Total Time: %.3f s\n", total_time);
+    printf("Throughput: %.0f lines/sec\n", total_time > 0 ? line_number / total_time : 0);
+    printf("==========================================\n");
+}
+
+// Appends customers with generated names and meter numbers, for benchmarking
+void addSyntheticCustomers(int count) {
+    Customer customer;
+    memset(&customer, 0, sizeof(Customer));
+    customer.last_bill = -1;
+    customer.is_active = 1;
+    customer.connection_date = getCurrentDate();
+    
+    for (int i = 0; i < count; i++) {
+        customer.customer_id = customer_count + FIRST_CUSTOMER_ID;
+        customer.type = (CustomerType)(customer_count % 3);
+        snprintf(customer.name, MAX_NAME_LENGTH, "Customer %d", customer_count);
+        snprintf(customer.address, MAX_ADDRESS_LENGTH, "%d Main Street", customer_count);
+        snprintf(customer.phone, 15, "555%07d", customer_count);
+        snprintf(customer.email, 50, "customer%d@example.com", customer_count);
+        snprintf(customer.meter_number, 20, "MTR%08d", customer_count);
+        
+        int customer_index = appendCustomer(&customer);
+        if (customer_index == -1) {
+            return;
+        }
+        indexCustomerMeter(customer_index);
+        indexCustomerId(customer_index);
+        indexCustomerText(customer_index);
+    }
+}
+
+// Measures add, lookup and report cost of the customer store at several sizes
+void runStoreBenchmark() {
+    int sizes[] = {1000, 100000, 1000000};
+    double results[3][4];
+    
+    // Reports go to a file of their own, leaving the user's report alone
+    report_filename = "bench_report.txt";
+    
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        clearCustomers();
+        buildCustomerIdIndex();
+        
+        double start = getTimeSeconds();
+        addSyntheticCustomers(n);
+        results[s][0] = getTimeSeconds() - start;
+        
+        // Look up every meter number in a scrambled order
+        char meter_number[20];
+        int misses = 0;
+        start = getTimeSeconds();
+        for (int i = 0; i < n; i++) {
+            snprintf(meter_number, 20, "MTR%08d", (int)(((long long)i * 7919) % n));
+            if (findCustomerByMeterNumber(meter_number) == -1) {
+                misses++;
+            }
+        }
+        results[s][1] = getTimeSeconds() - start;
+        if (misses > 0) {
+            printf("Warning: %d lookups failed!\n", misses);
+        }
+        
+        // And every customer ID, in the same order
+        misses = 0;
+        start = getTimeSeconds();
+        for (int i = 0; i < n; i++) {
+            int customer_index = (int)(((long long)i * 7919) % n);
+            if (findCustomerById(customer_index + FIRST_CUSTOMER_ID) != customer_index) {
+                misses++;
+            }
+        }
+        results[s][3] = getTimeSeconds() - start;
+        if (misses > 0) {
+            printf("Warning: %d ID lookups failed!\n", misses);
+        }
+        
+        start = getTimeSeconds();
+        generateReport();
+        results[s][2] = getTimeSeconds() - start;
+    }
+    
+    remove(report_filename);
+    report_filename = NULL;
+    clearCustomers();
+    
+    printf("\n===== Customer Store Benchmark =====\n");
+    printf("%-12s %-16s %-16s %-16s %-16s\n", "Customers", "Add (ns/op)", "Lookup (ns/op)", "ID (ns/op)", "Report (ms)");
+    printf("-----------------------------------------------------------------------------\n");
+    for (int s = 0; s < 3; s++) {
+        printf("%-12d %-16.1f %-16.1f %-16.1f %-16.2f\n",
+               sizes[s],
+               results[s][0] / sizes[s] * 1e9,
+               results[s][1] / sizes[s] * 1e9,
+               results[s][3] / sizes[s] * 1e9,
+               results[s][2] * 1e3);
+    }
+    printf("=============================================================================\n");
+}
+
+// Memory held by the search index
+static size_t getSearchIndexBytes() {
+    size_t bytes = trigram_capacity * sizeof(TrigramPostings);
+    for (int i = 0; i < trigram_capacity; i++) {
+        bytes += trigram_table[i].capacity * sizeof(int);
+    }
+    return bytes;
+}
+
+// Compares substring searches through the trigram index with scanning every
+// customer, at several store sizes
+void runSearchBenchmark() {
+    int sizes[] = {1000, 100000, 1000000};
+    const int queries = 100; // per field
+    double results[3][4];
+    int matched[3];
+    
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        clearCustomers();
+        addSyntheticCustomers(n);
+        
+        double start = getTimeSeconds();
+        buildSearchIndex();
+        results[s][0] = getTimeSeconds() - start;
+        results[s][1] = getSearchIndexBytes() / (1024.0 * 1024.0);
+        
+        int *scanned = (int *)malloc(n * sizeof(int));
+        if (scanned == NULL) {
+            printf("Error allocating benchmark data!\n");
+            return;
+        }
+        double index_time = 0, scan_time = 0;
+        matched[s] = 1;
+        
+        for (int q = 0; q < queries * 3; q++) {
+            SearchField field = (SearchField)(q % 3);
+            int j = (int)(((long long)q * 7919 + 17) % n);
+            char term[20];
+            if (field == SEARCH_NAME) {
+                snprintf(term, sizeof(term), "mer %d", j);
+            } else if (field == SEARCH_METER_NUMBER) {
+                snprintf(term, sizeof(term), "%05d", j % 100000);
+            } else {
+                snprintf(term, sizeof(term), "%07d", j);
+            }
+            
+            int *matches;
+            start = getTimeSeconds();
+            int count = findCustomersByText(field, term, &matches);
+            index_time += getTimeSeconds() - start;
+            
+            start = getTimeSeconds();
+            int scan_count = 0;
+            for (int i = 0; i < customer_count; i++) {
+                if (strstr(getSearchFieldText(getCustomer(i), field), term) != NULL) {
+                    scanned[scan_count++] = i;
+                }
+            }
+            scan_time += getTimeSeconds() - start;
+            
+            if (count != scan_count || (count > 0 && memcmp(matches, scanned, count * sizeof(int)) != 0)) {
+                matched[s] = 0;
+            }
+            free(matches);
+        }
+        results[s][2] = index_time / (queries * 3);
+        results[s][3] = scan_time / (queries * 3);
+        free(scanned);
+    }
+    clearCustomers();
+    
+    printf("\n===== Customer Search Benchmark (%d queries per field) =====\n", queries);
+    printf("%-12s %-12s %-12s %-16s %-16s %-6s\n",
+           "Customers", "Build (ms)", "Index (MB)", "Index (us/op)", "Scan (us/op)", "Match");
+    printf("----------------------------------------------------------------------------\n");
+    for (int s = 0; s < 3; s++) {
+        printf("%-12d %-12.1f %-12.1f %-16.2f %-16.2f %-6s\n",
+               sizes[s],
+               results[s][0] * 1e3,
+               results[s][1],
+               results[s][2] * 1e6,
+               results[s][3] * 1e6,
+               matched[s] ? "yes" : "NO");
+    }
+    printf("============================================================================\n");
+    printf("Queries search names, meter numbers and phones for substrings of one\n");
+    printf("customer's values. Match: the index finds the same customers as the scan.\n");
+}
+
+// Appends bills_per_customer bills to every customer, one per month ending with
+// the current month, and marks every other bill as paid
+void addSyntheticBills(int bills_per_customer) {
+    const char *methods[] = {"Cash", "Credit Card", "Bank Transfer"};
+    Date current_date = getCurrentDate();
+    
+    for (int k = 0; k < bills_per_customer; k++) {
+        // Months back from the current month for this round of bills
+        int months_back = bills_per_customer - 1 - k;
+        Date bill_date = current_date;
+        bill_date.day = 1;
+        bill_date.month -= months_back % 12;
+        bill_date.year -= months_back / 12;
+        if (bill_date.month < 1) {
+            bill_date.month += 12;
+            bill_date.year--;
+        }
+        DayNumber bill_day = getDayNumber(bill_date);
+        
+        for (int c = 0; c < customer_count; c++) {
+            TimeOfUseUsage tou_usage = {(float)(c % 97), (float)(c % 89)};
+            float previous_reading = 0;
+            if (getCustomer(c)->last_bill != -1) {
+                previous_reading = BILL_FIELD(getCustomer(c)->last_bill, meter_reading_end);
+            }
+            if (createBill(c, previous_reading + 100 + (c * 7 + k * 13) % 900, tou_usage) == -1) {
+                return;
+            }
+            
+            // Backdating moves the bill to another month's roll-up
+            int row = getCustomer(c)->last_bill;
+            applyBillToRollups(&rollup_table, row, -1);
+            BILL_FIELD(row, bill_date) = bill_day;
+            BILL_FIELD(row, due_date) = bill_day + 15;
+            if ((c + k) % 2 == 0) {
+                BILL_FIELD(row, is_paid) = 1;
+                BILL_FIELD(row, payment_date) = bill_day;
+                strcpy(BILL_FIELD(row, payment_method), methods[(c / 2) % 3]);
+            }
+            applyBillToRollups(&rollup_table, row, 1);
+        }
+    }
+}
+
+// The report aggregation as it was before aggregateReport(): a separate pass
+// over the ledger per report section, each repeating the month filter, with a
+// per-customer table for the top consumers. Kept only to benchmark and
+// cross-check the single-pass version.
+static int aggregateReportMultiPass(Date report_date, ReportTotals *totals) {
+    memset(totals, 0, sizeof(ReportTotals));
+    
+    for (int i = 0; i < customer_count; i++) {
+        if (getCustomer(i)->is_active) {
+            totals->active_customers++;
+        }
+        totals->customers_by_type[getCustomer(i)->type]++;
+    }
+    
+    // Billing summary
+    for (int row = 0; row < ledger_count; row++) {
+        BillingInfo bill = getBill(row);
+        if (bill.bill_date.month == report_date.month && bill.bill_date.year == report_date.year) {
+            totals->bills_generated++;
+            totals->total_billed_amount += bill.amount;
+            totals->total_usage += bill.total_usage;
+            if (bill.is_paid) {
+                totals->bills_paid++;
+                totals->total_collected_amount += bill.amount;
+            } else {
+                totals->total_collected_amount += BILL_FIELD(row, amount_received);
+                totals->total_outstanding_amount += bill.amount - BILL_FIELD(row, amount_received);
+            }
+        }
+    }
+    
+    // Usage by customer type
+    for (int row = 0; row < ledger_count; row++) {
+        BillingInfo bill = getBill(row);
+        if (bill.bill_date.month == report_date.month && bill.bill_date.year == report_date.year) {
+            CustomerType type = getCustomer(BILL_FIELD(row, customer_index))->type;
+            totals->usage_by_type[type] += bill.total_usage;
+            totals->amount_by_type[type] += bill.amount;
+        }
+    }
+    
+    // Time of use
+    for (int row = 0; row < ledger_count; row++) {
+        BillingInfo bill = getBill(row);
+        if (bill.bill_date.month == report_date.month && bill.bill_date.year == report_date.year) {
+            totals->peak_usage += bill.tou_usage.peak_hours;
+            totals->off_peak_usage += bill.tou_usage.off_peak_hours;
+        }
+    }
+    
+    // Top consumers
+    ConsumerRanking *per_customer = calloc(customer_count > 0 ? customer_count : 1, sizeof(ConsumerRanking));
+    if (per_customer == NULL) {
+        return -1;
+    }
+    for (int row = 0; row < ledger_count; row++) {
+        BillingInfo bill = getBill(row);
+        if (bill.bill_date.month == report_date.month && bill.bill_date.year == report_date.year) {
+            int customer_index = BILL_FIELD(row, customer_index);
+            per_customer[customer_index].usage += bill.total_usage;
+            per_customer[customer_index].amount += bill.amount;
+        }
+    }
+    if (initTopConsumers(&totals->top_consumers, REPORT_TOP_CONSUMERS, RANK_BY_USAGE) != 0) {
+        free(per_customer);
+        return -1;
+    }
+    for (int i = 0; i < customer_count; i++) {
+        if (per_customer[i].usage > 0) {
+            per_customer[i].customer_index = i;
+            offerTopConsumer(&totals->top_consumers, &per_customer[i]);
+        }
+    }
+    finishTopConsumers(&totals->top_consumers);
+    free(per_customer);
+    
+    // Payment methods
+    for (int row = 0; row < ledger_count; row++) {
+        BillingInfo bill = getBill(row);
+        if (bill.is_paid && 
+            bill.payment_date.month == report_date.month && 
+            bill.payment_date.year == report_date.year) {
+            int found = 0;
+            for (int k = 0; k < totals->payment_methods_count; k++) {
+                if (strcmp(totals->payment_stats[k].method, bill.payment_method) == 0) {
+                    totals->payment_stats[k].count++;
+                    totals->payment_stats[k].amount += bill.amount;
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found && totals->payment_methods_count < MAX_PAYMENT_METHODS) {
+                PaymentMethodStats *stats = &totals->payment_stats[totals->payment_methods_count++];
+                strcpy(stats->method, bill.payment_method);
+                stats->count = 1;
+                stats->amount = bill.amount;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+// Returns 1 if both aggregations produced the same report. Counts and amounts
+// must match exactly. Usage sums over millions of bills can drift with the
+// order they are added in, so they may differ by a relative tolerance; pass 0
+// to require identical results.
+static int reportTotalsMatch(const ReportTotals *a, const ReportTotals *b, double tolerance) {
+    const double *sums_a = &a->total_usage;
+    const double *sums_b = &b->total_usage;
+    int sum_count = (offsetof(ReportTotals, top_consumers) - offsetof(ReportTotals, total_usage)) / sizeof(double);
+    
+    if (memcmp(a, b, offsetof(ReportTotals, total_usage)) != 0 ||
+        a->top_consumers.count != b->top_consumers.count ||
+        a->payment_methods_count != b->payment_methods_count) {
+        return 0;
+    }
+    for (int i = 0; i < sum_count; i++) {
+        double difference = sums_a[i] - sums_b[i];
+        if (difference < 0) {
+            difference = -difference;
+        }
+        if (difference > tolerance * (sums_a[i] > 0 ? sums_a[i] : -sums_a[i])) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < a->top_consumers.count; i++) {
+        const ConsumerRanking *ranking_a = &a->top_consumers.entries[i];
+        const ConsumerRanking *ranking_b = &b->top_consumers.entries[i];
+        if (ranking_a->customer_index != ranking_b->customer_index ||
+            ranking_a->usage != ranking_b->usage ||
+            ranking_a->amount != ranking_b->amount) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < a->payment_methods_count; i++) {
+        if (strcmp(a->payment_stats[i].method, b->payment_stats[i].method) != 0 ||
+            a->payment_stats[i].count != b->payment_stats[i].count ||
+            a->payment_stats[i].amount != b->payment_stats[i].amount) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Times the report aggregation at 10K, 100K and 1M customers: the old
+// pass-per-section approach, the single pass with 1, 2, 4 and 8 worker
+// threads, and reading the month's roll-up. Every threaded result must be
+// identical to the one-thread result.
+void runReportBenchmark() {
+    int sizes[] = {10000, 100000, 1000000};
+    int thread_counts[] = {1, 2, 4, 8};
+    int bills_per_customer = MAX_HISTORY;
+    int repeats = 3;
+    double results[3][6];
+    int matches[3];
+    int saved_threads = report_threads;
+    Date current_date = getCurrentDate();
+    
+    for (int s = 0; s < 3; s++) {
+        clearCustomers();
+        addSyntheticCustomers(sizes[s]);
+        addSyntheticBills(bills_per_customer);
+        
+        ReportTotals reference;
+        matches[s] = 1;
+        
+        // Best of a few runs, so page faults on the first touch do not count
+        results[s][0] = 1e30;
+        for (int r = 0; r < repeats; r++) {
+            double start = getTimeSeconds();
+            if (aggregateReportMultiPass(current_date, &reference) != 0) {
+                printf("Error allocating report rankings!\n");
+                clearCustomers();
+                return;
+            }
+            double elapsed = getTimeSeconds() - start;
+            if (elapsed < results[s][0]) {
+                results[s][0] = elapsed;
+            }
+            if (r < repeats - 1) {
+                freeTopConsumers(&reference.top_consumers);
+            }
+        }
+        
+        ReportTotals single_thread;
+        memset(&single_thread, 0, sizeof(ReportTotals));
+        for (int t = 0; t < 4; t++) {
+            report_threads = thread_counts[t];
+            results[s][t + 1] = 1e30;
+            
+            for (int r = 0; r < repeats; r++) {
+                ReportTotals totals;
+                double start = getTimeSeconds();
+                if (aggregateReport(current_date, &totals) != 0) {
+                    printf("Error allocating report rankings!\n");
+                    freeTopConsumers(&reference.top_consumers);
+                    freeTopConsumers(&single_thread.top_consumers);
+                    report_threads = saved_threads;
+                    clearCustomers();
+                    return;
+                }
+                double elapsed = getTimeSeconds() - start;
+                if (elapsed < results[s][t + 1]) {
+                    results[s][t + 1] = elapsed;
+                }
+                
+                if (t == 0 && r == 0) {
+                    single_thread = totals;
+                    matches[s] &= reportTotalsMatch(&reference, &single_thread, 1e-9);
+                } else {
+                    matches[s] &= reportTotalsMatch(&single_thread, &totals, 0);
+                    freeTopConsumers(&totals.top_consumers);
+                }
+            }
+        }
+        
+        results[s][5] = 1e30;
+        for (int r = 0; r < repeats; r++) {
+            ReportTotals totals;
+            double start = getTimeSeconds();
+            if (getRollupReport(current_date, &totals) != 0) {
+                printf("Error allocating report rankings!\n");
+                break;
+            }
+            double elapsed = getTimeSeconds() - start;
+            if (elapsed < results[s][5]) {
+                results[s][5] = elapsed;
+            }
+            matches[s] &= reportTotalsMatch(&single_thread, &totals, 1e-9);
+            freeTopConsumers(&totals.top_consumers);
+        }
+        
+        freeTopConsumers(&reference.top_consumers);
+        freeTopConsumers(&single_thread.top_consumers);
+    }
+    report_threads = saved_threads;
+    clearCustomers();
+    
+    printf("\n===== Report Aggregation Benchmark (%d bills per customer, %ld CPUs) =====\n",
+           bills_per_customer, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %-10s %-12s %-12s %-12s %-12s %-12s %-12s %-6s\n",
+           "Customers", "Bills", "Multi (ms)", "1 thr (ms)", "2 thr (ms)", "4 thr (ms)", "8 thr (ms)",
+           "Roll-up (ms)", "Match");
+    printf("-----------------------------------------------------------------------------------------------------\n");
+    for (int s = 0; s < 3; s++) {
+        printf("%-10d %-10lld %-12.2f %-12.2f %-12.2f %-12.2f %-12.2f %-12.4f %-6s\n",
+               sizes[s],
+               (long long)sizes[s] * bills_per_customer,
+               results[s][0] * 1e3,
+               results[s][1] * 1e3,
+               results[s][2] * 1e3,
+               results[s][3] * 1e3,
+               results[s][4] * 1e3,
+               results[s][5] * 1e3,
+               matches[s] ? "yes" : "NO");
+    }
+    printf("=====================================================================================================\n");
+    printf("Match: the single pass and the roll-up agree with the multi-pass totals, and\n");
+    printf("every thread count produces exactly the same totals as one thread.\n");
+}
+
+// Rates the same synthetic bills one at a time with calculateBillAmount()
+// and in batches with calculateBillAmounts(), and checks that every amount
+// agrees to the cent
+void runTariffBenchmark() {
+    int count = 10000000;
+    int repeats = 3;
+    int *plans = malloc(count * sizeof(int));
+    float *usages = malloc(count * sizeof(float));
+    float *peak_hours = malloc(count * sizeof(float));
+    float *off_peak_hours = malloc(count * sizeof(float));
+    Money *scalar_amounts = malloc(count * sizeof(Money));
+    Money *batch_amounts = malloc(count * sizeof(Money));
+    if (plans == NULL || usages == NULL || peak_hours == NULL || off_peak_hours == NULL ||
+        scalar_amounts == NULL || batch_amounts == NULL) {
+        printf("Error allocating benchmark data!\n");
+        free(plans);
+        free(usages);
+        free(peak_hours);
+        free(off_peak_hours);
+        free(scalar_amounts);
+        free(batch_amounts);
+        return;
+    }
+    
+    // Bills are spread over every loaded plan, and usages cover every tier
+    // including the exact tier boundaries
+    unsigned int seed = 12345;
+    for (int i = 0; i < count; i++) {
+        seed = seed * 1103515245u + 12345u;
+        plans[i] = seed % rate_plan_count;
+        RatePlan *plan = &rate_plans[plans[i]];
+        usages[i] = i % 97 == 0 ? plan->tier_start[i % plan->tier_count] : (float)(seed >> 8 & 0xffff) / 64.0f;
+        peak_hours[i] = (float)(seed >> 4 & 0xff);
+        off_peak_hours[i] = (float)(seed >> 12 & 0x1ff);
+    }
+    
+    double scalar_time = 1e30, batch_time = 1e30;
+    for (int r = 0; r < repeats; r++) {
+        double start = getTimeSeconds();
+        for (int i = 0; i < count; i++) {
+            TimeOfUseUsage tou_usage = {peak_hours[i], off_peak_hours[i]};
+            scalar_amounts[i] = calculateBillAmount(&rate_plans[plans[i]], usages[i], tou_usage);
+        }
+        double elapsed = getTimeSeconds() - start;
+        if (elapsed < scalar_time) {
+            scalar_time = elapsed;
+        }
+        
+        start = getTimeSeconds();
+        calculateBillAmounts(plans, usages, peak_hours, off_peak_hours, batch_amounts, count);
+        elapsed = getTimeSeconds() - start;
+        if (elapsed < batch_time) {
+            batch_time = elapsed;
+        }
+    }
+    
+    int mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        if (scalar_amounts[i] != batch_amounts[i]) {
+            if (mismatches < 5) {
+                printf("Mismatch: plan %s usage %.4f -> %.2f (scalar) vs %.2f (batch)\n", rate_plans[plans[i]].name,
+                       usages[i], moneyToUnits(scalar_amounts[i]), moneyToUnits(batch_amounts[i]));
+            }
+            mismatches++;
+        }
+    }
+    
+    printf("\n===== Tariff Kernel Benchmark (%d bills, %d rate plans) =====\n", count, rate_plan_count);
+    printf("%-28s %-12s %-16s\n", "Method", "Time (ms)", "Bills/sec");
+    printf("----------------------------------------------------------\n");
+    printf("%-28s %-12.2f %-16.0f\n", "calculateBillAmount", scalar_time * 1e3, count / scalar_time);
+    printf("%-28s %-12.2f %-16.0f\n", "calculateBillAmounts (x4)", batch_time * 1e3, count / batch_time);
+    printf("----------------------------------------------------------\n");
+    printf("Speedup: %.2fx, mismatched amounts: %d\n", scalar_time / batch_time, mismatches);
+    printf("==========================================================\n");
+    
+    free(plans);
+    free(usages);
+    free(peak_hours);
+    free(off_peak_hours);
+    free(scalar_amounts);
+    free(batch_amounts);
+}
+
+static int compareRankingsByUsage(const void *a, const void *b) {
+    const ConsumerRanking *x = a;
+    const ConsumerRanking *y = b;
+    if (x->usage != y->usage) {
+        return x->usage < y->usage ? 1 : -1;
+    }
+    return x->customer_index - y->customer_index;
+}
+
+// Compares ways of finding the top K consumers over a skewed stream of
+// twelve bills per customer: a full sort and the bounded heap (both over
+// per-customer totals), and the fixed-memory streaming mode.
+void runTopConsumersBenchmark() {
+    int sizes[] = {10000, 1000000};
+    int k = 100;
+    int counters = 50 * k;
+    
+    printf("\n===== Top Consumers Benchmark (K = %d, %d streaming counters) =====\n", k, counters);
+    printf("%-10s %-22s %-12s %-14s %-8s\n", "Customers", "Method", "Time (ms)", "Memory (KB)", "Recall");
+    printf("----------------------------------------------------------------------\n");
+    
+    for (int s = 0; s < 2; s++) {
+        int n = sizes[s];
+        long long events = (long long)n * 12;
+        ConsumerRanking *totals = calloc(n, sizeof(ConsumerRanking));
+        ConsumerRanking *sorted = malloc(n * sizeof(ConsumerRanking));
+        TopConsumers exact, approx_top;
+        ApproxTopConsumers approx;
+        if (totals == NULL || sorted == NULL ||
+            initTopConsumers(&exact, k, RANK_BY_USAGE) != 0 ||
+            initTopConsumers(&approx_top, k, RANK_BY_USAGE) != 0 ||
+            initApproxTopConsumers(&approx, counters, RANK_BY_USAGE) != 0) {
+            printf("Error allocating benchmark data!\n");
+            free(totals);
+            free(sorted);
+            return;
+        }
+        
+        // A few customers use far more than the rest: customer = n * u^4
+        double start = getTimeSeconds();
+        unsigned long long seed = 12345;
+        for (long long e = 0; e < events; e++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            double u = (double)(seed >> 11) / 9007199254740992.0;
+            int customer_index = (int)(n * u * u * u * u);
+            float usage = 10 + (float)((seed >> 40) % 90);
+            totals[customer_index].customer_index = customer_index;
+            totals[customer_index].usage += usage;
+            totals[customer_index].amount += toMoney(usage * 7);
+        }
+        double accumulate_time = getTimeSeconds() - start;
+        
+        start = getTimeSeconds();
+        memcpy(sorted, totals, n * sizeof(ConsumerRanking));
+        qsort(sorted, n, sizeof(ConsumerRanking), compareRankingsByUsage);
+        double sort_time = accumulate_time + getTimeSeconds() - start;
+        
+        start = getTimeSeconds();
+        for (int i = 0; i < n; i++) {
+            if (totals[i].usage > 0) {
+                offerTopConsumer(&exact, &totals[i]);
+            }
+        }
+        finishTopConsumers(&exact);
+        double heap_time = accumulate_time + getTimeSeconds() - start;
+        
+        // The same stream again, without per-customer totals
+        start = getTimeSeconds();
+        seed = 12345;
+        for (long long e = 0; e < events; e++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            double u = (double)(seed >> 11) / 9007199254740992.0;
+            int customer_index = (int)(n * u * u * u * u);
+            float usage = 10 + (float)((seed >> 40) % 90);
+            addApproxConsumerUsage(&approx, customer_index, usage, toMoney(usage * 7));
+        }
+        getApproxTopConsumers(&approx, &approx_top);
+        double approx_time = getTimeSeconds() - start;
+        
+        // Recall: how many of the true top K each method found
+        int heap_hits = 0, approx_hits = 0;
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j < k; j++) {
+                heap_hits += exact.entries[j].customer_index == sorted[i].customer_index;
+                approx_hits += approx_top.entries[j].customer_index == sorted[i].customer_index;
+            }
+        }
+        
+        double totals_kb = n * sizeof(ConsumerRanking) / 1024.0;
+        printf("%-10d %-22s %-12.2f %-14.1f %d%%\n", n, "Full sort", sort_time * 1e3,
+               totals_kb * 2, 100);
+        printf("%-10d %-22s %-12.2f %-14.1f %d%%\n", n, "Bounded heap", heap_time * 1e3,
+               totals_kb + k * sizeof(ConsumerRanking) / 1024.0, heap_hits * 100 / k);
+        printf("%-10d %-22s %-12.2f %-14.1f %d%%\n", n, "Streaming (approx.)", approx_time * 1e3,
+               (counters * (sizeof(MonitoredConsumer) + sizeof(int)) + approx.slot_capacity * sizeof(int)) / 1024.0,
+               approx_hits * 100 / k);
+        
+        freeApproxTopConsumers(&approx);
+        freeTopConsumers(&approx_top);
+        freeTopConsumers(&exact);
+        free(sorted);
+        free(totals);
+    }
+    printf("======================================================================\n");
+    printf("Time includes accumulating the bills. Streaming memory stays\n");
+    printf("fixed however many customers there are.\n");
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the samples and returns the value at the given fraction (0.5 = median)
+double percentile(double *samples, int count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    qsort(samples, count, sizeof(double), compareDoubles);
+    int index = (int)(fraction * (count - 1) + 0.5);
+    return samples[index];
+}
+
+long getFileSize(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// Compares the cost of persisting a new bill by rewriting the whole snapshot
+// (the old behaviour) against appending it to the write-ahead log.
+void runLogBenchmark() {
+    int sizes[] = {1000, 10000, 100000};
+    int rewrite_ops[] = {200, 50, 10};
+    int log_ops = 200;
+    double *latencies = malloc(log_ops * sizeof(double));
+    
+    data_filename = "bench_data.bin";
+    log_filename = "bench_data.wal";
+    
+    printf("\n===== Persistence Benchmark (one new bill per operation) =====\n");
+    printf("%-10s %-14s %-12s %-12s %-14s %-10s\n",
+           "Customers", "Mode", "Avg (us)", "p99 (us)", "Bytes/op", "Write amp.");
+    printf("------------------------------------------------------------------------------\n");
+    
+    double logical_bytes = sizeof(BillingInfo);
+    
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        clearCustomers();
+        addSyntheticCustomers(n);
+        for (int i = 0; i < n; i++) {
+            TimeOfUseUsage tou_usage = {60, 140};
+            createBill(i, 200, tou_usage);
+        }
+        checkpoint();
+        
+        // Old behaviour: every change rewrites the snapshot
+        double total = 0;
+        for (int k = 0; k < rewrite_ops[s]; k++) {
+            int customer_index = (int)(((long long)k * 7919) % n);
+            TimeOfUseUsage tou_usage = {60, 140};
+            double start = getTimeSeconds();
+            createBill(customer_index, 400 + k, tou_usage);
+            checkpoint();
+            latencies[k] = getTimeSeconds() - start;
+            total += latencies[k];
+        }
+        double snapshot_bytes = getFileSize(data_filename);
+        printf("%-10d %-14s %-12.1f %-12.1f %-14.0f %-10.1f\n",
+               n, "Full rewrite",
+               total / rewrite_ops[s] * 1e6,
+               percentile(latencies, rewrite_ops[s], 0.99) * 1e6,
+               snapshot_bytes, snapshot_bytes / logical_bytes);
+        
+        // Write-ahead log: append only the changed bill
+        total = 0;
+        for (int k = 0; k < log_ops; k++) {
+            int customer_index = (int)(((long long)k * 7919) % n);
+            TimeOfUseUsage tou_usage = {60, 140};
+            double start = getTimeSeconds();
+            createBill(customer_index, 1000 + k, tou_usage);
+            logBill(getCustomer(customer_index)->last_bill);
+            latencies[k] = getTimeSeconds() - start;
+            total += latencies[k];
+        }
+        double record_bytes = sizeof(LogRecordHeader) + sizeof(LoggedBill);
+        double amortized_bytes = record_bytes + snapshot_bytes / CHECKPOINT_INTERVAL;
+        printf("%-10d %-14s %-12.1f %-12.1f %-14.0f %-10.1f\n",
+               n, "WAL append",
+               total / log_ops * 1e6,
+               percentile(latencies, log_ops, 0.99) * 1e6,
+               record_bytes, record_bytes / logical_bytes);
+        printf("%-10d %-14s %-12s %-12s %-14.0f %-10.1f\n",
+               n, "WAL+checkpoint", "-", "-",
+               amortized_bytes, amortized_bytes / logical_bytes);
+    }
+    printf("==============================================================================\n");
+    printf("WAL+checkpoint includes the snapshot rewritten every %d log records.\n", CHECKPOINT_INTERVAL);
+    
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    remove(data_filename);
+    remove(log_filename);
+    data_filename = FILENAME;
+    log_filename = LOG_FILENAME;
+    clearCustomers();
+    free(latencies);
+}
+
+typedef struct {
+    int thread;
+    int threads;
+    int customers;
+    int operations;
+    double *latencies;    // seconds, one per operation
+} CommitWorker;
+
+// Alternately adds a bill for one of the thread's own customers and pays it
+static void *runCommitWorker(void *arg) {
+    CommitWorker *worker = arg;
+    BillingInfo bill;
+    TimeOfUseUsage tou_usage = {60, 140};
+    
+    for (int k = 0; k < worker->operations; k++) {
+        int customer_index = (worker->thread + (k / 2) * worker->threads) % worker->customers;
+        double start = getTimeSeconds();
+        if (k % 2 == 0) {
+            float previous_reading = readRecentBills(customer_index, &bill, 1) == 1 ? bill.meter_reading_end : 0;
+            addBillLocked(customer_index, previous_reading + 250, tou_usage);
+        } else if (readRecentBills(customer_index, &bill, 1) == 1) {
+            payBillLocked(customer_index, bill.bill_id, "Bank Transfer");
+        }
+        worker->latencies[k] = getTimeSeconds() - start;
+    }
+    return NULL;
+}
+
+// Compares the commit modes on new bills and payments from one and from eight
+// threads: per-operation latency, and throughput up to the point where every
+// change is on disk
+void runCommitBenchmark() {
+    const int customers = 10000;
+    const int operations = 16000; // per run, shared between the threads
+    int thread_counts[] = {1, 8};
+    const char *mode_names[] = {"sync", "group", "wait"};
+    double results[3][2][4];
+    
+    double *latencies = malloc(operations * sizeof(double));
+    if (latencies == NULL) {
+        printf("Error allocating benchmark data!\n");
+        return;
+    }
+    
+    data_filename = "bench_commit.bin";
+    log_filename = "bench_commit.wal";
+    clearCustomers();
+    addSyntheticCustomers(customers);
+    checkpoint();
+    
+    for (int m = 0; m < 3; m++) {
+        commit_mode = (CommitMode)m;
+        for (int t = 0; t < 2; t++) {
+            int threads = thread_counts[t];
+            int per_thread = operations / threads;
+            pthread_t thread_ids[8];
+            CommitWorker workers[8];
+            long long syncs = log_syncs;
+            
+            double start = getTimeSeconds();
+            for (int k = 0; k < threads; k++) {
+                workers[k] = (CommitWorker){k, threads, customers, per_thread, latencies + k * per_thread};
+                if (pthread_create(&thread_ids[k], NULL, runCommitWorker, &workers[k]) != 0) {
+                    printf("Error starting benchmark thread!\n");
+                    exit(1);
+                }
+            }
+            for (int k = 0; k < threads; k++) {
+                pthread_join(thread_ids[k], NULL);
+            }
+            drainLog();
+            double elapsed = getTimeSeconds() - start;
+            
+            int count = per_thread * threads;
+            long long run_syncs = log_syncs - syncs;
+            results[m][t][0] = percentile(latencies, count, 0.5);
+            results[m][t][1] = percentile(latencies, count, 0.99);
+            results[m][t][2] = count / elapsed;
+            results[m][t][3] = run_syncs > 0 ? (double)count / run_syncs : 0;
+        }
+    }
+    stopLogWriter();
+    commit_mode = COMMIT_SYNC;
+    
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    remove(data_filename);
+    remove(log_filename);
+    data_filename = FILENAME;
+    log_filename = LOG_FILENAME;
+    clearCustomers();
+    free(latencies);
+    
+    printf("\n===== Commit Mode Benchmark (%d bills and payments per run, %ld CPUs) =====\n",
+           operations, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %-8s %-12s %-12s %-14s %-14s\n", "Mode", "Threads", "p50 (us)", "p99 (us)", "Ops/sec", "Records/fsync");
+    printf("---------------------------------------------------------------------------\n");
+    for (int m = 0; m < 3; m++) {
+        for (int t = 0; t < 2; t++) {
+            printf("%-8s %-8d %-12.1f %-12.1f %-14.0f %-14.1f\n", mode_names[m], thread_counts[t],
+                   results[m][t][0] * 1e6, results[m][t][1] * 1e6, results[m][t][2], results[m][t][3]);
+        }
+    }
+    printf("===========================================================================\n");
+    printf("sync: each change is synced before it returns. group: changes return once queued\n");
+    printf("and a writer thread syncs them in batches. wait: queued, but each change waits for\n");
+    printf("its batch to be synced. Ops/sec counts until every change is on disk.\n");
+}
+
+// Loads the snapshot in whatever version it was written and saves it again in
+// the current format, reporting the size and load and save times of each.
+// Returns 0 on success, -1 on error.
+int migrateSnapshot() {
+    if (storage_mode == STORAGE_MMAP) {
+        printf("The --mmap database is not stored as a snapshot; nothing to migrate.\n");
+        return -1;
+    }
+    
+    FILE *file = fopen(data_filename, "rb");
+    int header[2] = {0, 0};
+    if (file == NULL) {
+        printf("No data file %s to migrate!\n", data_filename);
+        return -1;
+    }
+    if (fread(header, sizeof(int), 2, file) != 2 || header[0] != DATA_MAGIC) {
+        header[1] = 0; // Written before files had a header
+    }
+    fclose(file);
+    long old_bytes = getFileSize(data_filename);
+    
+    double start = getTimeSeconds();
+    loadData();
+    double load_time = getTimeSeconds() - start;
+    
+    start = getTimeSeconds();
+    if (checkpoint() != 0) {
+        printf("Error writing data file %s!\n", data_filename);
+        return -1;
+    }
+    double save_time = getTimeSeconds() - start;
+    
+    printf("\n===== Snapshot Migration (%d customers, %d bills) =====\n", customer_count, ledger_count);
+    printf("%-10s %-14s %-12s\n", "Version", "Size (bytes)", "Time (ms)");
+    printf("--------------------------------------\n");
+    printf("%-10d %-14ld %-12.1f (load)\n", header[1], old_bytes, load_time * 1e3);
+    printf("%-10d %-14ld %-12.1f (save)\n", DATA_VERSION, getFileSize(data_filename), save_time * 1e3);
+    printf("======================================\n");
+    return 0;
+}
+
+static unsigned int hashBytes(unsigned int hash, const void *bytes, size_t count) {
+    const unsigned char *data = bytes;
+    for (size_t i = 0; i < count; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a over every field of every customer and bill. Text is hashed up to
+// its terminator, since the bytes after it are not saved.
+static unsigned int getDataFingerprint() {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < customer_count; i++) {
+        Customer *c = getCustomer(i);
+        int numbers[] = {c->customer_id, c->type, c->bill_count, c->last_bill,
+                         getDayNumber(c->connection_date), c->is_active};
+        hash = hashBytes(hash, numbers, sizeof(numbers));
+        for (int col = 0; col < CUSTOMER_TEXT_COLUMN_COUNT; col++) {
+            const char *text = (const char *)c + customer_text_columns[col].offset;
+            hash = hashBytes(hash, text, strnlen(text, customer_text_columns[col].capacity));
+        }
+    }
+    for (int row = 0; row < ledger_count; row++) {
+        const char *chunk = (const char *)getBillChunk(row);
+        int i = row % BILL_CHUNK_SIZE;
+        for (int col = 0; col < LEDGER_COLUMN_COUNT; col++) {
+            const char *field = chunk + ledger_columns[col].offset + i * ledger_columns[col].size;
+            size_t size = ledger_columns[col].offset == offsetof(BillChunk, payment_method) ?
+                strnlen(field, 20) : ledger_columns[col].size;
+            hash = hashBytes(hash, field, size);
+        }
+    }
+    return hash;
+}
+
+// Compares the size and save and load times of the raw (version 4) and
+// columnar snapshot formats at several sizes
+void runFormatBenchmark() {
+    int sizes[] = {10000, 100000, 1000000};
+    int formats[] = {RAW_DATA_VERSION, DATA_VERSION};
+    const char *format_names[] = {"Raw", "Columnar"};
+    const int bills_per_customer = 12;
+    
+    data_filename = "bench_data.bin";
+    log_filename = "bench_data.wal";
+    remove(log_filename);
+    
+    double results[3][2][3];
+    int matched[3][2];
+    
+    for (int s = 0; s < 3; s++) {
+        for (int f = 0; f < 2; f++) {
+            clearCustomers();
+            addSyntheticCustomers(sizes[s]);
+            addSyntheticBills(bills_per_customer);
+            unsigned int fingerprint = getDataFingerprint();
             
-        case 0:
-            return;
+            double start = getTimeSeconds();
+            long bytes = writeSnapshotFile(data_filename, formats[f]);
+            results[s][f][1] = getTimeSeconds() - start;
+            results[s][f][0] = bytes / (1024.0 * 1024.0);
             
-        default:
-            printf("Invalid choice!\n");
+            start = getTimeSeconds();
+            loadData();
+            results[s][f][2] = getTimeSeconds() - start;
+            matched[s][f] = bytes > 0 && customer_count == sizes[s] &&
+                            ledger_count == sizes[s] * bills_per_customer &&
+                            getDataFingerprint() == fingerprint;
+            
+            if (log_file != NULL) {
+                fclose(log_file);
+                log_file = NULL;
+            }
+        }
     }
     
-    saveData();
+    remove(data_filename);
+    remove(log_filename);
+    data_filename = FILENAME;
+    log_filename = LOG_FILENAME;
+    clearCustomers();
+    
+    printf("\n===== Snapshot Format Benchmark (%d bills per customer) =====\n", bills_per_customer);
+    printf("%-10s %-10s %-10s %-12s %-12s %-12s %-6s\n",
+           "Customers", "Bills", "Format", "Size (MB)", "Save (ms)", "Load (ms)", "Match");
+    printf("------------------------------------------------------------------------\n");
+    for (int s = 0; s < 3; s++) {
+        for (int f = 0; f < 2; f++) {
+            printf("%-10d %-10d %-10s %-12.1f %-12.1f %-12.1f %-6s\n",
+                   sizes[s], sizes[s] * bills_per_customer, format_names[f],
+                   results[s][f][0], results[s][f][1] * 1e3, results[s][f][2] * 1e3,
+                   matched[s][f] ? "yes" : "NO");
+        }
+    }
+    printf("========================================================================\n");
+    printf("Save includes fsync. Match: loading the file gives back every customer\n");
+    printf("and bill field as saved.\n");
 }
 
-void showAllCustomers() {
-    if (customer_count == 0) {
-        printf("No customers found!\n");
-        return;
+// Writes the bills CSV with one fprintf per bill, the way the text report is
+// written, for comparison with the export writer. Returns the bytes written.
+static long long exportBillsWithFprintf(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    for (int row = 0; row < ledger_count; row++) {
+        BillingInfo bill = getBill(row);
+        Customer *c = getCustomer(BILL_FIELD(row, customer_index));
+        fprintf(file, "%d,%d,%s,%04d-%02d-%02d,%04d-%02d-%02d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%d,",
+                bill.bill_id, c->customer_id, c->meter_number,
+                bill.bill_date.year, bill.bill_date.month, bill.bill_date.day,
+                bill.due_date.year, bill.due_date.month, bill.due_date.day,
+                bill.meter_reading_start, bill.meter_reading_end, bill.total_usage,
+                bill.tou_usage.peak_hours, bill.tou_usage.off_peak_hours,
+                moneyToUnits(bill.amount), bill.is_paid);
+        if (bill.is_paid) {
+            fprintf(file, "%04d-%02d-%02d", bill.payment_date.year, bill.payment_date.month, bill.payment_date.day);
+        }
+        fprintf(file, ",%s\n", bill.payment_method);
     }
+    long long bytes = ftell(file);
+    fclose(file);
+    return bytes;
+}
+
+// Times exporting a year of bills for synthetic customers in each format,
+// against fprintf formatting and against writing the same number of bytes
+// without any formatting
+void runExportBenchmark() {
+    const int customers = 1000000;
+    const int bills_per_customer = 12;
+    const char *filename = "bench_export.tmp";
     
-    printf("\n===== All Customers =====\n");
-    printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
-    printf("---------------------------------------------------------------\n");
+    clearCustomers();
+    addSyntheticCustomers(customers);
+    addSyntheticBills(bills_per_customer);
     
-    for (int i = 0; i < customer_count; i++) {
-        Customer c = customers[i];
-        printf("%-5d %-20s %-15s %-15s %-10s\n", 
-               c.customer_id, 
-               c.name, 
-               c.meter_number, 
-               c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
-               c.is_active ? "Active" : "Inactive");
+    const char *names[] = {"Bills CSV", "Bills JSONL", "Payments CSV", "Bills fprintf", "Raw write"};
+    double seconds[5];
+    long long rows[5], bytes[5];
+    
+    ExportDataset datasets[] = {EXPORT_BILLS, EXPORT_BILLS, EXPORT_PAYMENTS};
+    ExportFormat formats[] = {EXPORT_CSV, EXPORT_JSONL, EXPORT_CSV};
+    for (int i = 0; i < 3; i++) {
+        double start = getTimeSeconds();
+        if (exportData(datasets[i], formats[i], filename, &rows[i], &bytes[i]) != 0) {
+            printf("Error writing export file %s!\n", filename);
+            rows[i] = bytes[i] = 0;
+        }
+        seconds[i] = getTimeSeconds() - start;
     }
     
-    printf("---------------------------------------------------------------\n");
-    printf("Total Customers: %d\n", customer_count);
+    double start = getTimeSeconds();
+    bytes[3] = exportBillsWithFprintf(filename);
+    seconds[3] = getTimeSeconds() - start;
+    rows[3] = ledger_count;
+    
+    // The same bytes as the bills CSV, written from a filled buffer
+    char *block = malloc(EXPORT_BUFFER_SIZE);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bytes[4] = 0;
+    start = getTimeSeconds();
+    if (block != NULL && fd != -1) {
+        memset(block, 'x', EXPORT_BUFFER_SIZE);
+        while (bytes[4] < bytes[0]) {
+            ssize_t n = write(fd, block, EXPORT_BUFFER_SIZE);
+            if (n <= 0) {
+                break;
+            }
+            bytes[4] += n;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    seconds[4] = getTimeSeconds() - start;
+    rows[4] = 0;
+    free(block);
+    
+    remove(filename);
+    clearCustomers();
+    
+    printf("\n===== Export Benchmark (%d customers, %d bills) =====\n", customers, customers * bills_per_customer);
+    printf("%-15s %-12s %-12s %-10s %-14s %-10s\n", "Export", "Records", "Size (MB)", "Time (s)", "Records/sec", "MB/s");
+    printf("----------------------------------------------------------------------------\n");
+    for (int i = 0; i < 5; i++) {
+        double megabytes = bytes[i] / (1024.0 * 1024.0);
+        printf("%-15s %-12lld %-12.1f %-10.3f %-14.0f %-10.1f\n",
+               names[i], rows[i], megabytes, seconds[i],
+               seconds[i] > 0 ? rows[i] / seconds[i] : 0,
+               seconds[i] > 0 ? megabytes / seconds[i] : 0);
+    }
+    printf("============================================================================\n");
+    printf("Raw write: the bills CSV's size in unformatted 1 MB writes, the disk's limit.\n");
 }
 
-void searchCustomer() {
-    if (customer_count == 0) {
-        printf("No customers found!\n");
+// Generated data is drawn from a fixed seed, so the same arguments always
+// give the same customers and bills
+static unsigned long long nextRandom(unsigned long long *state) {
+    // splitmix64
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static int randomBelow(unsigned long long *state, int limit) {
+    return (int)(nextRandom(state) % (unsigned long long)limit);
+}
+
+static double randomUnit(unsigned long long *state) {
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Standard normal sample (Box-Muller)
+static double randomGaussian(unsigned long long *state) {
+    double u = randomUnit(state);
+    double v = randomUnit(state);
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+}
+
+static void lowercaseText(char *text) {
+    for (; *text; text++) {
+        if (*text >= 'A' && *text <= 'Z') {
+            *text += 'a' - 'A';
+        }
+    }
+}
+
+// Replaces the store with customers and bills_per_customer monthly bills each,
+// ending with the current month, in rough utility proportions: mostly
+// residential customers, log-normal usage by type with summer and winter
+// peaks, most past bills paid within a few weeks by a mix of methods, and a
+// few customers on non-default plans or disconnected.
+void generateData(int customers, int bills_per_customer, unsigned long long seed) {
+    const char *first_names[] = {"James", "Mary", "Robert", "Patricia", "John", "Jennifer", "Michael", "Linda",
+                                 "Priya", "Wei", "Fatima", "Carlos", "Aisha", "Hiroshi", "Olga", "Kwame"};
+    const char *last_names[] = {"Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis",
+                                "Patel", "Chen", "Khan", "Lopez", "Okafor", "Tanaka", "Ivanova", "Mensah"};
+    const char *business_suffixes[] = {"Trading", "Foods", "Motors", "Stores", "Clinic", "Bakery"};
+    const char *industry_suffixes[] = {"Industries", "Steel Works", "Plastics", "Textiles"};
+    const char *streets[] = {"Main Street", "Oak Avenue", "Park Road", "Station Road", "High Street",
+                             "Lake View", "Mill Lane", "Church Street", "River Road", "Hill Crescent"};
+    const char *towns[] = {"Springfield", "Riverside", "Fairview", "Greenville", "Madison", "Georgetown"};
+    const char *methods[] = {"Bank Transfer", "Credit Card", "Direct Debit", "Cash", "Cheque"};
+    const int method_weights[] = {35, 30, 20, 10, 5};
+    const double mean_usage[] = {300, 2500, 25000}; // units per month by customer type
+    
+    unsigned long long state = seed;
+    DayNumber today = getToday();
+    Date current_date = getDateOfDay(today);
+    
+    // The first month billed; customers were connected some time before it
+    int first_month = current_date.year * 12 + current_date.month - 1 - (bills_per_customer - 1);
+    DayNumber first_bill_day = getMonthStart(first_month / 12, first_month % 12 + 1);
+    
+    clearCustomers();
+    
+    float *usage_scale = (float *)malloc(customers * sizeof(float));
+    float *peak_share = (float *)malloc(customers * sizeof(float));
+    if (usage_scale == NULL || peak_share == NULL) {
+        printf("Error allocating generator data!\n");
+        free(usage_scale);
+        free(peak_share);
         return;
     }
     
-    int choice;
-    printf("\n===== Search Customer =====\n");
-    printf("1. Search by Name\n");
-    printf("2. Search by Meter Number\n");
-    printf("3. Search by Customer ID\n");
-    printf("4. Search by Phone\n");
-    printf("Enter your choice: ");
-    scanf("%d", &choice);
-    getchar(); // Consume newline
+    Customer customer;
+    memset(&customer, 0, sizeof(Customer));
+    customer.last_bill = -1;
     
-    char search_term[MAX_NAME_LENGTH];
-    int found = 0;
+    for (int i = 0; i < customers; i++) {
+        int type_draw = randomBelow(&state, 100);
+        customer.type = type_draw < 85 ? RESIDENTIAL : type_draw < 97 ? COMMERCIAL : INDUSTRIAL;
+        customer.customer_id = customer_count + FIRST_CUSTOMER_ID;
+        
+        const char *first = first_names[randomBelow(&state, 16)];
+        const char *last = last_names[randomBelow(&state, 16)];
+        if (customer.type == RESIDENTIAL) {
+            snprintf(customer.name, MAX_NAME_LENGTH, "%s %s", first, last);
+            snprintf(customer.email, 50, "%s.%s%d@example.com", first, last, randomBelow(&state, 1000));
+        } else {
+            const char *suffix = customer.type == COMMERCIAL ? business_suffixes[randomBelow(&state, 6)]
+                                                             : industry_suffixes[randomBelow(&state, 4)];
+            snprintf(customer.name, MAX_NAME_LENGTH, "%s %s", last, suffix);
+            snprintf(customer.email, 50, "accounts%d@%s.example.com", randomBelow(&state, 100), last);
+        }
+        lowercaseText(customer.email);
+        snprintf(customer.address, MAX_ADDRESS_LENGTH, "%d %s, %s",
+                 1 + randomBelow(&state, 2000), streets[randomBelow(&state, 10)], towns[randomBelow(&state, 6)]);
+        snprintf(customer.phone, 15, "555%07d", randomBelow(&state, 10000000));
+        snprintf(customer.meter_number, 20, "MTR%08d", customer_count);
+        
+        // One customer in ten is on a plan loaded from the rate plan file, if any
+        customer.rate_plan[0] = '\0';
+        if (rate_plan_count > 3 && randomBelow(&state, 10) == 0) {
+            strcpy(customer.rate_plan, rate_plans[3 + randomBelow(&state, rate_plan_count - 3)].name);
+        }
+        
+        customer.connection_date = getDateOfDay(first_bill_day - 30 - randomBelow(&state, 3650));
+        customer.is_active = randomBelow(&state, 100) >= 2;
+        
+        int customer_index = appendCustomer(&customer);
+        if (customer_index == -1) {
+            break;
+        }
+        indexCustomerMeter(customer_index);
+        indexCustomerId(customer_index);
+        indexCustomerText(customer_index);
+        
+        usage_scale[customer_index] = (float)(mean_usage[customer.type] * exp(0.5 * randomGaussian(&state) - 0.125));
+        peak_share[customer_index] = 0.25f + 0.25f * (float)randomUnit(&state);
+    }
     
-    switch (choice) {
-        case 1:
-            printf("Enter customer name: ");
-            fgets(search_term, MAX_NAME_LENGTH, stdin);
-            search_term[strcspn(search_term, "\n")] = 0; // Remove newline
+    for (int k = 0; k < bills_per_customer; k++) {
+        int month = first_month + k;
+        int months_back = bills_per_customer - 1 - k;
+        DayNumber bill_day = getMonthStart(month / 12, month % 12 + 1);
+        
+        // Usage peaks in January and July
+        double season = 1.0 + 0.2 * cos(2.0 * M_PI * (month % 12) / 6.0);
+        
+        // Almost all older bills are paid; the latest ones are still coming in
+        int paid_percent = months_back >= 2 ? 97 : months_back == 1 ? 80 : 35;
+        
+        for (int c = 0; c < customer_count; c++) {
+            Customer *cust = getCustomer(c);
+            if (!cust->is_active && months_back < 3) {
+                continue; // Disconnected a few months ago
+            }
             
-            printf("\n--- Search Results ---\n");
-            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
-            printf("---------------------------------------------------------------\n");
+            float usage = (float)(usage_scale[c] * season * exp(0.15 * randomGaussian(&state)));
+            float previous_reading = cust->last_bill != -1 ? BILL_FIELD(cust->last_bill, meter_reading_end) : 0;
+            TimeOfUseUsage tou_usage = {usage * peak_share[c], usage * (1 - peak_share[c])};
+            if (createBill(c, previous_reading + usage, tou_usage) == -1) {
+                free(usage_scale);
+                free(peak_share);
+                return;
+            }
             
-            for (int i = 0; i < customer_count; i++) {
-                if (strstr(customers[i].name, search_term) != NULL) {
-                    Customer c = customers[i];
-                    printf("%-5d %-20s %-15s %-15s %-10s\n", 
-                           c.customer_id, 
-                           c.name, 
-                           c.meter_number, 
-                           c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
-                           c.is_active ? "Active" : "Inactive");
-                    found++;
+            int row = cust->last_bill;
+            BILL_FIELD(row, bill_date) = bill_day;
+            BILL_FIELD(row, due_date) = bill_day + 15;
+            if (randomBelow(&state, 100) < paid_percent) {
+                DayNumber paid_day = bill_day + 1 + randomBelow(&state, 28);
+                BILL_FIELD(row, is_paid) = 1;
+                BILL_FIELD(row, payment_date) = paid_day < today ? paid_day : today;
+                
+                int draw = randomBelow(&state, 100);
+                int method = 0;
+                while (draw >= method_weights[method]) {
+                    draw -= method_weights[method++];
                 }
+                strcpy(BILL_FIELD(row, payment_method), methods[method]);
             }
+        }
+    }
+    
+    free(usage_scale);
+    free(peak_share);
+    
+    // The bills were backdated after they were added, so their roll-ups are
+    // built once from the finished ledger
+    rebuildRollups(&rollup_table);
+}
+
+// --generate <customers> <bills per customer>: writes generated data to the
+// data file. Returns 0 on success, -1 on error.
+int runDataGenerator(const char *customers_arg, const char *bills_arg) {
+    int customers = atoi(customers_arg);
+    int bills_per_customer = atoi(bills_arg);
+    if (customers <= 0 || bills_per_customer < 0) {
+        printf("Invalid customer or bill count!\n");
+        return -1;
+    }
+    if (access(data_filename, F_OK) == 0) {
+        printf("Data file %s already exists! Move it away before generating data.\n", data_filename);
+        return -1;
+    }
+    
+    double start = getTimeSeconds();
+    pinClock();
+    generateData(customers, bills_per_customer, 1);
+    unpinClock();
+    double generate_time = getTimeSeconds() - start;
+    
+    start = getTimeSeconds();
+    if (checkpoint() != 0) {
+        printf("Error writing data file %s!\n", data_filename);
+        return -1;
+    }
+    double save_time = getTimeSeconds() - start;
+    
+    printf("Generated %d customers and %d bills in %.3f s, saved to %s (%.1f MB) in %.3f s\n",
+           customer_count, ledger_count, generate_time, data_filename,
+           getFileSize(data_filename) / (1024.0 * 1024.0), save_time);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int customers;
+    int bills;
+    long long operations;
+    double seconds;
+} SuiteResult;
+
+// Times the main operations on generated data at several sizes, printing a
+// table and appending the results as CSV to results_filename, one line per
+// operation and size, so that runs of different releases can be compared
+void runBenchmarkSuite(const char *results_filename) {
+    int sizes[] = {10000, 100000, 1000000};
+    const int bills_per_customer = 12;
+    const int rating_ops = 1 << 20;
+    const int queries = 100; // per search field
+    
+    SuiteResult results[3 * 7];
+    int result_count = 0;
+    int failures = 0;
+    
+    data_filename = "bench_suite.bin";
+    log_filename = "bench_suite.wal";
+    report_filename = "bench_suite.txt";
+    remove(log_filename);
+    
+    int *plans = (int *)malloc(rating_ops * sizeof(int));
+    float *usages = (float *)malloc(rating_ops * sizeof(float));
+    TimeOfUseUsage *tou = (TimeOfUseUsage *)malloc(rating_ops * sizeof(TimeOfUseUsage));
+    if (plans == NULL || usages == NULL || tou == NULL) {
+        printf("Error allocating benchmark data!\n");
+        free(plans);
+        free(usages);
+        free(tou);
+        return;
+    }
+    
+    pinClock();
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        
+        double start = getTimeSeconds();
+        generateData(n, bills_per_customer, 1);
+        double seconds = getTimeSeconds() - start;
+        int bills = ledger_count;
+        results[result_count++] = (SuiteResult){"generate", n, bills, (long long)n + bills, seconds};
+        
+        // Rating the generated bills again, cycling through them
+        for (int i = 0; i < rating_ops; i++) {
+            int row = i % ledger_count;
+            plans[i] = getCustomerRatePlan(getCustomer(BILL_FIELD(row, customer_index)));
+            usages[i] = BILL_FIELD(row, total_usage);
+            tou[i].peak_hours = BILL_FIELD(row, peak_hours);
+            tou[i].off_peak_hours = BILL_FIELD(row, off_peak_hours);
+        }
+        volatile Money rated_total = 0;
+        start = getTimeSeconds();
+        for (int i = 0; i < rating_ops; i++) {
+            rated_total += calculateBillAmount(&rate_plans[plans[i]], usages[i], tou[i]);
+        }
+        results[result_count++] = (SuiteResult){"calculate_bill", n, bills, rating_ops, getTimeSeconds() - start};
+        
+        // Every meter number, in a scrambled order
+        char (*meters)[20] = malloc((size_t)n * 20);
+        if (meters == NULL) {
+            printf("Error allocating benchmark data!\n");
             break;
-            
-        case 2:
-            printf("Enter meter number: ");
-            fgets(search_term, MAX_NAME_LENGTH, stdin);
-            search_term[strcspn(search_term, "\n")] = 0; // Remove newline
-            
-            printf("\n--- Search Results ---\n");
-            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
-            printf("---------------------------------------------------------------\n");
-            
-            for (int i = 0; i < customer_count; i++) {
-                if (strstr(customers[i].meter_number, search_term) != NULL) {
-                    Customer c = customers[i];
-                    printf("%-5d %-20s %-15s %-15s %-10s\n", 
-                           c.customer_id, 
-                           c.name, 
-                           c.meter_number, 
-                           c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
-                           c.is_active ? "Active" : "Inactive");
-                    found++;
+        }
+        for (int i = 0; i < n; i++) {
+            strcpy(meters[i], getCustomer((int)(((long long)i * 7919) % n))->meter_number);
+        }
+        start = getTimeSeconds();
+        for (int i = 0; i < n; i++) {
+            if (findCustomerByMeterNumber(meters[i]) == -1) {
+                failures++;
+            }
+        }
+        results[result_count++] = (SuiteResult){"find_meter", n, bills, n, getTimeSeconds() - start};
+        free(meters);
+        
+        // Searches as the menu runs them: a full name, the end of a meter
+        // number and the end of a phone number of random customers
+        buildSearchIndex();
+        unsigned long long state = 7;
+        start = getTimeSeconds();
+        for (int q = 0; q < queries * 3; q++) {
+            Customer *c = getCustomer(randomBelow(&state, n));
+            SearchField field = (SearchField)(q % 3);
+            const char *term = field == SEARCH_NAME ? c->name
+                             : field == SEARCH_METER_NUMBER ? c->meter_number + 5 : c->phone + 3;
+            int *matches;
+            int count = findCustomersByText(field, term, &matches);
+            if (count <= 0) {
+                failures++;
+            }
+            free(matches);
+        }
+        results[result_count++] = (SuiteResult){"search", n, bills, queries * 3, getTimeSeconds() - start};
+        
+        start = getTimeSeconds();
+        generateReport();
+        results[result_count++] = (SuiteResult){"generate_report", n, bills, 1, getTimeSeconds() - start};
+        
+        unsigned int fingerprint = getDataFingerprint();
+        start = getTimeSeconds();
+        if (checkpoint() != 0) {
+            failures++;
+        }
+        results[result_count++] = (SuiteResult){"save_data", n, bills, 1, getTimeSeconds() - start};
+        
+        start = getTimeSeconds();
+        loadData();
+        results[result_count++] = (SuiteResult){"load_data", n, bills, 1, getTimeSeconds() - start};
+        if (customer_count != n || ledger_count != bills || getDataFingerprint() != fingerprint) {
+            failures++;
+        }
+        
+        if (log_file != NULL) {
+            fclose(log_file);
+            log_file = NULL;
+        }
+    }
+    unpinClock();
+    
+    free(plans);
+    free(usages);
+    free(tou);
+    
+    remove(report_filename);
+    remove(data_filename);
+    remove(log_filename);
+    data_filename = FILENAME;
+    log_filename = LOG_FILENAME;
+    report_filename = NULL;
+    clearCustomers();
+    clearRollups(&rollup_table);
+    
+    printf("\n===== Benchmark Suite (%d bills per customer) =====\n", bills_per_customer);
+    printf("%-18s %-10s %-10s %-12s %-12s %-14s\n", "Operation", "Customers", "Bills", "Operations", "Time (ms)", "ns/op");
+    printf("------------------------------------------------------------------------------\n");
+    for (int i = 0; i < result_count; i++) {
+        printf("%-18s %-10d %-10d %-12lld %-12.2f %-14.1f\n",
+               results[i].name, results[i].customers, results[i].bills, results[i].operations,
+               results[i].seconds * 1e3, results[i].seconds / results[i].operations * 1e9);
+    }
+    printf("==============================================================================\n");
+    if (failures > 0) {
+        printf("Warning: %d lookups, searches or reloads did not find the expected data!\n", failures);
+    }
+    
+    // One CSV line per result, with a header when the file is new
+    FILE *file = fopen(results_filename, "a");
+    if (file == NULL) {
+        printf("Error opening results file %s!\n", results_filename);
+        return;
+    }
+    if (ftell(file) == 0) {
+        fprintf(file, "timestamp,data_version,operation,customers,bills,operations,seconds,ns_per_op\n");
+    }
+    long long timestamp = (long long)time(NULL);
+    for (int i = 0; i < result_count; i++) {
+        fprintf(file, "%lld,%d,%s,%d,%d,%lld,%.6f,%.1f\n",
+                timestamp, DATA_VERSION, results[i].name, results[i].customers, results[i].bills,
+                results[i].operations, results[i].seconds, results[i].seconds / results[i].operations * 1e9);
+    }
+    fclose(file);
+    printf("Results appended to %s\n", results_filename);
+}
+
+typedef enum {
+    WORKLOAD_READS,
+    WORKLOAD_MIXED,
+    WORKLOAD_ONE_LOCK,    // the mixed workload with every operation under one lock
+    WORKLOAD_COUNT
+} Workload;
+
+typedef struct {
+    Workload workload;
+    int operations;
+    int lookup_customers;  // customers whose meter number is MTR followed by their index
+    unsigned long long seed;
+    long long failures;    // lookups that missed, or histories out of order
+} ConcurrencyWorker;
+
+static pthread_mutex_t benchmark_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static int benchmark_next_meter = 0;
+
+static void *runConcurrencyWorker(void *arg) {
+    ConcurrencyWorker *worker = arg;
+    unsigned long long state = worker->seed;
+    BillingInfo bills[MAX_HISTORY];
+    Customer customer;
+    char meter_number[20];
+    
+    for (int i = 0; i < worker->operations; i++) {
+        // Mixed: 70% lookups, 15% histories, 7% bills, 7% payments, 1% new customers
+        int pick = randomBelow(&state, 100);
+        if (worker->workload == WORKLOAD_READS) {
+            pick = pick < 80 ? 0 : 70;
+        }
+        if (worker->workload == WORKLOAD_ONE_LOCK) {
+            pthread_mutex_lock(&benchmark_store_lock);
+        }
+        
+        if (pick < 70) {
+            int customer_index = randomBelow(&state, worker->lookup_customers);
+            snprintf(meter_number, 20, "MTR%08d", customer_index);
+            if (readCustomerByMeter(meter_number, &customer) != customer_index ||
+                strcmp(customer.meter_number, meter_number) != 0) {
+                worker->failures++;
+            }
+        } else if (pick < 85) {
+            int customer_index = randomBelow(&state, __atomic_load_n(&customer_count, __ATOMIC_ACQUIRE));
+            int count = readRecentBills(customer_index, bills, MAX_HISTORY);
+            for (int k = 1; k < count; k++) {
+                if (bills[k].bill_id <= bills[k - 1].bill_id ||
+                    bills[k].meter_reading_start != bills[k - 1].meter_reading_end) {
+                    worker->failures++;
+                    break;
                 }
             }
-            break;
-            
-        case 3:
-            printf("Enter customer ID: ");
-            int search_id;
-            scanf("%d", &search_id);
-            getchar(); // Consume newline
-            
-            printf("\n--- Search Results ---\n");
-            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
-            printf("---------------------------------------------------------------\n");
-            
-            for (int i = 0; i < customer_count; i++) {
-                if (customers[i].customer_id == search_id) {
-                    Customer c = customers[i];
-                    printf("%-5d %-20s %-15s %-15s %-10s\n", 
-                           c.customer_id, 
-                           c.name, 
-                           c.meter_number, 
-                           c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
-                           c.is_active ? "Active" : "Inactive");
-                    found++;
+        } else if (pick < 92) {
+            int customer_index = randomBelow(&state, worker->lookup_customers);
+            float previous_reading = 0;
+            if (readRecentBills(customer_index, bills, 1) == 1) {
+                previous_reading = bills[0].meter_reading_end;
+            }
+            TimeOfUseUsage tou_usage = {(float)randomBelow(&state, 100), (float)randomBelow(&state, 100)};
+            addBillLocked(customer_index, previous_reading + 100 + randomBelow(&state, 900), tou_usage);
+        } else if (pick < 99) {
+            int customer_index = randomBelow(&state, worker->lookup_customers);
+            int count = readRecentBills(customer_index, bills, MAX_HISTORY);
+            for (int k = count - 1; k >= 0; k--) {
+                if (!bills[k].is_paid) {
+                    payBillLocked(customer_index, bills[k].bill_id, "Bank Transfer");
+                    break;
                 }
             }
-            break;
-            
-        case 4:
-            printf("Enter phone number: ");
-            fgets(search_term, MAX_NAME_LENGTH, stdin);
-            search_term[strcspn(search_term, "\n")] = 0; // Remove newline
-            
-            printf("\n--- Search Results ---\n");
-            printf("%-5s %-20s %-15s %-15s %-10s\n", "ID", "Name", "Meter Number", "Type", "Status");
-            printf("---------------------------------------------------------------\n");
+        } else {
+            memset(&customer, 0, sizeof(Customer));
+            int number = __atomic_fetch_add(&benchmark_next_meter, 1, __ATOMIC_RELAXED);
+            customer.last_bill = -1;
+            customer.is_active = 1;
+            customer.type = (CustomerType)(number % 3);
+            snprintf(customer.name, MAX_NAME_LENGTH, "New Customer %d", number);
+            snprintf(customer.meter_number, 20, "NEW%08d", number);
+            addCustomerLocked(&customer);
+        }
+        
+        if (worker->workload == WORKLOAD_ONE_LOCK) {
+            pthread_mutex_unlock(&benchmark_store_lock);
+        }
+    }
+    return NULL;
+}
+
+// Checks that every customer's bill chain holds bill_count bills and that
+// together they make up the ledger. Returns the number of customers wrong.
+static int checkBillChains() {
+    int wrong = 0;
+    long long total = 0;
+    for (int i = 0; i < customer_count; i++) {
+        Customer *c = getCustomer(i);
+        int count = 0;
+        for (int row = c->last_bill; row != -1; row = BILL_FIELD(row, prev_bill)) {
+            if (BILL_FIELD(row, customer_index) != i) {
+                break;
+            }
+            count++;
+        }
+        wrong += count != c->bill_count;
+        total += count;
+    }
+    return wrong + (total != ledger_count);
+}
+
+// Runs lookups, histories, bills, payments and new customers from 1 to 16
+// threads at once, reporting throughput, and checks the store afterwards
+void runConcurrencyBenchmark() {
+    const int customers = 200000;
+    const int operations = 1000000; // per run, shared between the threads
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    const char *workload_names[] = {"Reads", "Mixed", "Mixed, one lock"};
+    double results[WORKLOAD_COUNT][5];
+    long long failures = 0;
+    
+    clearCustomers();
+    buildCustomerIdIndex();
+    addSyntheticCustomers(customers);
+    addSyntheticBills(MAX_HISTORY);
+    benchmark_next_meter = 0;
+    
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        for (int t = 0; t < 5; t++) {
+            int threads = thread_counts[t];
+            pthread_t thread_ids[16];
+            ConcurrencyWorker workers[16];
             
-            for (int i = 0; i < customer_count; i++) {
-                if (strstr(customers[i].phone, search_term) != NULL) {
-                    Customer c = customers[i];
-                    printf("%-5d %-20s %-15s %-15s %-10s\n", 
-                           c.customer_id, 
-                           c.name, 
-                           c.meter_number, 
-                           c.type == RESIDENTIAL ? "Residential" : (c.type == COMMERCIAL ? "Commercial" : "Industrial"),
-                           c.is_active ? "Active" : "Inactive");
-                    found++;
+            double start = getTimeSeconds();
+            for (int k = 0; k < threads; k++) {
+                workers[k] = (ConcurrencyWorker){(Workload)w, operations / threads, customers,
+                                                 (unsigned long long)(w * 100 + t * 16 + k + 1), 0};
+                if (pthread_create(&thread_ids[k], NULL, runConcurrencyWorker, &workers[k]) != 0) {
+                    printf("Error starting benchmark thread!\n");
+                    exit(1);
                 }
             }
-            break;
-            
-        default:
-            printf("Invalid choice!\n");
+            for (int k = 0; k < threads; k++) {
+                pthread_join(thread_ids[k], NULL);
+                failures += workers[k].failures;
+            }
+            results[w][t] = (double)(operations / threads * threads) / (getTimeSeconds() - start);
+        }
+    }
+    
+    int wrong_chains = checkBillChains();
+    int mismatched = checkRollups();
+    int final_customers = customer_count;
+    int final_bills = ledger_count;
+    clearCustomers();
+    
+    printf("\n===== Concurrent Store Benchmark (%d customers, %d operations per run, %ld CPUs) =====\n",
+           customers, operations, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-18s %-14s %-14s %-14s %-14s %-14s\n", "Workload (Kops/s)", "1 thread", "2 threads",
+           "4 threads", "8 threads", "16 threads");
+    printf("------------------------------------------------------------------------------------------\n");
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        printf("%-18s", workload_names[w]);
+        for (int t = 0; t < 5; t++) {
+            printf(" %-14.1f", results[w][t] / 1e3);
+        }
+        printf("\n");
+    }
+    printf("==========================================================================================\n");
+    printf("Reads: 80%% meter lookups, 20%% bill histories. Mixed: 70%% lookups, 15%% histories,\n");
+    printf("7%% new bills, 7%% payments, 1%% new customers. One lock: the mixed workload with every\n");
+    printf("operation under a single store-wide lock, for comparison.\n");
+    printf("Afterwards: %d customers, %d bills. Lookup misses or torn histories: %lld. Bill chains wrong: %d. "
+           "Roll-up months wrong: %d.\n", final_customers, final_bills, failures, wrong_chains, mismatched);
+}
+
+#ifdef BILL_STATS
+// Histogram buckets split each power of two into four, so percentiles are
+// within a quarter of the true value
+static int getStatBucket(long long ns) {
+    if (ns < 4) {
+        return ns > 0 ? (int)ns : 0;
+    }
+    int exponent = 63 - __builtin_clzll((unsigned long long)ns);
+    return (exponent - 1) * 4 + (int)((ns >> (exponent - 2)) & 3);
+}
+
+// Upper bound of a bucket's range
+static long long getStatBucketLimit(int bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    int exponent = bucket / 4 + 1;
+    return ((long long)(4 + bucket % 4 + 1) << (exponent - 2)) - 1;
+}
+
+void recordStatTime(StatId id, long long elapsed_ns) {
+    OperationStats *stats = &operation_stats[id];
+    stats->timed++;
+    stats->total_ns += elapsed_ns;
+    if (elapsed_ns > stats->max_ns) {
+        stats->max_ns = elapsed_ns;
+    }
+    stats->histogram[getStatBucket(elapsed_ns)]++;
+}
+
+static long long getStatPercentile(const OperationStats *stats, double fraction) {
+    long long rank = (long long)ceil(stats->timed * fraction);
+    long long seen = 0;
+    for (int bucket = 0; bucket < STAT_BUCKETS; bucket++) {
+        seen += stats->histogram[bucket];
+        if (seen >= rank && seen > 0) {
+            long long limit = getStatBucketLimit(bucket);
+            return limit < stats->max_ns ? limit : stats->max_ns;
+        }
+    }
+    return stats->max_ns;
+}
+
+static const char *getStatName(StatId id) {
+    const char *menu_names[MENU_ITEMS] = {
+        "Menu: Add Customer", "Menu: View Customer", "Menu: Generate Bill", "Menu: View Bill",
+        "Menu: Record Payment", "Menu: Payment History", "Menu: Compare Bills", "Menu: Project Bill",
+        "Menu: Usage Alert", "Menu: Update Customer", "Menu: Show Customers", "Menu: Search",
+        "Menu: Report", "Menu: Export", "Menu: Stats"
+    };
+    const char *names[] = {
+        "Menu: Exit or invalid", "Meter lookup", "Rate bill", "Rate batch", "Log append", "Log commit", "Save", "Load", "Server request",
+        "Report: totals", "Report: customers", "Report: billing", "Report: usage", "Report: time of use",
+        "Report: top consumers", "Report: payments", "Report: write"
+    };
+    return id < STAT_MENU_OTHER ? menu_names[id - STAT_MENU] : names[id - STAT_MENU_OTHER];
+}
+
+// Times are in microseconds. Percentiles and means are over the timed calls.
+void printOperationStats() {
+    printf("\n===== Performance Stats =====\n");
+    printf("%-24s %-10s %-10s %-10s %-10s %-10s %-10s %-12s %-10s\n",
+           "Operation", "Count", "Timed", "Mean (us)", "p50 (us)", "p99 (us)", "Max (us)", "Total (ms)", "MB");
+    printf("--------------------------------------------------------------------------------------------------------\n");
+    for (int id = 0; id < STAT_COUNT; id++) {
+        const OperationStats *stats = &operation_stats[id];
+        if (stats->count == 0) {
+            continue;
+        }
+        // Sampled operations are scaled up to estimate their total time
+        double mean_us = stats->timed > 0 ? stats->total_ns / 1e3 / stats->timed : 0;
+        printf("%-24s %-10lld %-10lld %-10.2f %-10.2f %-10.2f %-10.2f %-12.2f %-10.2f\n",
+               getStatName((StatId)id), stats->count, stats->timed, mean_us,
+               getStatPercentile(stats, 0.5) / 1e3, getStatPercentile(stats, 0.99) / 1e3, stats->max_ns / 1e3,
+               mean_us * stats->count / 1e3, stats->bytes / (1024.0 * 1024.0));
+    }
+    printf("========================================================================================================\n");
+    printf("Meter lookups are timed one call in %u and bill rating one in %u.\n",
+           stat_sample_masks[STAT_FIND_METER] + 1, stat_sample_masks[STAT_CALCULATE_BILL] + 1);
+}
+#else
+void printOperationStats() {
+    printf("Performance stats were compiled out (built with -DBILL_NO_STATS).\n");
+}
+#endif
+
+// Server mode: the data stays loaded and clients on a Unix domain socket send
+// one request per line. A single thread serves every connection from an epoll
+// loop, so requests never run concurrently and need no locking.
+//
+// Requests are words separated by spaces; responses are tab-separated fields,
+// the first being OK or ERR (followed by a message):
+//   PING                                  OK
+//   LOOKUP <meter>                        OK id name address phone email type meter plan connected active bills
+//   BILL <meter> <reading> <peak> <off>   OK bill_id date due_date usage amount
+//   PAY <meter> <bill_id> <method...>     OK bill_id payment_date amount
+//   HISTORY <meter> [count]               OK n, then n lines: bill_id date amount paid payment_date method
+//   PROJECT <meter>                       OK usage amount
+//   ALERT <meter>                         OK last_usage average_usage change level peak_percent
+//   REPORT [YYYY-MM]                      OK month customers active bills paid billed collected outstanding usage peak off_peak
+//   QUIT                                  OK, then the connection is closed
+
+typedef struct {
+    int fd;
+    char input[SERVER_REQUEST_MAX];
+    size_t input_used;
+    char *output;
+    size_t output_used;
+    size_t output_sent;
+    size_t output_capacity;
+    int closing;          // close once the output is sent
+    int overlong;         // discarding the rest of a request that was too long
+} ServerClient;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void stopServer(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+static void serverReply(ServerClient *client, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Appends a formatted response to the client's output buffer
+static void serverReply(ServerClient *client, const char *format, ...) {
+    va_list args;
+    while (1) {
+        size_t room = client->output_capacity - client->output_used;
+        va_start(args, format);
+        int length = vsnprintf(client->output + client->output_used, room, format, args);
+        va_end(args);
+        if (length < 0) {
+            return;
+        }
+        if ((size_t)length < room) {
+            client->output_used += length;
             return;
-    }
-    
-    printf("---------------------------------------------------------------\n");
-    printf("Total Results: %d\n", found);
-    
-    if (found > 0) {
-        printf("\nDo you want to view details of any customer? (1-Yes, 0-No): ");
-        int view;
-        scanf("%d", &view);
-        getchar(); // Consume newline
+        }
         
-        if (view == 1) {
-            printf("Enter Customer ID: ");
-            int id;
-            scanf("%d", &id);
-            getchar(); // Consume newline
-            
-            for (int i = 0; i < customer_count; i++) {
-                if (customers[i].customer_id == id) {
-                    displayCustomer(i);
-                    return;
-                }
-            }
-            
-            printf("Customer with ID %d not found!\n", id);
+        size_t capacity = client->output_capacity * 2;
+        while (capacity - client->output_used <= (size_t)length) {
+            capacity *= 2;
         }
+        char *output = realloc(client->output, capacity);
+        if (output == NULL) {
+            client->closing = 1;
+            return;
+        }
+        client->output = output;
+        client->output_capacity = capacity;
     }
 }
-void generateReport() {
-    if (customer_count == 0) {
-        printf("No customers found!\n");
+
+// Text fields are sent with tabs and newlines turned into spaces
+static const char *serverText(const char *text, char *buffer, size_t size) {
+    size_t i = 0;
+    for (; text[i] != '\0' && i < size - 1; i++) {
+        buffer[i] = text[i] == '\t' || text[i] == '\n' || text[i] == '\r' ? ' ' : text[i];
+    }
+    buffer[i] = '\0';
+    return buffer;
+}
+
+static void formatServerDate(DayNumber day, char *buffer) {
+    if (day == NO_DATE) {
+        strcpy(buffer, "-");
         return;
     }
-    
-    Date current_date = getCurrentDate();
-    char report_filename[50];
-    sprintf(report_filename, "report_%02d_%02d_%d.txt", current_date.day, current_date.month, current_date.year);
-    
-    FILE *report_file = fopen(report_filename, "w");
-    if (report_file == NULL) {
-        printf("Error creating report file!\n");
+    // Same YYYY-MM-DD layout as the export
+    Date date = getDateOfDay(day);
+    memcpy(buffer, &digit_pairs[(date.year / 100 % 100) * 2], 2);
+    memcpy(buffer + 2, &digit_pairs[(date.year % 100) * 2], 2);
+    buffer[4] = '-';
+    memcpy(buffer + 5, &digit_pairs[date.month * 2], 2);
+    buffer[7] = '-';
+    memcpy(buffer + 8, &digit_pairs[date.day * 2], 2);
+    buffer[10] = '\0';
+}
+
+static int parseServerNumber(const char *text, float *value) {
+    char *end;
+    if (text == NULL) {
+        return -1;
+    }
+    *value = strtof(text, &end);
+    return end == text || *end != '\0' || *value < 0 ? -1 : 0;
+}
+
+// Finds the customer for a request's meter argument, replying with an error
+// if there is none
+static int findServerCustomer(ServerClient *client, char *meter_number) {
+    if (meter_number == NULL) {
+        serverReply(client, "ERR\tmissing meter number\n");
+        return -1;
+    }
+    int customer_index = findCustomerByMeterNumber(meter_number);
+    if (customer_index == -1) {
+        serverReply(client, "ERR\tunknown meter %s\n", meter_number);
+    }
+    return customer_index;
+}
+
+static void serveLookup(ServerClient *client, char *meter_number) {
+    const char *type_names[] = {"Residential", "Commercial", "Industrial"};
+    int customer_index = findServerCustomer(client, meter_number);
+    if (customer_index == -1) {
+        return;
+    }
+    Customer *c = getCustomer(customer_index);
+    char name[MAX_NAME_LENGTH], address[MAX_ADDRESS_LENGTH], phone[15], email[50], connected[SERVER_DATE_SIZE];
+    formatServerDate(getDayNumber(c->connection_date), connected);
+    serverReply(client, "OK\t%d\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%d\t%d\n",
+                c->customer_id, serverText(c->name, name, sizeof(name)),
+                serverText(c->address, address, sizeof(address)), serverText(c->phone, phone, sizeof(phone)),
+                serverText(c->email, email, sizeof(email)), type_names[c->type], c->meter_number,
+                rate_plans[getCustomerRatePlan(c)].name, connected, c->is_active, c->bill_count);
+}
+
+static void serveBill(ServerClient *client, char *meter_number) {
+    int customer_index = findServerCustomer(client, meter_number);
+    if (customer_index == -1) {
         return;
     }
     
-    // Report header
-    fprintf(report_file, "===============================================\n");
-    fprintf(report_file, "          ELECTRIC BILLING SYSTEM REPORT       \n");
-    fprintf(report_file, "                %02d/%02d/%d                   \n", 
-            current_date.day, current_date.month, current_date.year);
-    fprintf(report_file, "===============================================\n\n");
-    
-    // Customer summary
-    fprintf(report_file, "CUSTOMER SUMMARY\n");
-    fprintf(report_file, "-----------------\n");
-    fprintf(report_file, "Total Customers: %d\n", customer_count);
-    
-    int active_customers = 0;
-    int residential = 0, commercial = 0, industrial = 0;
-    
-    for (int i = 0; i < customer_count; i++) {
-        if (customers[i].is_active)
-            active_customers++;
-        
-        switch (customers[i].type) {
-            case RESIDENTIAL: residential++; break;
-            case COMMERCIAL: commercial++; break;
-            case INDUSTRIAL: industrial++; break;
+    float values[3];
+    for (int i = 0; i < 3; i++) {
+        if (parseServerNumber(strtok(NULL, " "), &values[i]) != 0) {
+            serverReply(client, "ERR\texpected reading, peak usage and off-peak usage\n");
+            return;
         }
     }
     
-    fprintf(report_file, "Active Customers: %d (%.1f%%)\n", 
-            active_customers, (float)active_customers / customer_count * 100);
-    fprintf(report_file, "Inactive Customers: %d (%.1f%%)\n", 
-            customer_count - active_customers, (float)(customer_count - active_customers) / customer_count * 100);
-    fprintf(report_file, "Customer Types:\n");
-    fprintf(report_file, "  - Residential: %d (%.1f%%)\n", 
-            residential, (float)residential / customer_count * 100);
-    fprintf(report_file, "  - Commercial: %d (%.1f%%)\n", 
-            commercial, (float)commercial / customer_count * 100);
-    fprintf(report_file, "  - Industrial: %d (%.1f%%)\n\n", 
-            industrial, (float)industrial / customer_count * 100);
-    
-    // Billing summary for current month
-    fprintf(report_file, "BILLING SUMMARY FOR %02d/%d\n", current_date.month, current_date.year);
-    fprintf(report_file, "------------------------\n");
+    Customer *c = getCustomer(customer_index);
+    if (c->last_bill != -1 && values[0] < BILL_FIELD(c->last_bill, meter_reading_end)) {
+        serverReply(client, "ERR\treading is below the previous reading %.2f\n",
+                    BILL_FIELD(c->last_bill, meter_reading_end));
+        return;
+    }
     
-    int bills_generated = 0;
-    int bills_paid = 0;
-    float total_billed_amount = 0;
-    float total_collected_amount = 0;
-    float total_outstanding_amount = 0;
-    float total_usage = 0;
+    TimeOfUseUsage tou_usage = {values[1], values[2]};
+    if (createBill(customer_index, values[0], tou_usage) == -1) {
+        serverReply(client, "ERR\tbill storage is full\n");
+        return;
+    }
+    int row = c->last_bill;
+    logBill(row);
     
-    for (int i = 0; i < customer_count; i++) {
-        for (int j = 0; j < customers[i].bill_count; j++) {
-            BillingInfo bill = customers[i].billing_history[j];
-            
-            // Check if the bill is from current month
-            if (bill.bill_date.month == current_date.month && 
-                bill.bill_date.year == current_date.year) {
-                
-                bills_generated++;
-                total_billed_amount += bill.amount;
-                total_usage += bill.total_usage;
-                
-                if (bill.is_paid) {
-                    bills_paid++;
-                    total_collected_amount += bill.amount;
-                } else {
-                    total_outstanding_amount += bill.amount;
-                }
-            }
-        }
+    char bill_date[SERVER_DATE_SIZE], due_date[SERVER_DATE_SIZE];
+    formatServerDate(BILL_FIELD(row, bill_date), bill_date);
+    formatServerDate(BILL_FIELD(row, due_date), due_date);
+    serverReply(client, "OK\t%d\t%s\t%s\t%.2f\t%.2f\n", BILL_FIELD(row, bill_id), bill_date, due_date,
+                BILL_FIELD(row, total_usage), moneyToUnits(BILL_FIELD(row, amount)));
+}
+
+static void servePayment(ServerClient *client, char *meter_number) {
+    int customer_index = findServerCustomer(client, meter_number);
+    if (customer_index == -1) {
+        return;
     }
     
-    fprintf(report_file, "Bills Generated: %d\n", bills_generated);
-    fprintf(report_file, "Bills Paid: %d (%.1f%%)\n", 
-            bills_paid, bills_generated > 0 ? (float)bills_paid / bills_generated * 100 : 0);
-    fprintf(report_file, "Bills Unpaid: %d (%.1f%%)\n", 
-            bills_generated - bills_paid, 
-            bills_generated > 0 ? (float)(bills_generated - bills_paid) / bills_generated * 100 : 0);
-    fprintf(report_file, "Total Billed Amount: $%.2f\n", total_billed_amount);
-    fprintf(report_file, "Total Collected Amount: $%.2f (%.1f%%)\n", 
-            total_collected_amount, 
-            total_billed_amount > 0 ? total_collected_amount / total_billed_amount * 100 : 0);
-    fprintf(report_file, "Total Outstanding Amount: $%.2f (%.1f%%)\n", 
-            total_outstanding_amount, 
-            total_billed_amount > 0 ? total_outstanding_amount / total_billed_amount * 100 : 0);
-    fprintf(report_file, "Total Energy Usage: %.2f units\n\n", total_usage);
+    char *bill_id_text = strtok(NULL, " ");
+    char *method = strtok(NULL, ""); // The rest of the line
+    if (bill_id_text == NULL || method == NULL || method[0] == '\0') {
+        serverReply(client, "ERR\texpected bill ID and payment method\n");
+        return;
+    }
+    int bill_id = atoi(bill_id_text);
     
-    // Usage by customer type
-    fprintf(report_file, "USAGE BY CUSTOMER TYPE\n");
-    fprintf(report_file, "---------------------\n");
+    int row = findBillById(bill_id);
+    if (row == -1 || BILL_FIELD(row, customer_index) != customer_index) {
+        serverReply(client, "ERR\tunknown bill %s for meter %s\n", bill_id_text, meter_number);
+        return;
+    }
+    if (BILL_FIELD(row, is_paid)) {
+        serverReply(client, "ERR\tbill %d is already paid\n", bill_id);
+        return;
+    }
     
-    float residential_usage = 0, commercial_usage = 0, industrial_usage = 0;
-    float residential_amount = 0, commercial_amount = 0, industrial_amount = 0;
+    char method_text[20];
+    markBillPaid(row, serverText(method, method_text, sizeof(method_text)));
+    char payment_date[SERVER_DATE_SIZE];
+    formatServerDate(BILL_FIELD(row, payment_date), payment_date);
+    serverReply(client, "OK\t%d\t%s\t%.2f\n", bill_id, payment_date, moneyToUnits(BILL_FIELD(row, amount)));
+}
+
+static void serveHistory(ServerClient *client, char *meter_number) {
+    int customer_index = findServerCustomer(client, meter_number);
+    if (customer_index == -1) {
+        return;
+    }
     
-    for (int i = 0; i < customer_count; i++) {
-        for (int j = 0; j < customers[i].bill_count; j++) {
-            BillingInfo bill = customers[i].billing_history[j];
-            
-            // Check if the bill is from current month
-            if (bill.bill_date.month == current_date.month && 
-                bill.bill_date.year == current_date.year) {
-                
-                switch (customers[i].type) {
-                    case RESIDENTIAL:
-                        residential_usage += bill.total_usage;
-                        residential_amount += bill.amount;
-                        break;
-                    case COMMERCIAL:
-                        commercial_usage += bill.total_usage;
-                        commercial_amount += bill.amount;
-                        break;
-                    case INDUSTRIAL:
-                        industrial_usage += bill.total_usage;
-                        industrial_amount += bill.amount;
-                        break;
-                }
-            }
+    // The most recent bills, oldest first; all of them by default
+    Customer *c = getCustomer(customer_index);
+    char *count_text = strtok(NULL, " ");
+    int count = c->bill_count;
+    if (count_text != NULL) {
+        char *end;
+        long requested = strtol(count_text, &end, 10);
+        if (end == count_text || *end != '\0' || requested < 0) {
+            serverReply(client, "ERR\tinvalid count\n");
+            return;
+        }
+        if (requested < count) {
+            count = (int)requested;
         }
     }
     
-    fprintf(report_file, "Residential:\n");
-    fprintf(report_file, "  - Usage: %.2f units (%.1f%%)\n", 
-            residential_usage, 
-            total_usage > 0 ? residential_usage / total_usage * 100 : 0);
-    fprintf(report_file, "  - Amount: $%.2f (%.1f%%)\n", 
-            residential_amount, 
-            total_billed_amount > 0 ? residential_amount / total_billed_amount * 100 : 0);
-    
-    fprintf(report_file, "Commercial:\n");
-    fprintf(report_file, "  - Usage: %.2f units (%.1f%%)\n", 
-            commercial_usage, 
-            total_usage > 0 ? commercial_usage / total_usage * 100 : 0);
-    fprintf(report_file, "  - Amount: $%.2f (%.1f%%)\n", 
-            commercial_amount, 
-            total_billed_amount > 0 ? commercial_amount / total_billed_amount * 100 : 0);
-    
-    fprintf(report_file, "Industrial:\n");
-    fprintf(report_file, "  - Usage: %.2f units (%.1f%%)\n", 
-            industrial_usage, 
-            total_usage > 0 ? industrial_usage / total_usage * 100 : 0);
-    fprintf(report_file, "  - Amount: $%.2f (%.1f%%)\n\n", 
-            industrial_amount, 
-            total_billed_amount > 0 ? industrial_amount / total_billed_amount * 100 : 0);
-    
-    // Time of use analysis
-    fprintf(report_file, "TIME OF USE ANALYSIS\n");
-    fprintf(report_file, "-------------------\n");
-    
-    float peak_usage = 0, off_peak_usage = 0;
+    int *rows = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (rows == NULL) {
+        serverReply(client, "ERR\tout of memory\n");
+        return;
+    }
+    count = collectRecentBills(customer_index, rows, count);
     
-    for (int i = 0; i < customer_count; i++) {
-        for (int j = 0; j < customers[i].bill_count; j++) {
-            BillingInfo bill = customers[i].billing_history[j];
-            
-            // Check if the bill is from current month
-            if (bill.bill_date.month == current_date.month && 
-                bill.bill_date.year == current_date.year) {
-                
-                peak_usage += bill.tou_usage.peak_hours;
-                off_peak_usage += bill.tou_usage.off_peak_hours;
-            }
+    serverReply(client, "OK\t%d\n", count);
+    for (int i = 0; i < count; i++) {
+        int row = rows[i];
+        char bill_date[SERVER_DATE_SIZE], payment_date[SERVER_DATE_SIZE], method[20];
+        formatServerDate(BILL_FIELD(row, bill_date), bill_date);
+        formatServerDate(BILL_FIELD(row, is_paid) ? BILL_FIELD(row, payment_date) : NO_DATE, payment_date);
+        serverReply(client, "%d\t%s\t%.2f\t%d\t%s\t%s\n", BILL_FIELD(row, bill_id), bill_date,
+                    moneyToUnits(BILL_FIELD(row, amount)), BILL_FIELD(row, is_paid), payment_date,
+                    BILL_FIELD(row, is_paid) ? serverText(BILL_FIELD(row, payment_method), method, sizeof(method)) : "-");
+    }
+    free(rows);
+}
+
+static void serveProjection(ServerClient *client, char *meter_number) {
+    int customer_index = findServerCustomer(client, meter_number);
+    if (customer_index == -1) {
+        return;
+    }
+    float projected_usage;
+    Money projected_amount;
+    if (getBillProjection(customer_index, &projected_usage, &projected_amount) != 0) {
+        serverReply(client, "ERR\tno bills to project from\n");
+        return;
+    }
+    serverReply(client, "OK\t%.2f\t%.2f\n", projected_usage, moneyToUnits(projected_amount));
+}
+
+static void serveAlert(ServerClient *client, char *meter_number) {
+    int customer_index = findServerCustomer(client, meter_number);
+    if (customer_index == -1) {
+        return;
+    }
+    UsageAlert alert;
+    if (getUsageAlert(customer_index, &alert) != 0) {
+        serverReply(client, "ERR\tno bills to analyse\n");
+        return;
+    }
+    serverReply(client, "OK\t%.2f\t%.2f\t%.2f\t%s\t%.2f\n", alert.last_usage, alert.average_usage,
+                alert.monthly_change, alert.level > 0 ? "high" : alert.level < 0 ? "low" : "normal",
+                alert.peak_percentage);
+}
+
+static void serveReport(ServerClient *client, char *month_text) {
+    Date report_date = getCurrentDate();
+    if (month_text != NULL) {
+        int year, month;
+        char extra;
+        if (sscanf(month_text, "%d-%d%c", &year, &month, &extra) != 2 || month < 1 || month > 12) {
+            serverReply(client, "ERR\texpected month as YYYY-MM\n");
+            return;
         }
+        report_date.year = year;
+        report_date.month = month;
+        report_date.day = 1;
     }
     
-    fprintf(report_file, "Peak Hours Usage (2pm-8pm): %.2f units (%.1f%%)\n", 
-            peak_usage, 
-            total_usage > 0 ? peak_usage / total_usage * 100 : 0);
-    fprintf(report_file, "Off-Peak Hours Usage (8pm-2pm): %.2f units (%.1f%%)\n\n", 
-            off_peak_usage, 
-            total_usage > 0 ? off_peak_usage / total_usage * 100 : 0);
-    
-    // Top consumers
-    fprintf(report_file, "TOP 5 CONSUMERS\n");
-    fprintf(report_file, "-------------\n");
-    
-    typedef struct {
-        int customer_index;
-        float usage;
-        float amount;
-    } ConsumerRanking;
-    
-    ConsumerRanking rankings[MAX_CUSTOMERS] = {0};
-    int ranking_count = 0;
+    ReportTotals totals;
+    if (getRollupReport(report_date, &totals) != 0) {
+        serverReply(client, "ERR\tout of memory\n");
+        return;
+    }
+    serverReply(client, "OK\t%04d-%02d\t%d\t%d\t%d\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",
+                report_date.year, report_date.month, customer_count, totals.active_customers,
+                totals.bills_generated, totals.bills_paid, moneyToUnits(totals.total_billed_amount),
+                moneyToUnits(totals.total_collected_amount), moneyToUnits(totals.total_outstanding_amount),
+                totals.total_usage, totals.peak_usage, totals.off_peak_usage);
+    freeTopConsumers(&totals.top_consumers);
+}
+
+static void handleServerRequest(ServerClient *client, char *line) {
+    STAT_BEGIN(request_start, STAT_SERVER_REQUEST);
+    char *command = strtok(line, " ");
+    char *argument = strtok(NULL, " ");
     
-    for (int i = 0; i < customer_count; i++) {
-        float monthly_usage = 0;
-        float monthly_amount = 0;
+    if (command == NULL) {
+        serverReply(client, "ERR\tempty request\n");
+    } else if (strcmp(command, "LOOKUP") == 0) {
+        serveLookup(client, argument);
+    } else if (strcmp(command, "BILL") == 0) {
+        serveBill(client, argument);
+    } else if (strcmp(command, "PAY") == 0) {
+        servePayment(client, argument);
+    } else if (strcmp(command, "HISTORY") == 0) {
+        serveHistory(client, argument);
+    } else if (strcmp(command, "PROJECT") == 0) {
+        serveProjection(client, argument);
+    } else if (strcmp(command, "ALERT") == 0) {
+        serveAlert(client, argument);
+    } else if (strcmp(command, "REPORT") == 0) {
+        serveReport(client, argument);
+    } else if (strcmp(command, "PING") == 0) {
+        serverReply(client, "OK\n");
+    } else if (strcmp(command, "QUIT") == 0) {
+        serverReply(client, "OK\n");
+        client->closing = 1;
+    } else {
+        serverReply(client, "ERR\tunknown command %s\n", command);
+    }
+    STAT_END(request_start, STAT_SERVER_REQUEST, 0);
+}
+
+// Sends as much pending output as the socket takes. Returns -1 if the
+// connection failed.
+static int flushServerClient(ServerClient *client) {
+    while (client->output_sent < client->output_used) {
+        ssize_t n = send(client->fd, client->output + client->output_sent,
+                         client->output_used - client->output_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        client->output_sent += n;
+    }
+    client->output_used = client->output_sent = 0;
+    return 0;
+}
+
+// A client that is not reading its answers gets no more until it catches up
+static inline int isServerOutputFull(const ServerClient *client) {
+    return client->output_used >= SERVER_OUTPUT_MAX;
+}
+
+// Answers the complete request lines the client has sent, then reads more.
+// Requests wait while too much output is queued. Returns -1 once the
+// connection should be closed.
+static int readServerClient(ServerClient *client) {
+    while (1) {
+        // Answer each complete line in order
+        size_t start = 0;
+        char *newline;
+        while (!client->closing && !isServerOutputFull(client) &&
+               (newline = memchr(client->input + start, '\n', client->input_used - start)) != NULL) {
+            *newline = '\0';
+            if (newline > client->input + start && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+            if (client->overlong) {
+                client->overlong = 0;
+            } else {
+                handleServerRequest(client, client->input + start);
+            }
+            start = newline + 1 - client->input;
+        }
+        memmove(client->input, client->input + start, client->input_used - start);
+        client->input_used -= start;
         
-        for (int j = 0; j < customers[i].bill_count; j++) {
-            BillingInfo bill = customers[i].billing_history[j];
-            
-            // Check if the bill is from current month
-            if (bill.bill_date.month == current_date.month && 
-                bill.bill_date.year == current_date.year) {
-                
-                monthly_usage += bill.total_usage;
-                monthly_amount += bill.amount;
+        // A full buffer without a newline is a request that is too long
+        if (client->input_used == SERVER_REQUEST_MAX && memchr(client->input, '\n', client->input_used) == NULL) {
+            if (!client->overlong) {
+                serverReply(client, "ERR\trequest too long\n");
             }
+            client->overlong = 1;
+            client->input_used = 0;
         }
         
-        if (monthly_usage > 0) {
-            rankings[ranking_count].customer_index = i;
-            rankings[ranking_count].usage = monthly_usage;
-            rankings[ranking_count].amount = monthly_amount;
-            ranking_count++;
+        if (client->closing || isServerOutputFull(client)) {
+            return 0;
+        }
+        ssize_t n = recv(client->fd, client->input + client->input_used,
+                         SERVER_REQUEST_MAX - client->input_used, 0);
+        if (n == 0) {
+            // The client has finished sending; what it is owed is still sent
+            client->closing = 1;
+            return 0;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
+        client->input_used += n;
     }
-    
-    // Sort rankings by usage
-    for (int i = 0; i < ranking_count - 1; i++) {
-        for (int j = 0; j < ranking_count - i - 1; j++) {
-            if (rankings[j].usage < rankings[j + 1].usage) {
-                ConsumerRanking temp = rankings[j];
-                rankings[j] = rankings[j + 1];
-                rankings[j + 1] = temp;
-            }
+}
+
+static void closeServerClient(ServerClient *client) {
+    close(client->fd);
+    free(client->output);
+    free(client);
+}
+
+static void acceptServerClients(int listen_fd, int epoll_fd) {
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            return; // No more pending connections (or a transient error)
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        
+        ServerClient *client = calloc(1, sizeof(ServerClient));
+        char *output = malloc(SERVER_REQUEST_MAX);
+        if (client == NULL || output == NULL) {
+            free(client);
+            free(output);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->output = output;
+        client->output_capacity = SERVER_REQUEST_MAX;
+        
+        struct epoll_event event = {EPOLLIN | EPOLLRDHUP, {.ptr = client}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            closeServerClient(client);
         }
     }
+}
+
+// --serve <socket path>: answers requests until interrupted, then saves.
+// Returns 0 after a clean shutdown, -1 if the socket could not be set up.
+int runServer(const char *socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path %s is too long!\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
     
-    // Print top 5 (or less if there are fewer customers)
-    int top_count = ranking_count < 5 ? ranking_count : 5;
-    
-    fprintf(report_file, "%-5s %-20s %-15s %-15s %-15s\n", 
-            "Rank", "Customer Name", "Meter Number", "Usage (units)", "Amount ($)");
-    fprintf(report_file, "----------------------------------------------------------------------\n");
-    
-    for (int i = 0; i < top_count; i++) {
-        int idx = rankings[i].customer_index;
-        fprintf(report_file, "%-5d %-20s %-15s %-15.2f %-15.2f\n", 
-                i + 1, 
-                customers[idx].name, 
-                customers[idx].meter_number, 
-                rankings[i].usage, 
-                rankings[i].amount);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        printf("Error creating socket!\n");
+        return -1;
     }
-    fprintf(report_file, "\n");
+    unlink(socket_path); // A socket file left behind by a previous run
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        printf("Error listening on %s!\n", socket_path);
+        close(listen_fd);
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
     
-    // Payment methods analysis (for paid bills in current month)
-    fprintf(report_file, "PAYMENT METHODS ANALYSIS\n");
-    fprintf(report_file, "-----------------------\n");
+    int epoll_fd = epoll_create1(0);
+    struct epoll_event listen_event = {EPOLLIN, {.ptr = NULL}};
+    if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) != 0) {
+        printf("Error setting up the event loop!\n");
+        close(listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
     
-    typedef struct {
-        char method[20];
-        int count;
-        float amount;
-    } PaymentMethodStats;
+    // Stop cleanly on Ctrl-C or kill, so the data is saved
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
     
-    PaymentMethodStats payment_stats[10] = {0}; // Assuming max 10 different payment methods
-    int payment_methods_count = 0;
+    printf("Serving %d customers on %s\n", customer_count, socket_path);
+    fflush(stdout);
     
-    for (int i = 0; i < customer_count; i++) {
-        for (int j = 0; j < customers[i].bill_count; j++) {
-            BillingInfo bill = customers[i].billing_history[j];
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (!server_stopping) {
+        int count = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        for (int e = 0; e < count; e++) {
+            ServerClient *client = events[e].data.ptr;
+            if (client == NULL) {
+                acceptServerClients(listen_fd, epoll_fd);
+                continue;
+            }
             
-            // Check if the bill is paid and from current month
-            if (bill.is_paid && 
-                bill.payment_date.month == current_date.month && 
-                bill.payment_date.year == current_date.year) {
-                
-                // Check if payment method already exists in stats
-                int found = 0;
-                for (int k = 0; k < payment_methods_count; k++) {
-                    if (strcmp(payment_stats[k].method, bill.payment_method) == 0) {
-                        payment_stats[k].count++;
-                        payment_stats[k].amount += bill.amount;
-                        found = 1;
-                        break;
-                    }
-                }
-                
-                // If payment method not found, add it
-                if (!found) {
-                    strcpy(payment_stats[payment_methods_count].method, bill.payment_method);
-                    payment_stats[payment_methods_count].count = 1;
-                    payment_stats[payment_methods_count].amount = bill.amount;
-                    payment_methods_count++;
-                }
+            // Output sent first makes room for requests that were waiting
+            int failed = flushServerClient(client) != 0;
+            if (!failed) {
+                failed = readServerClient(client) != 0;
+            }
+            if (!failed) {
+                failed = flushServerClient(client) != 0;
+            }
+            
+            // Wait for room in the socket only while output is pending, and
+            // for requests only while there is room for their answers
+            int pending = client->output_used > client->output_sent;
+            if (failed || (client->closing && !pending)) {
+                closeServerClient(client); // Closing the socket also removes it from epoll
+                continue;
             }
+            int reading = !client->closing && !isServerOutputFull(client);
+            struct epoll_event event = {(pending ? EPOLLOUT : 0) | (reading ? EPOLLIN | EPOLLRDHUP : 0),
+                                        {.ptr = client}};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
         }
     }
     
-    fprintf(report_file, "%-20s %-10s %-15s %-10s\n", 
-            "Payment Method", "Count", "Amount ($)", "Percentage");
-    fprintf(report_file, "------------------------------------------------------\n");
-    
-    for (int i = 0; i < payment_methods_count; i++) {
-        fprintf(report_file, "%-20s %-10d %-15.2f %-10.1f%%\n", 
-                payment_stats[i].method, 
-                payment_stats[i].count, 
-                payment_stats[i].amount,
-                total_collected_amount > 0 ? payment_stats[i].amount / total_collected_amount * 100 : 0);
-    }
-    
-    fprintf(report_file, "\n");
-    fprintf(report_file, "===============================================\n");
-    fprintf(report_file, "               END OF REPORT                   \n");
-    fprintf(report_file, "===============================================\n");
-    
-    fclose(report_file);
-    
-    printf("Report generated successfully! Saved as %s\n", report_filename);
-}
\ No newline at end of file
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    printf("Server stopped.\n");
+    saveData();
+    return 0;
+}